@@ -445,11 +445,133 @@ void get_password(char *password, size_t max_len)
 
 char auth_buf[256];
 
+/* READAHEAD=COUNT[,SIZE] and WRITEBEHIND=COUNT[,SIZE] */
+#define BUFFER_COUNT            4
+#define BUFFER_SIZE             1024
+#define BUFFER_SIZE_MIN         128
+#define BUFFER_SIZE_MAX         4096
+
+/* Returns the value of a NAME or NAME=VALUE argument, or NULL if arg
+   is some other option */
+const char *option_value(const char *arg, const char *name)
+{
+  int len = strlen(name);
+
+
+  if (strncasecmp(arg, name, len))
+    return NULL;
+  if (!arg[len])
+    return "";
+  if (arg[len] != '=')
+    return NULL;
+  return &arg[len + 1];
+}
+
+/* Allocate the buffers an option asks for. They go in their own DOS
+   memory block, anything past the end of our data segment is given
+   back when we go resident. Returns the segment, or 0 if there are no
+   buffers. */
+unsigned setup_buffers(const char *opt, const char *what, uint16_t max,
+                       uint16_t *count, uint16_t *size)
+{
+  unsigned seg;
+  const char *comma;
+
+
+  *count = BUFFER_COUNT;
+  *size = BUFFER_SIZE;
+  if (opt && *opt) {
+    *count = atoi(opt);
+    comma = strchr(opt, ',');
+    if (comma)
+      *size = atoi(comma + 1);
+  }
+  if (*count > max)
+    *count = max;
+  if (*size < BUFFER_SIZE_MIN)
+    *size = BUFFER_SIZE_MIN;
+  if (*size > BUFFER_SIZE_MAX)
+    *size = BUFFER_SIZE_MAX;
+  *size = (*size + 15) & ~15;
+
+  if (!*count)
+    return 0;
+  if (_dos_allocmem(*count * (*size >> 4), &seg)) {
+    printf("Not enough memory for %s buffers\n", what);
+    return 0;
+  }
+  return seg;
+}
+
+void setup_readahead(const char *opt)
+{
+  uint16_t count, size;
+  unsigned seg;
+  int idx;
+
+
+  seg = setup_buffers(opt, "read-ahead", READAHEAD_MAX, &count, &size);
+  if (!seg)
+    return;
+
+  for (idx = 0; idx < count; idx++)
+    readahead[idx].data = MK_FP(seg, idx * size);
+  readahead_count = count;
+  readahead_size = size;
+  return;
+}
+
+void setup_writebehind(const char *opt)
+{
+  uint16_t count, size;
+  unsigned seg;
+  int idx;
+
+
+  seg = setup_buffers(opt, "write-behind", WRITEBEHIND_MAX, &count, &size);
+  if (!seg)
+    return;
+
+  for (idx = 0; idx < count; idx++)
+    writebehind[idx].data = MK_FP(seg, idx * size);
+  writebehind_count = count;
+  writebehind_size = size;
+  return;
+}
+
+/* DIRCACHE=ENTRIES - names fujifs_stat keeps from directory listings,
+   22 bytes each */
+#define DIRCACHE_DEFAULT        512
+#define DIRCACHE_MAX            2048
+#define DIRCACHE_ENTRY          22
+void setup_dircache(const char *opt)
+{
+  uint16_t count = DIRCACHE_DEFAULT;
+  unsigned seg;
+
+
+  if (opt && *opt)
+    count = atoi(opt);
+  if (count > DIRCACHE_MAX)
+    count = DIRCACHE_MAX;
+  if (!count)
+    return;
+
+  if (_dos_allocmem((count * DIRCACHE_ENTRY + 15) >> 4, &seg)) {
+    printf("Not enough memory for the directory cache\n");
+    return;
+  }
+  fujifs_dircache(MK_FP(seg, 0), count * DIRCACHE_ENTRY);
+  return;
+}
+
 int _cdecl main(uint16_t argc, char **argv)
 {
   uint8_t drive_letter;
-  const char *url;
+  const char *url, *readahead_opt = NULL, *writebehind_opt = NULL, *dircache_opt = NULL;
+  const char *value;
   errcode err;
+  int idx;
 
 
   printf("FNSHARE version %s\n", VERSION);
@@ -461,10 +583,24 @@ int _cdecl main(uint16_t argc, char **argv)
 
   // Only support map command at this time
   if (strcasecmp(argv[1], "map") != 0 || argc < 4) {
-    printf("Usage: %s map L: <url_of_share>\n", argv[0]);
+    printf("Usage: %s map L: <url_of_share> [READAHEAD=count[,size]]"
+           " [WRITEBEHIND=count[,size]] [DIRCACHE=entries]\n", argv[0]);
     exit(1);
   }
 
+  for (idx = 4; idx < argc; idx++) {
+    if ((value = option_value(argv[idx], "READAHEAD")))
+      readahead_opt = value;
+    else if ((value = option_value(argv[idx], "WRITEBEHIND")))
+      writebehind_opt = value;
+    else if ((value = option_value(argv[idx], "DIRCACHE")))
+      dircache_opt = value;
+    else {
+      printf("Unknown option: %s\n", argv[idx]);
+      exit(1);
+    }
+  }
+
   drive_letter = toupper(argv[2][0]);
   fn_drive_num = drive_letter - 'A';
   url = argv[3];
@@ -504,6 +640,9 @@ int _cdecl main(uint16_t argc, char **argv)
   get_dos_vars();
   set_up_cds();
   set_up_pointers();
+  setup_readahead(readahead_opt);
+  setup_writebehind(writebehind_opt);
+  setup_dircache(dircache_opt);
 
   // Tell the user
   printf("FujiNet installed as %c:\n", fn_drive_num + 'A');
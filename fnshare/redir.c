@@ -16,6 +16,22 @@
 
 #define STACK_SIZE 1024
 
+/* Paths that were looked for recently and weren't there. With the
+   drive on PATH every command typed makes DOS try NAME.COM, NAME.EXE
+   and NAME.BAT here, so remember the misses for a little while. */
+#define MISS_ENTRIES            16
+#define MISS_PATHLEN            64
+#define MISS_TTL                (18 * 2)
+#define MISS_STAT               0xFF    // Looked up by stat_path, not a search
+#define BIOS_TICKS              (*(volatile uint32_t far *) MK_FP(0x40, 0x6C))
+
+typedef struct {
+  uint32_t when;                // BIOS tick count, entry unused if path is empty
+  uint8_t attr;                 // Search attributes or MISS_STAT
+  uint8_t dir_len;              // Length of the directory part of path
+  char path[MISS_PATHLEN];
+} MISS_ENTRY;
+
 ALL_REGS r;                     /* Global save area for all caller's regs */
 uint8_t fn_drive_num;                           /* A: is 1, B: is 2, etc. */
 fujifs_handle fn_host;
@@ -36,6 +52,15 @@ uint16_t dos_sp;                    /* DOS's saved SP at entry */
 uint16_t our_sp;                    /* SP to switch to on entry */
 uint16_t save_sp;                   /* SP saved across internal DOS calls */
 char our_stack[STACK_SIZE];     /* our internal stack */
+static MISS_ENTRY miss_cache[MISS_ENTRIES];
+static uint8_t miss_next;       /* Oldest entry, replaced next */
+READAHEAD readahead[READAHEAD_MAX];
+uint8_t readahead_count;
+uint16_t readahead_size;
+static uint16_t readahead_clock;
+WRITEBEHIND writebehind[WRITEBEHIND_MAX];
+uint8_t writebehind_count;
+uint16_t writebehind_size;
 
 /* these are version independent pointers to various frequently used
         locations within the various DOS structures */
@@ -175,6 +200,238 @@ char *path_with_volume(char far *path)
   return temp_path;
 }
 
+static uint8_t dir_length(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+
+
+  return slash ? slash - path : 0;
+}
+
+/* True if path was looked for with the same search attributes and
+   not found a moment ago */
+int miss_cached(const char *path, uint8_t attr)
+{
+  MISS_ENTRY *miss;
+  int idx;
+
+
+  for (idx = 0; idx < MISS_ENTRIES; idx++) {
+    miss = &miss_cache[idx];
+    if (miss->path[0] && miss->attr == attr && !strcmp(miss->path, path)) {
+      if (BIOS_TICKS - miss->when < MISS_TTL)
+        return 1;
+      miss->path[0] = 0;
+    }
+  }
+  return 0;
+}
+
+void miss_record(const char *path, uint8_t attr)
+{
+  MISS_ENTRY *miss;
+
+
+  if (strlen(path) >= MISS_PATHLEN)
+    return;
+
+  miss = &miss_cache[miss_next];
+  miss_next = (miss_next + 1) % MISS_ENTRIES;
+  strcpy(miss->path, path);
+  miss->attr = attr;
+  miss->dir_len = dir_length(path);
+  miss->when = BIOS_TICKS;
+  return;
+}
+
+/* fujifs_stat, but answered from the miss cache when it can be */
+errcode stat_path(const char *path, FN_DIRENT *entry)
+{
+  errcode err;
+
+
+  if (miss_cached(path, MISS_STAT))
+    return NETWORK_ERROR_FILE_NOT_FOUND;
+
+  err = fujifs_stat(fn_host, path, entry);
+  if (err == NETWORK_ERROR_FILE_NOT_FOUND)
+    miss_record(path, MISS_STAT);
+  return err;
+}
+
+/* Something was created in the directory path is in, forget what
+   wasn't there before */
+void forget_misses(const char *path)
+{
+  MISS_ENTRY *miss;
+  uint8_t len = dir_length(path);
+  int idx;
+
+
+  for (idx = 0; idx < MISS_ENTRIES; idx++) {
+    miss = &miss_cache[idx];
+    if (miss->dir_len == len && !strncmp(miss->path, path, len))
+      miss->path[0] = 0;
+  }
+  return;
+}
+
+/* Forget what was read ahead for a file */
+void readahead_discard(fujifs_handle handle)
+{
+  int idx;
+
+
+  for (idx = 0; idx < readahead_count; idx++)
+    if (readahead[idx].handle == handle)
+      readahead[idx].handle = 0;
+  return;
+}
+
+/* Serve a small read from the file's buffer, filling it with a read
+   of readahead_size whenever the position isn't in it. Returns the
+   number of bytes read. */
+uint16_t read_buffered(SFTREC_PTR sft, uint8_t far *dta, uint16_t length)
+{
+  READAHEAD *ra = NULL;
+  uint16_t done, chunk;
+  uint32_t fill;
+  int idx;
+
+
+  for (idx = 0; idx < readahead_count; idx++)
+    if (readahead[idx].handle == sft->file_handle)
+      ra = &readahead[idx];
+
+  // Take over the buffer that was read from longest ago
+  if (!ra) {
+    ra = &readahead[0];
+    for (idx = 0; idx < readahead_count; idx++) {
+      if (!readahead[idx].handle) {
+        ra = &readahead[idx];
+        break;
+      }
+      if ((uint16_t) (readahead_clock - readahead[idx].used)
+          > (uint16_t) (readahead_clock - ra->used))
+        ra = &readahead[idx];
+    }
+    ra->handle = sft->file_handle;
+    ra->length = 0;
+  }
+  ra->used = ++readahead_clock;
+
+  for (done = 0; done < length; done += chunk) {
+    if (sft->pos < ra->pos || sft->pos >= ra->pos + ra->length) {
+      if (sft->pos != sft->last_pos)
+        fujifs_seek(sft->file_handle, sft->pos); // FIXME - check error
+      fill = sft->size - sft->pos;
+      if (fill > readahead_size)
+        fill = readahead_size;
+      ra->pos = sft->pos;
+      ra->length = fujifs_read(sft->file_handle, ra->data, fill);
+      sft->last_pos = sft->pos + ra->length;
+      if (!ra->length)
+        break;
+    }
+
+    chunk = ra->pos + ra->length - sft->pos;
+    if (chunk > length - done)
+      chunk = length - done;
+    _fmemcpy(&dta[done], &ra->data[sft->pos - ra->pos], chunk);
+    sft->pos += chunk;
+  }
+
+  return done;
+}
+
+/* Find the write-behind buffer a file is using, or NULL */
+WRITEBEHIND *writebehind_find(fujifs_handle handle)
+{
+  int idx;
+
+
+  for (idx = 0; idx < writebehind_count; idx++)
+    if (writebehind[idx].handle == handle)
+      return &writebehind[idx];
+  return NULL;
+}
+
+/* Give up a file's write-behind buffer without writing it */
+void writebehind_discard(fujifs_handle handle)
+{
+  WRITEBEHIND *wb = writebehind_find(handle);
+
+
+  if (wb)
+    wb->handle = 0;
+  return;
+}
+
+/* Write out whatever a file has waiting. Errors from writes DOS was
+   already told had succeeded come back as a DOS error code here, so
+   the call that caused the flush can fail with it. */
+uint16_t writebehind_flush(SFTREC_PTR sft)
+{
+  WRITEBEHIND *wb = writebehind_find(sft->file_handle);
+  uint16_t length;
+
+
+  if (!wb || !wb->length)
+    return DOSERR_NONE;
+
+  length = wb->length;
+  wb->length = 0;
+  if (fujifs_write(sft->file_handle, wb->data, length) != length) {
+    // Don't know where the server left off, make the next access seek
+    sft->last_pos = -1;
+    return DOSERR_WRITE_FAULT;
+  }
+  return DOSERR_NONE;
+}
+
+/* Add a small write to the file's buffer, flushing first if it doesn't
+   follow on from what's there or won't fit. Returns the DOS error from
+   the flush, or -1 if there is no buffer to spare and the caller
+   should write it directly. */
+int write_buffered(SFTREC_PTR sft, uint8_t far *dta, uint16_t length)
+{
+  WRITEBEHIND *wb;
+  uint16_t err;
+
+
+  wb = writebehind_find(sft->file_handle);
+  if (!wb) {
+    wb = writebehind_find(0);
+    if (!wb)
+      return -1;
+    wb->handle = sft->file_handle;
+    wb->length = 0;
+  }
+
+  if (wb->length && (sft->pos != wb->pos + wb->length
+                     || wb->length + length > writebehind_size)) {
+    err = writebehind_flush(sft);
+    if (err)
+      return err;
+  }
+
+  if (!wb->length) {
+    if (sft->pos != sft->last_pos)
+      fujifs_seek(sft->file_handle, sft->pos); // FIXME - check error
+    wb->pos = sft->pos;
+  }
+  _fmemcpy(&wb->data[wb->length], dta, length);
+  wb->length += length;
+
+  /* last_pos is where the server will be once the buffer is flushed,
+     which always happens before anything else is done with the file */
+  sft->pos += length;
+  sft->last_pos = sft->pos;
+  if (sft->pos > sft->size)
+    sft->size = sft->pos;
+  return DOSERR_NONE;
+}
+
 /* ----- Redirector functions ------------------*/
 
 /* Respond that it is OK to load another redirector */
@@ -299,11 +556,19 @@ void find_first(void)
   srchrec_ptr1->attr_mask = *srch_attr_ptr;
   srchrec_ptr1->drive_num = (uint8_t) (fn_drive_num | 0xC0);
 
+  // DOS searching PATH for a command
+  if (miss_cached(path_with_volume(undosify_path(filename_ptr1)), *srch_attr_ptr)) {
+    fail(DOSERR_FILE_NOT_FOUND);
+    return;
+  }
+
   find_next();
   /* No need to check r.flags & FCARRY; if ax is 18,
      FCARRY must have been set. */
-  if (r.ax == DOSERR_NO_MORE_FILES)
+  if (r.ax == DOSERR_NO_MORE_FILES) {
     r.ax = DOSERR_FILE_NOT_FOUND;   // make find_next error code suitable to find_first
+    miss_record(path_with_volume(undosify_path(filename_ptr1)), *srch_attr_ptr);
+  }
 }
 
 /* ReMove Directory - subfunction 01h */
@@ -328,7 +593,7 @@ void remove_dir(void)
 
     undos = undosify_path(filename_ptr1);
     undos = path_with_volume(undos);
-    if (fujifs_stat(fn_host, undos, &entry)) {
+    if (stat_path(undos, &entry)) {
       fail(DOSERR_PATH_NOT_FOUND);
       return;
     }
@@ -378,7 +643,7 @@ void make_dir(void)
 
     undos = undosify_path(filename_ptr1);
     undos = path_with_volume(undos);
-    if (!fujifs_stat(fn_host, undos, &entry)) {
+    if (!stat_path(undos, &entry)) {
       fail(DOSERR_FILE_EXISTS);
       return;
     }
@@ -399,6 +664,7 @@ void make_dir(void)
       fail(DOSERR_ACCESS_DENIED);
       return;
     }
+    forget_misses(undos);
     succeed();
   }
 }
@@ -421,7 +687,7 @@ void chdir(void)
 
       undos = undosify_path(filename_ptr1);
       undos = path_with_volume(undos);
-      if (fujifs_stat(fn_host, undos, &entry) || !entry.isdir) {
+      if (stat_path(undos, &entry) || !entry.isdir) {
 	fail(DOSERR_ACCESS_DENIED);
 	return;
       }
@@ -437,6 +703,7 @@ void chdir(void)
 void close_file(void)
 {
   SFTREC_PTR sft = (SFTREC_PTR) MK_FP(r.es, r.di);
+  uint16_t err;
 
   if (sft->handle_count)  /* If handle count not 0, decrement it */
     --sft->handle_count;
@@ -445,14 +712,25 @@ void close_file(void)
   if (!(sft->open_mode & 3))
     return;
 
+  err = writebehind_flush(sft);
+  writebehind_discard(sft->file_handle);
+  readahead_discard(sft->file_handle);
   if (fujifs_close(sft->file_handle))
     fail(DOSERR_ACCESS_DENIED);
+  else if (err)
+    fail(err);
 }
 
 /* Commit File - subfunction 07h */
 void commit_file(void)
 {
-  /* We support this but don't do anything... */
+  SFTREC_PTR sft = (SFTREC_PTR) MK_FP(r.es, r.di);
+  uint16_t err;
+
+
+  err = writebehind_flush(sft);
+  if (err)
+    fail(err);
   return;
 }
 
@@ -462,22 +740,43 @@ void commit_file(void)
 void read_file(void)
 {
   SFTREC_PTR sft = (SFTREC_PTR) MK_FP(r.es, r.di);
+  uint16_t err, done, got;
+  uint8_t far *dta;
 
   if (sft->open_mode & 1) {
     fail(DOSERR_ACCESS_DENIED);
     return;
   }
 
+  err = writebehind_flush(sft);
+  if (err) {
+    fail(err);
+    return;
+  }
+
   if ((sft->pos + r.cx) > sft->size)
     r.cx = (uint16_t) (sft->size - sft->pos);
 
   if (!r.cx)
     return;
 
-  /* Fill caller's buffer and update the SFT for the file */
+  if (r.cx < readahead_size) {
+    r.cx = read_buffered(sft, ((SDA_PTR_V3) sda_ptr)->current_dta, r.cx);
+    return;
+  }
+
+  /* Fill caller's buffer and update the SFT for the file. A read can
+     come back short before the end of the file, DOS would take that
+     for the end. */
   if (sft->pos != sft->last_pos)
     fujifs_seek(sft->file_handle, sft->pos); // FIXME - check error
-  r.cx = fujifs_read(sft->file_handle, ((SDA_PTR_V3) sda_ptr)->current_dta, r.cx);
+  dta = ((SDA_PTR_V3) sda_ptr)->current_dta;
+  for (done = 0; done < r.cx; done += got) {
+    got = fujifs_read(sft->file_handle, &dta[done], r.cx - done);
+    if (!got)
+      break;
+  }
+  r.cx = done;
   sft->pos += r.cx;
   sft->last_pos = sft->pos;
 }
@@ -486,12 +785,30 @@ void read_file(void)
 void write_file(void)
 {
   SFTREC_PTR sft = (SFTREC_PTR) MK_FP(r.es, r.di);
+  int err;
 
   if (!(sft->open_mode & 3)) {
     fail(DOSERR_ACCESS_DENIED);
     return;
   }
 
+  readahead_discard(sft->file_handle);
+
+  /* A zero length write truncates, so it always goes to the server */
+  if (r.cx && r.cx < writebehind_size) {
+    err = write_buffered(sft, ((SDA_PTR_V3) sda_ptr)->current_dta, r.cx);
+    if (err > 0)
+      fail(err);
+    if (err >= 0)
+      return;
+  }
+
+  err = writebehind_flush(sft);
+  if (err) {
+    fail(err);
+    return;
+  }
+
   /* Write from the caller's buffer and update the SFT for the file */
   if (sft->pos != sft->last_pos)
     fujifs_seek(sft->file_handle, sft->pos); // FIXME - check error
@@ -593,7 +910,7 @@ void get_attr(void)
 
     undos = undosify_path(filename_ptr1);
     undos = path_with_volume(undos);
-    if (fujifs_stat(fn_host, undos, &entry)) {
+    if (stat_path(undos, &entry)) {
       fail(DOSERR_FILE_NOT_FOUND);
       return;
     }
@@ -715,6 +1032,7 @@ void rename_files(void)
         fail(DOSERR_ACCESS_DENIED);
         return;
       }
+      forget_misses(undos);
     }
     find_next();
   }
@@ -815,6 +1133,9 @@ void seek_file(void)
 {
   long seek_amnt;
   SFTREC_PTR sft;
+  WRITEBEHIND *wb;
+  uint16_t err;
+  int idx;
 
   /* But, just in case... */
   seek_amnt = -1L * (((long) r.cx << 16) + r.dx);
@@ -823,6 +1144,20 @@ void seek_file(void)
     seek_amnt = sft->size;
 
   sft->pos = sft->size - seek_amnt;
+  for (idx = 0; idx < readahead_count; idx++)
+    if (readahead[idx].handle == sft->file_handle
+        && (sft->pos < readahead[idx].pos
+            || sft->pos >= readahead[idx].pos + readahead[idx].length))
+      readahead[idx].handle = 0;
+
+  wb = writebehind_find(sft->file_handle);
+  if (wb && sft->pos != wb->pos + wb->length) {
+    err = writebehind_flush(sft);
+    if (err) {
+      fail(err);
+      return;
+    }
+  }
   r.dx = (uint16_t) (sft->pos >> 16);
   r.ax = (uint16_t) (sft->pos & 0xFFFF);
 }
@@ -883,7 +1218,7 @@ void open_extended(void)
 
     undos = undosify_path(filename_ptr1);
     undos = path_with_volume(undos);
-    r.ax = fujifs_stat(fn_host, undos, &entry);
+    r.ax = stat_path(undos, &entry);
     if (!r.ax)
       fndirent_to_dirrec(&entry, dirrec_ptr1);
   }
@@ -949,6 +1284,10 @@ void open_extended(void)
       fail(DOSERR_UNEXPECTED_NETWORK_ERROR);
       return;
     }
+    if (flags != FUJIFS_READ)
+      forget_misses(undos);
+    readahead_discard(handle);
+    writebehind_discard(handle);
     sft->file_handle = handle;
   }
 
@@ -15,6 +15,35 @@ extern char fn_cwd[];
 typedef void (interrupt far *INTVECT)();
 extern INTVECT prev_int2f_vector;
 
+/* Read-ahead buffers for small reads, set up by fnshare.c before it
+   goes resident */
+#define READAHEAD_MAX           8
+typedef struct {
+  fujifs_handle handle;         /* 0 if free */
+  uint16_t length;              /* Bytes in data */
+  uint16_t used;                /* readahead_clock when last read from */
+  uint32_t pos;                 /* File position of data[0] */
+  uint8_t far *data;
+} READAHEAD;
+
+extern READAHEAD readahead[READAHEAD_MAX];
+extern uint8_t readahead_count;
+extern uint16_t readahead_size;
+
+/* Write-behind buffers that gather small sequential writes, also set
+   up by fnshare.c */
+#define WRITEBEHIND_MAX         8
+typedef struct {
+  fujifs_handle handle;         /* 0 if free */
+  uint16_t length;              /* Bytes waiting in data */
+  uint32_t pos;                 /* File position of data[0] */
+  uint8_t far *data;
+} WRITEBEHIND;
+
+extern WRITEBEHIND writebehind[WRITEBEHIND_MAX];
+extern uint8_t writebehind_count;
+extern uint16_t writebehind_size;
+
 enum {
   SUBF_INQUIRY          = 0x00,
   SUBF_REMOVEDIR        = 0x01,
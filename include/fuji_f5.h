@@ -11,6 +11,9 @@
 #define FUJIINT_NONE    0x00
 #define FUJIINT_READ    0x40
 #define FUJIINT_WRITE   0x80
+#define FUJIINT_DRIVER  0xC0    // Ask the driver itself, AH selects FUJIDRV_*
+#define FUJIINT_DIRECTION 0xC0
+#define FUJIINT_ASYNC   0x20    // Added to NONE/READ/WRITE, don't wait for the reply
 
 #define FUJICOM_TIMEOUT  -1
 
@@ -61,6 +64,14 @@ enum {
   FUJICMD_APETIME_GETTIME   = 0x93,
   FUJICMD_APETIME_SETTZ     = 0x99,
   FUJICMD_APETIME_GETTZTIME = 0x9A,
+  FUJICMD_GET_CAPABILITIES  = 0xA0,
+  FUJICMD_READ_MULTI        = 0xA1,
+  FUJICMD_WRITE_MULTI       = 0xA2,
+  FUJICMD_GET_MEDIA_STATE   = 0xA3,
+  FUJICMD_GET_BAUD_RATES    = 0xA4,
+  FUJICMD_SET_BAUD          = 0xA5,
+  FUJICMD_BAUD_TEST         = 0xA6,
+  FUJICMD_READ_STATUS       = 0xA7,
   FUJICMD_MOUNT_ALL         = 0xD7,
   FUJICMD_GET_ADAPTERCONFIG = 0xE8,
   FUJICMD_UNMOUNT_IMAGE     = 0xE9,
@@ -72,6 +83,17 @@ enum {
   FUJICMD_PASSWORD          = 0xFE,
 };
 
+/* FujiBus extensions, negotiated with FUJICMD_GET_CAPABILITIES */
+enum {
+  FUJI_CAP_MULTI_SECTOR         = 0x0001,
+  FUJI_CAP_MEDIA_STATE          = 0x0002,
+  FUJI_CAP_BAUD                 = 0x0004,
+  FUJI_CAP_RLE                  = 0x0008,
+  FUJI_CAP_LZ                   = 0x0010,
+  FUJI_CAP_TAGGED               = 0x0020,
+  FUJI_CAP_READ_STATUS          = 0x0040,
+};
+
 enum {
   SLOT_READONLY                 = 1,
   SLOT_READWRITE                = 2,
@@ -115,8 +137,53 @@ enum {
 enum {
   REPLY_ERROR           = 'E',
   REPLY_COMPLETE        = 'C',
+  REPLY_BUSY            = 'B',  // Called from an interrupt while the bus was in use
+  REPLY_PENDING         = 'P',  // Async request still waiting for its reply
 };
 
+/* Driver queries, DL = FUJIINT_DRIVER, AH = query, ES:BX/DI = buffer */
+enum {
+  FUJIDRV_TIMING_GET    = 0x01, // Copy fuji_timing_stats to the buffer
+  FUJIDRV_TIMING_RESET  = 0x02, // Clear it
+  FUJIDRV_BUS_DEFER     = 0x03, // Far call ES:BX from the timer tick once the bus is free
+  FUJIDRV_ASYNC_POLL    = 0x04, // CL = handle, result or REPLY_PENDING
+  FUJIDRV_ASYNC_WAIT    = 0x05, // CL = handle, result once the reply is in
+  FUJIDRV_ASYNC_CALLBACK = 0x06, // CL = handle, far call ES:BX with AL = result, AH = handle
+  FUJIDRV_CAPS_GET      = 0x07, // Copy the uint16 FUJI_CAP_* bits in use to the buffer
+};
+
+/* The eight bytes in front of the driver's INT F5 handler, anything
+ * else doesn't answer FUJIINT_DRIVER queries */
+#define FUJIDRV_SIGNATURE       "FUJIDRV"
+
+/* Latencies are in 8253 PIT clocks. Histogram bucket 0 counts calls
+ * under 2^FUJI_TIMING_SHIFT clocks (215us), each bucket after that
+ * doubles, and the last one catches everything longer. */
+#define FUJI_PIT_HZ             1193182UL
+#define FUJI_TIMING_SHIFT       8
+#define FUJI_TIMING_BUCKETS     16
+#define FUJI_TIMING_ENTRIES     16
+
+typedef struct {
+  uint8_t key;                  // Command or device ID
+  uint8_t reserved;
+  uint16_t hist[FUJI_TIMING_BUCKETS];
+  uint32_t calls;               // 0 if this entry is unused
+  uint32_t total;               // Sum of latencies
+  uint32_t max;
+  uint32_t bytes_out;           // Bytes framed and sent, retries included
+  uint32_t bytes_in;            // Bytes received
+} fuji_timing_entry;
+
+typedef struct {
+  uint16_t size;                // sizeof(fuji_timing_stats)
+  uint16_t entries;             // FUJI_TIMING_ENTRIES
+  uint32_t since;               // BIOS tick count at the last reset
+  uint32_t dropped;             // Calls with no free entry to go in
+  fuji_timing_entry commands[FUJI_TIMING_ENTRIES];
+  fuji_timing_entry devices[FUJI_TIMING_ENTRIES];
+} fuji_timing_stats;
+
 extern int fujiF5w(uint16_t descrdir, uint16_t devcom,
                   uint16_t aux12, uint16_t aux34, void far *buffer, uint16_t length);
 #pragma aux fujiF5w = \
@@ -130,4 +197,43 @@ extern int fujiF5w(uint16_t descrdir, uint16_t devcom,
 #define fujiF5_read(d, c, fd, a12, a34, b, l) fujiF5(FUJIINT_READ, d, c, fd, a12, a34, b, l)
 #define fujiF5_write(d, c, fd, a12, a34, b, l) fujiF5(FUJIINT_WRITE, d, c, fd, a12, a34, b, l)
 
+/* Asynchronous requests. fujiF5_submit returns REPLY_COMPLETE in the
+ * low byte and a handle in the high byte once the command is on its
+ * way, the buffer has to stay put until the handle is finished with.
+ * Every handle must be collected with fujiF5_poll returning anything
+ * but REPLY_PENDING, with fujiF5_wait, or by its callback. A callback
+ * is made from the driver's timer tick: it must preserve every
+ * register but AX and must not call DOS. */
+#define fujiF5_submit(dir, dev, cmd, descr, a12, a34, buf, len)  \
+  fujiF5(dir | FUJIINT_ASYNC, dev, cmd, descr, a12, a34, buf, len)
+#define FUJI_ASYNC_RESULT(r)    ((uint8_t) (r))
+#define FUJI_ASYNC_HANDLE(r)    ((uint8_t) ((r) >> 8))
+
+extern uint8_t fujiF5_poll(uint8_t handle);
+#pragma aux fujiF5_poll = \
+  "mov dx, 0xc0" \
+  "mov ah, 0x04" \
+  "int 0xf5" \
+  parm [cl] \
+  value [al] \
+  modify [ax dx]
+
+extern uint8_t fujiF5_wait(uint8_t handle);
+#pragma aux fujiF5_wait = \
+  "mov dx, 0xc0" \
+  "mov ah, 0x05" \
+  "int 0xf5" \
+  parm [cl] \
+  value [al] \
+  modify [ax dx]
+
+extern uint8_t fujiF5_callback(uint8_t handle, void far *routine);
+#pragma aux fujiF5_callback = \
+  "mov dx, 0xc0" \
+  "mov ah, 0x06" \
+  "int 0xf5" \
+  parm [cl] [es bx] \
+  value [al] \
+  modify [ax dx]
+
 #endif /* _FUJI_F5_H */
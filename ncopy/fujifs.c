@@ -38,14 +38,54 @@ typedef struct {
   uint8_t parent;
   uint8_t is_open:1;
   uint8_t did_auth:1;
+  uint8_t at_end:1;             // Last status said END_OF_FILE
   size_t position, length;
+  size_t waiting;               // Bytes the last status said were left to read
+  uint16_t dir_hash;            // Parent directory if open for writing, else 0
   // FIXME - move to host/url handle
   char user[32], password[32];
 } fn_network_handle;
 
 static fn_network_handle fujifs_open_handles[NETDEV_TOTAL];
 static uint8_t fujifs_buf[OPEN_SIZE];
+static uint8_t fujifs_bounce[OPEN_SIZE + sizeof(status)];
 static char fujifs_did_init = 0;
+static uint16_t fujifs_caps;
+
+/* Directory listings kept so fujifs_stat doesn't have to download the
+   whole directory for every name it looks up. Entries of all the
+   cached directories share one pool, each directory's entries sorted
+   by name. Anything we change ourselves is dropped straight away,
+   changes made by anyone else show up once the listing expires. The
+   pool is handed over by fujifs_dircache, without one nothing is
+   kept. */
+#define DIRCACHE_DIRS           4
+#define DIRCACHE_PATH           64
+#define DIRCACHE_NAME           12      // 8.3, longer names aren't kept
+#define DIRCACHE_TTL            (18 * 5)
+#define BIOS_TICKS              (*(volatile uint32_t far *) MK_FP(0x40, 0x6C))
+
+typedef struct {
+  char name[DIRCACHE_NAME];     // Only terminated if shorter
+  uint32_t size;
+  uint8_t isdir;
+  uint8_t year, mon, mday, hour, min;
+} dircache_ent;
+
+typedef struct {
+  fujifs_handle host;           // 0 if unused
+  uint8_t complete:1;
+  uint16_t hash;
+  uint16_t first, count;
+  uint32_t loaded;              // BIOS tick count
+  char path[DIRCACHE_PATH];
+} dircache_dir;
+
+static dircache_ent far *dircache_pool;
+static uint16_t dircache_entries;
+static dircache_dir dircache_dirs[DIRCACHE_DIRS];
+static uint16_t dircache_used;
+static char dircache_name[DIRCACHE_NAME + 1];
 
 // Copy path to fujifs_buf and make sure it has N: prefix
 void ennify(int devnum, const char far *path)
@@ -81,6 +121,234 @@ void ennify(int devnum, const char far *path)
   return;
 }
 
+static uint16_t dircache_hash(const char *path)
+{
+  uint16_t hash;
+
+
+  for (hash = 1; *path; path++)
+    hash = hash * 31 + toupper(*path);
+  // 0 means no directory at all
+  return hash ? hash : 1;
+}
+
+static void dircache_drop(dircache_dir *dir)
+{
+  uint16_t end;
+  int idx;
+
+
+  if (!dir->host)
+    return;
+
+  end = dir->first + dir->count;
+  _fmemmove(&dircache_pool[dir->first], &dircache_pool[end],
+            (dircache_used - end) * sizeof(dircache_pool[0]));
+  dircache_used -= dir->count;
+  for (idx = 0; idx < DIRCACHE_DIRS; idx++)
+    if (dircache_dirs[idx].host && dircache_dirs[idx].first > dir->first)
+      dircache_dirs[idx].first -= dir->count;
+  dir->host = 0;
+  return;
+}
+
+// Drop every listing of a directory, 0 drops them all
+static void dircache_forget(uint16_t hash)
+{
+  int idx;
+
+
+  for (idx = 0; idx < DIRCACHE_DIRS; idx++)
+    if (!hash || dircache_dirs[idx].hash == hash)
+      dircache_drop(&dircache_dirs[idx]);
+  return;
+}
+
+/* Cut the name off the path in fujifs_buf and return its directory's
+   hash, 0 if there isn't one */
+static uint16_t dircache_parent(char **name)
+{
+  char *sep;
+
+
+  sep = strrchr(fujifs_buf, '/');
+  if (!sep)
+    return 0;
+  *sep = 0;
+  if (name)
+    *name = sep + 1;
+  return dircache_hash(fujifs_buf);
+}
+
+/* Drop the listing path is in, and its own if it's a directory.
+   Returns the hash of the directory it's in. */
+static uint16_t dircache_forget_path(fujifs_handle handle, const char far *path)
+{
+  uint16_t hash;
+
+
+  ennify(handle, path);
+  dircache_forget(dircache_hash(fujifs_buf));
+  hash = dircache_parent(NULL);
+  if (hash)
+    dircache_forget(hash);
+  return hash;
+}
+
+static int dircache_cmp(const char far *name, const dircache_ent far *ent)
+{
+  return _fstrnicmp(name, ent->name, DIRCACHE_NAME);
+}
+
+static dircache_dir *dircache_find(fujifs_handle host_handle, const char *path)
+{
+  int idx;
+  dircache_dir *dir;
+
+
+  for (idx = 0; idx < DIRCACHE_DIRS; idx++) {
+    dir = &dircache_dirs[idx];
+    if (dir->host == host_handle && dir->complete && !strcmp(dir->path, path)) {
+      if (BIOS_TICKS - dir->loaded < DIRCACHE_TTL)
+        return dir;
+      dircache_drop(dir);
+    }
+  }
+  return NULL;
+}
+
+// Start a new listing at the end of the pool, in place of the oldest
+static dircache_dir *dircache_begin(fujifs_handle host_handle, const char *path)
+{
+  int idx;
+  dircache_dir *dir, *oldest = NULL;
+
+
+  if (!dircache_entries || strlen(path) >= DIRCACHE_PATH)
+    return NULL;
+
+  for (idx = 0; idx < DIRCACHE_DIRS; idx++) {
+    dir = &dircache_dirs[idx];
+    if (!dir->host) {
+      oldest = dir;
+      break;
+    }
+    if (!oldest || dir->loaded < oldest->loaded)
+      oldest = dir;
+  }
+  dircache_drop(oldest);
+
+  oldest->host = host_handle;
+  oldest->complete = 0;
+  oldest->hash = dircache_hash(path);
+  oldest->first = dircache_used;
+  oldest->count = 0;
+  strcpy(oldest->path, path);
+  return oldest;
+}
+
+// Returns false if the pool is full of this directory alone
+static int dircache_add(dircache_dir *dir, FN_DIRENT *ent)
+{
+  int idx;
+  dircache_dir *victim;
+  dircache_ent far *cent;
+
+
+  if (strlen(ent->name) > DIRCACHE_NAME)
+    return 1;
+
+  // Make room by throwing out other directories, oldest first
+  while (dircache_used == dircache_entries) {
+    victim = NULL;
+    for (idx = 0; idx < DIRCACHE_DIRS; idx++)
+      if (dircache_dirs[idx].host && dircache_dirs[idx].complete
+          && (!victim || dircache_dirs[idx].loaded < victim->loaded))
+        victim = &dircache_dirs[idx];
+    if (!victim)
+      return 0;
+    dircache_drop(victim);
+  }
+
+  cent = &dircache_pool[dircache_used++];
+  dir->count++;
+  _fstrncpy(cent->name, ent->name, DIRCACHE_NAME);
+  cent->size = ent->size;
+  cent->isdir = ent->isdir;
+  cent->year = ent->mtime.tm_year;
+  cent->mon = ent->mtime.tm_mon;
+  cent->mday = ent->mtime.tm_mday;
+  cent->hour = ent->mtime.tm_hour;
+  cent->min = ent->mtime.tm_min;
+  return 1;
+}
+
+/* Listings usually come back sorted already, so an insertion sort
+   is hardly any work */
+static void dircache_finish(dircache_dir *dir)
+{
+  dircache_ent far *base = &dircache_pool[dir->first];
+  dircache_ent temp;
+  uint16_t idx, jdx;
+
+
+  for (idx = 1; idx < dir->count; idx++) {
+    if (dircache_cmp(base[idx].name, &base[idx - 1]) >= 0)
+      continue;
+    temp = base[idx];
+    for (jdx = idx; jdx && dircache_cmp(temp.name, &base[jdx - 1]) < 0; jdx--)
+      base[jdx] = base[jdx - 1];
+    base[jdx] = temp;
+  }
+
+  dir->complete = 1;
+  dir->loaded = BIOS_TICKS;
+  return;
+}
+
+static errcode dircache_lookup(dircache_dir *dir, const char far *name,
+                               FN_DIRENT far *entry)
+{
+  dircache_ent far *base = &dircache_pool[dir->first];
+  dircache_ent far *cent;
+  uint16_t low, high, mid;
+  int cmp;
+
+
+  for (low = 0, high = dir->count; low < high; ) {
+    mid = (low + high) / 2;
+    cent = &base[mid];
+    cmp = dircache_cmp(name, cent);
+    if (cmp < 0)
+      high = mid;
+    else if (cmp > 0)
+      low = mid + 1;
+    else {
+      _fmemcpy(dircache_name, cent->name, DIRCACHE_NAME);
+      dircache_name[DIRCACHE_NAME] = 0;
+      _fmemset(entry, 0, sizeof(*entry));
+      entry->name = dircache_name;
+      entry->size = cent->size;
+      entry->isdir = cent->isdir;
+      entry->mtime.tm_year = cent->year;
+      entry->mtime.tm_mon = cent->mon;
+      entry->mtime.tm_mday = cent->mday;
+      entry->mtime.tm_hour = cent->hour;
+      entry->mtime.tm_min = cent->min;
+      return 0;
+    }
+  }
+  return NETWORK_ERROR_FILE_NOT_FOUND;
+}
+
+uint16_t fujifs_dircache(void far *pool, uint16_t size)
+{
+  dircache_forget(0);
+  dircache_pool = pool;
+  dircache_entries = pool ? size / sizeof(dircache_ent) : 0;
+  return dircache_entries;
+}
+
 fujifs_handle fujifs_find_handle()
 {
   int idx;
@@ -94,6 +362,8 @@ fujifs_handle fujifs_find_handle()
   for (idx = 0; idx < NETDEV_TOTAL; idx++) {
     if (!FN_HANDLE(idx + 1).is_open) {
       FN_HANDLE(idx + 1).is_open = 1;
+      FN_HANDLE(idx + 1).waiting = 0;
+      FN_HANDLE(idx + 1).at_end = 0;
       return idx + 1;
     }
   }
@@ -101,6 +371,24 @@ fujifs_handle fujifs_find_handle()
   return 0;
 }
 
+/* Only ask a driver that leaves its signature in front of the INT F5
+   handler, older ones take DL = FUJIINT_DRIVER as a command for device
+   0xC0 and wait out its timeout. Without the answer we stay on the
+   base commands. */
+static uint16_t fujifs_driver_caps(void)
+{
+  const char far *sig;
+  uint16_t caps;
+
+
+  sig = (const char far *) _dos_getvect(FUJINET_INT) - sizeof(FUJIDRV_SIGNATURE);
+  if (_fmemcmp(sig, FUJIDRV_SIGNATURE, sizeof(FUJIDRV_SIGNATURE))
+      || fujiF5(FUJIINT_DRIVER, 0, FUJIDRV_CAPS_GET, FUJI_FIELD_NONE, 0, 0,
+                &caps, sizeof(caps)) != REPLY_COMPLETE)
+    return 0;
+  return caps;
+}
+
 errcode fujifs_open_url(fujifs_handle far *host_handle, const char *url,
                         const char *user, const char *password)
 {
@@ -110,6 +398,7 @@ errcode fujifs_open_url(fujifs_handle far *host_handle, const char *url,
   fn_network_handle *hhp;
 
 
+  fujifs_caps = fujifs_driver_caps();
   temp = fujifs_find_handle();
   if (!temp)
     return NETWORK_ERROR_NO_DEVICE_AVAILABLE;
@@ -170,6 +459,10 @@ errcode fujifs_open(fujifs_handle host_handle, fujifs_handle far *file_handle,
     return NETWORK_ERROR_NO_DEVICE_AVAILABLE;
   fhp = &FN_HANDLE(*file_handle);
 
+  fhp->dir_hash = 0;
+  if (mode == FUJIFS_WRITE || mode == FUJIFS_APPEND || mode == FUJIFS_READWRITE)
+    fhp->dir_hash = dircache_forget_path(*file_handle, path);
+
   if (host_handle) {
     fn_network_handle *hhp = &FN_HANDLE(host_handle);
 
@@ -259,37 +552,85 @@ errcode fujifs_close(fujifs_handle handle)
   return 0;
 }
 
-// Returns number of bytes read
+/* Returns number of bytes read, which can come up short of length
+   before the end of the file */
 size_t fujifs_read(fujifs_handle handle, uint8_t far *buf, size_t length)
 {
   int reply;
+  size_t done, want;
+  uint8_t far *dest;
+  fn_network_handle *hhp;
 
 
   if (handle < 1 || handle > NETDEV_TOTAL || !FN_HANDLE(handle).is_open)
     return 0;
+  hhp = &FN_HANDLE(handle);
+
+  // Bytes the last status counted are still there, only ask again
+  // once they run out
+  if (hhp->waiting < length) {
+    hhp->at_end = 0;
+    if (fujifs_caps & FUJI_CAP_READ_STATUS) {
+      /* Status and data come back in one reply. Small reads go through
+         the bounce buffer, bigger ones land in place and leave out the
+         last few bytes to make room for the status, the next read
+         picks those up. */
+      dest = fujifs_bounce;
+      want = length;
+      if (length > OPEN_SIZE) {
+        dest = buf;
+        want = length - sizeof(status);
+      }
+      reply = fujiF5_read(NETDEV(handle), FUJICMD_READ_STATUS, FUJI_FIELD_B12,
+                          want, 0, dest, want + sizeof(status));
+      if (reply != REPLY_COMPLETE)
+        return 0;
+      _fmemcpy(&status, dest, sizeof(status));
+      hhp->at_end = status.errcode == NETWORK_ERROR_END_OF_FILE;
+      if (status.errcode > NETWORK_SUCCESS && !status.length)
+        return 0;
+      done = want;
+      if (done > status.length)
+        done = status.length;
+      _fmemmove(buf, &dest[sizeof(status)], done);
+      hhp->waiting = status.length - done;
+      return done;
+    }
 
-  // Check how many bytes are available
-  reply = fujiF5_read(NETDEV(handle), FUJICMD_STATUS, FUJI_FIELD_NONE, 0, 0, &status, sizeof(status));
+    // Check how many bytes are available
+    reply = fujiF5_read(NETDEV(handle), FUJICMD_STATUS, FUJI_FIELD_NONE, 0, 0,
+                        &status, sizeof(status));
 #if 0
-  if (reply != REPLY_COMPLETE)
-    printf("FUJIFS_READ STATUS REPLY: 0x%02x\n", reply);
-  // FIXME - check err
+    if (reply != REPLY_COMPLETE)
+      printf("FUJIFS_READ STATUS REPLY: 0x%02x\n", reply);
+    // FIXME - check err
 #endif
 
 #if 0
-  printf("FN STATUS: len %i  con %i  err %i\n",
-         status.length, status.connected, status.errcode);
+    printf("FN STATUS: len %i  con %i  err %i\n",
+           status.length, status.connected, status.errcode);
 #endif
-  if ((status.errcode > NETWORK_SUCCESS && !status.length)
-      /* || !status.connected // status.connected doesn't work */)
-    return 0;
+    if (reply == REPLY_COMPLETE)
+      hhp->at_end = status.errcode == NETWORK_ERROR_END_OF_FILE;
+    if ((status.errcode > NETWORK_SUCCESS && !status.length)
+        /* || !status.connected // status.connected doesn't work */)
+      return 0;
 
-  if (length > status.length)
-    length = status.length;
+    hhp->waiting = status.length;
+  }
 
-  reply = fujiF5_read(NETDEV(handle), FUJICMD_READ, FUJI_FIELD_B12, length, 0, buf, length);
-  if (reply != REPLY_COMPLETE)
+  if (length > hhp->waiting)
+    length = hhp->waiting;
+  if (!length)
+    return 0;
+
+  reply = fujiF5_read(NETDEV(handle), FUJICMD_READ, FUJI_FIELD_B12, length, 0,
+                      buf, length);
+  if (reply != REPLY_COMPLETE) {
+    hhp->waiting = 0;
     return 0;
+  }
+  hhp->waiting -= length;
   return length;
 }
 
@@ -307,7 +648,10 @@ size_t fujifs_write(fujifs_handle handle, uint8_t far *buf, size_t length)
   if (length == -1)
     length--;
 
+  FN_HANDLE(handle).waiting = 0;
   reply = fujiF5_write(NETDEV(handle), FUJICMD_WRITE, FUJI_FIELD_B12, length, 0, buf, length);
+  if (FN_HANDLE(handle).dir_hash)
+    dircache_forget(FN_HANDLE(handle).dir_hash);
   if (reply != REPLY_COMPLETE) {
     consolef("FUJIFS_WRITE FAILED %i\n", reply);
     return -1;
@@ -477,7 +821,7 @@ FN_DIRENT *fujifs_readdir(fujifs_handle handle)
   ent.mtime.tm_min = atoi(cptr3);
   ent.mtime.tm_hour = ent.mtime.tm_hour % 12 + (tolower(cptr3[2]) == 'p' ? 12 : 0);
 
-  len1 = (cptr3 - fujifs_buf) + 4;
+  len1 = (cptr3 - (char *) fujifs_buf) + 4;
   FN_HANDLE(handle).position = len1;
 
   return &ent;
@@ -491,6 +835,7 @@ errcode fujifs_seek(fujifs_handle handle, off_t position)
   if (handle < 1 || handle > NETDEV_TOTAL || !FN_HANDLE(handle).is_open)
     return NETWORK_ERROR_NOT_CONNECTED;
 
+  FN_HANDLE(handle).waiting = 0;
   reply = fujiF5_write(NETDEV(handle), FUJICMD_SEEK, FUJI_FIELD_C1234,
                        position & 0xffff, (position >> 16) & 0xffff, NULL, 0);
   if (reply != REPLY_COMPLETE)
@@ -506,11 +851,10 @@ errcode fujifs_stat(fujifs_handle host_handle, const char far *path, FN_DIRENT f
   const char far *fname;
   errcode err;
   FN_DIRENT *ent;
+  dircache_dir *dir = NULL;
+  uint8_t done;
 
 
-  // FIXME - this is an extremely slow way to stat a file, it requires
-  //         reading in the entire directory
-
   // Figure out which N: device will be used and add prefix so
   // fujifs_buf doesn't get modified during open
   dir_handle = fujifs_find_handle();
@@ -519,26 +863,57 @@ errcode fujifs_stat(fujifs_handle host_handle, const char far *path, FN_DIRENT f
   ennify(dir_handle, path);
   FN_HANDLE(dir_handle).is_open = 0;
 
-  sep = strrchr(fujifs_buf, '/');
-  if (!sep)
+  if (!dircache_parent(&sep))
     return NETWORK_ERROR_FILE_NOT_FOUND;
-  *sep = 0;
-  fname = path + (sep - fujifs_buf) + 2 - sizeof(NETDEV_PREFIX);
+  fname = path + (sep - (char *) fujifs_buf) + 1 - sizeof(NETDEV_PREFIX);
+
+  /* Reading the listing is the slow part, keep it for next time.
+     Names too long to be kept have to be looked for the slow way. */
+  if (_fstrlen(fname) <= DIRCACHE_NAME) {
+    dir = dircache_find(host_handle, fujifs_buf);
+    if (dir)
+      return dircache_lookup(dir, fname, entry);
+    dir = dircache_begin(host_handle, fujifs_buf);
+  }
 
   err = fujifs_opendir(host_handle, &dir_handle, fujifs_buf);
-  if (err)
+  if (err) {
+    if (dir)
+      dircache_drop(dir);
     return NETWORK_ERROR_SERVICE_NOT_AVAILABLE;
+  }
 
   err = NETWORK_ERROR_FILE_NOT_FOUND;
   while ((ent = fujifs_readdir(dir_handle))) {
-    if (!_fstricmp(ent->name, fname)) {
+    if (dir && !dircache_add(dir, ent)) {
+      dircache_drop(dir);
+      dir = NULL;
+    }
+
+    if (err && !_fstricmp(ent->name, fname)) {
       *entry = *ent;
       err = 0;
-      break;
+      if (!dir)
+        break;
+      // ent->name points into fujifs_buf, the rest of the listing reads over it
+      strcpy(dircache_name, ent->name);
+      entry->name = dircache_name;
     }
   }
 
+  /* fujifs_readdir gives up on an error just like at the end, only a
+     listing read to the end says a name isn't there or is worth
+     keeping */
+  done = FN_HANDLE(dir_handle).at_end;
   fujifs_closedir(dir_handle);
+  if (err && !done)
+    err = NETWORK_ERROR_SERVICE_NOT_AVAILABLE;
+  if (dir) {
+    if (done)
+      dircache_finish(dir);
+    else
+      dircache_drop(dir);
+  }
   return err;
 }
 
@@ -577,6 +952,9 @@ errcode fujifs_chdir(fujifs_handle host_handle, const char far *path)
   int idx;
 
 
+  // Relative paths don't mean the same thing any more
+  dircache_forget(0);
+
   // Invalidate all other network drives that have us as parent
   for (idx = 0; idx < NETDEV_TOTAL; idx++)
     if (FN_HANDLE(idx + 1).parent == host_handle)
@@ -588,16 +966,19 @@ errcode fujifs_chdir(fujifs_handle host_handle, const char far *path)
 
 errcode fujifs_rmdir(fujifs_handle host_handle, const char far *path)
 {
+  dircache_forget_path(host_handle, path);
   return fujifs_path_operation(host_handle, FUJICMD_RMDIR, path);
 }
 
 errcode fujifs_mkdir(fujifs_handle host_handle, const char far *path)
 {
+  dircache_forget_path(host_handle, path);
   return fujifs_path_operation(host_handle, FUJICMD_MKDIR, path);
 }
 
 errcode fujifs_unlink(fujifs_handle host_handle, const char far *path)
 {
+  dircache_forget_path(host_handle, path);
   return fujifs_path_operation(host_handle, FUJICMD_DELETE, path);
 }
 
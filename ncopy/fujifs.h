@@ -54,4 +54,9 @@ extern errcode fujifs_rename(fujifs_handle host_handle, const char far *oldpath,
 			     const char far *newpath);
 extern errcode fujifs_unlink(fujifs_handle host_handle, const char far *path);
 
+/* Room for fujifs_stat to keep directory listings in, size bytes at
+   pool. Returns how many names fit, no pool means every stat reads the
+   whole directory again. */
+extern uint16_t fujifs_dircache(void far *pool, uint16_t size);
+
 #endif /* _FUJIFS_H */
@@ -16,7 +16,7 @@ static uint16_t prn_buf_len = 0;
 static volatile uint16_t timer_counter = 0;
 static volatile uint16_t last_activity = 0;
 static volatile uint8_t flush_pending = 0;
-static uint8_t far *indos_flag = NULL;
+static uint8_t bus_defer = 0;
 static uint8_t buffering_enabled = 0;
 
 // Defined in iwrap.asm
@@ -26,12 +26,20 @@ extern void timer_vect(void);
 extern uint16_t old_idle_off;
 extern uint16_t old_idle_seg;
 extern void idle_vect(void);
+extern void defer_vect(void);
 
 int flush_prn_buf(void)
 {
     int ok = 1;
     if (prn_buf_len > 0) {
         ok = fujiF5_write(FUJI_DEVICEID_PRINTER, FUJICMD_WRITE, FUJI_FIELD_NONE, 0, 0, prn_buf, prn_buf_len);
+        if (ok == REPLY_BUSY) {
+            // Broke in on fujinet.sys using the bus, have it call back when it's done
+            flush_pending = 1;
+            fujiF5w(FUJIINT_DRIVER, FUJIDRV_BUS_DEFER << 8, 0, 0,
+                    MK_FP(getCS(), (uint16_t)defer_vect), 0);
+            return 0;
+        }
         if (ok) {
             prn_buf_len = 0;
             memset(prn_buf, 0, PRN_BUF_SIZE);
@@ -55,17 +63,20 @@ int prn_buf_add(unsigned char c)
     return 1;
 }
 
-// Called from INT 08h wrapper in iwrap.asm — DS=CS on entry
+// Called from INT 08h wrapper in iwrap.asm — DS=CS on entry. This is
+// ahead of the BIOS and its EOI, so the receive IRQ is still masked and
+// a bus call would wait forever. fujinet.sys calls defer_vect from its
+// own tick once that's done and the bus is free, INT 28h otherwise.
 void timer_tick(void)
 {
     timer_counter++;
-    if (prn_buf_len > 0 && (timer_counter - last_activity) >= AUTO_FLUSH_TICKS) {
-        if (indos_flag && *indos_flag == 0) {
-            flush_prn_buf();
-            last_activity = timer_counter;
-        } else {
-            flush_pending = 1;  // DOS busy — INT 28h will pick it up
-        }
+    if (prn_buf_len > 0 && !flush_pending
+        && (timer_counter - last_activity) >= AUTO_FLUSH_TICKS) {
+        flush_pending = 1;
+        last_activity = timer_counter;
+        if (bus_defer)
+            fujiF5w(FUJIINT_DRIVER, FUJIDRV_BUS_DEFER << 8, 0, 0,
+                    MK_FP(getCS(), (uint16_t)defer_vect), 0);
     }
 }
 
@@ -79,16 +90,13 @@ void idle_flush(void)
 void install_timer_handler(void)
 {
     void (__interrupt __far *old)(void);
-    uint16_t indos_seg, indos_off;
-
-    // Get InDOS flag address via INT 21h AH=34h
-    _asm {
-        mov  ah, 34h
-        int  21h
-        mov  indos_off, bx
-        mov  indos_seg, es
-    }
-    indos_flag = (uint8_t far *)MK_FP(indos_seg, indos_off);
+    union REGS regs;
+    const char far *sig;
+
+    // Only fujinet.sys with the signature takes driver queries, an
+    // older one would send them to the FujiNet
+    sig = (const char far *)_dos_getvect(FUJINET_INT) - sizeof(FUJIDRV_SIGNATURE);
+    bus_defer = !_fmemcmp(sig, FUJIDRV_SIGNATURE, sizeof(FUJIDRV_SIGNATURE));
 
     old = _dos_getvect(0x08);
     old_timer_off = FP_OFF(old);
@@ -101,12 +109,9 @@ void install_timer_handler(void)
     _dos_setvect(0x28, MK_FP(getCS(), (uint16_t)idle_vect));
 
     // Buffer + timer + INT 28h require DOS 3.0+
-    _asm {
-        mov  ah, 30h
-        int  21h
-        mov  buffering_enabled, al
-    }
-    buffering_enabled = (buffering_enabled >= 3) ? 1 : 0;
+    regs.h.ah = 0x30;
+    intdos(&regs, &regs);
+    buffering_enabled = (regs.h.al >= 3) ? 1 : 0;
 
     timer_counter = 0;
     last_activity = 0;
@@ -106,6 +106,35 @@ idle_vect_ PROC NEAR
 	jmp	dword ptr cs:[_old_idle_off]
 idle_vect_ ENDP
 
+; Called far by fujinet.sys once the bus is free — sets DS=CS, calls idle_flush_
+	PUBLIC	defer_vect_
+defer_vect_ PROC FAR
+	push	ax
+	push	bx
+	push	cx
+	push	dx
+	push	si
+	push	di
+	push	bp
+	push	ds
+	push	es
+	push	cs
+	pop	ds
+
+	call	idle_flush_
+
+	pop	es
+	pop	ds
+	pop	bp
+	pop	di
+	pop	si
+	pop	dx
+	pop	cx
+	pop	bx
+	pop	ax
+	retf
+defer_vect_ ENDP
+
 _TEXT	ends
 
 	end
@@ -0,0 +1,128 @@
+/**
+ * Line speed negotiation, only run from Init_cmd
+ *
+ * The FujiNet lists the speeds it can run at. Each one faster than the
+ * current speed is tried in turn: FUJICMD_SET_BAUD switches the
+ * FujiNet, the UART follows, and FUJICMD_BAUD_TEST has to bring a
+ * pattern with every byte value back intact. The first speed that
+ * fails ends the search and the last one that passed is kept.
+ */
+
+#include "autobps.h"
+#include "portio.h"
+#include "timer.h"
+#include <fuji_f5.h>
+#include <string.h>
+#include <conio.h>
+#include <dos.h>
+
+#define UART_LSR                5
+#define LSR_DR                  0x01
+
+#define BAUD_SWITCH_TICKS       2
+// The FujiNet gives up on a speed after 5 seconds without a test
+#define BAUD_REVERT_TICKS       (6 * PORT_TICKS_PER_SECOND)
+
+/* Let both ends change speed, whatever arrives meanwhile is noise */
+static void switch_wait(void)
+{
+  uint16_t start;
+
+
+  for (start = BIOS_TICKS; BIOS_TICKS - start < BAUD_SWITCH_TICKS; )
+    if (inp(port_uart_base + UART_LSR) & LSR_DR)
+      inp(port_uart_base);
+  return;
+}
+
+static bool set_baud(uint32_t bps)
+{
+  return fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_SET_BAUD, FUJI_FIELD_C1234,
+                       bps & 0xFF, (bps >> 8) & 0xFF, (bps >> 16) & 0xFF, bps >> 24,
+                       NULL, 0, NULL, 0);
+}
+
+static bool baud_test(uint8_t *pattern, uint8_t *echo)
+{
+  memset(echo, 0, BAUD_TEST_SIZE);
+  return fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_BAUD_TEST, FUJI_FIELD_NONE,
+                       0, 0, 0, 0, pattern, BAUD_TEST_SIZE, echo, BAUD_TEST_SIZE)
+    && !memcmp(pattern, echo, BAUD_TEST_SIZE);
+}
+
+/* Ask the FujiNet to switch to bps and check a test pattern comes
+ * back intact. If it doesn't, both ends go back to the old speed. */
+static bool try_bps(uint32_t bps, uint8_t *pattern, uint8_t *echo)
+{
+  uint32_t old_bps = fujicom_bps;
+  uint16_t start;
+  uint8_t retries;
+  bool ok;
+
+
+  if (!fujicom_divisor(bps) || !set_baud(bps))
+    return false;
+
+  fujicom_set_bps(bps);
+  switch_wait();
+
+  // One go at a time, a retry could run past the FujiNet giving up
+  retries = fujicom_retries;
+  fujicom_retries = 0;
+  ok = baud_test(pattern, echo);
+  if (!ok) {
+    // A pattern spoiled on its way back arrived intact at the FujiNet,
+    // which now sticks to the new speed, so it has to be told. If the
+    // pattern never got there this won't either, and the FujiNet goes
+    // back by itself.
+    set_baud(old_bps);
+    fujicom_set_bps(old_bps);
+    switch_wait();
+
+    // Test until the FujiNet answers at the old speed, which makes it
+    // stick there
+    for (start = BIOS_TICKS; !baud_test(pattern, echo)
+           && BIOS_TICKS - start < BAUD_REVERT_TICKS; )
+      ;
+  }
+
+  fujicom_retries = retries;
+  return ok;
+}
+
+void autobps_negotiate(uint32_t max_bps, void *space)
+{
+  fuji_baud_rates *rates = space;
+  uint8_t *pattern, *echo;
+  uint16_t idx;
+
+
+  pattern = (uint8_t *) (rates + 1);
+  echo = pattern + BAUD_TEST_SIZE;
+
+  // Every byte value, SLIP_END and SLIP_ESC included
+  for (idx = 0; idx < BAUD_TEST_SIZE; idx++)
+    pattern[idx] = idx;
+
+  memset(rates, 0, sizeof(*rates));
+  if (!fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_GET_BAUD_RATES, FUJI_FIELD_NONE,
+                     0, 0, 0, 0, NULL, 0, rates, sizeof(*rates)))
+    return;
+  if (rates->count > FUJI_BAUD_RATES_MAX)
+    rates->count = FUJI_BAUD_RATES_MAX;
+
+  // The speed that worked last time saves stepping through the rest
+  if (rates->saved > fujicom_bps && (!max_bps || rates->saved <= max_bps)
+      && try_bps(rates->saved, pattern, echo))
+    return;
+
+  for (idx = 0; idx < rates->count; idx++) {
+    if (rates->rates[idx] <= fujicom_bps)
+      continue;
+    if (max_bps && rates->rates[idx] > max_bps)
+      break;
+    if (fujicom_divisor(rates->rates[idx]) && !try_bps(rates->rates[idx], pattern, echo))
+      break;
+  }
+  return;
+}
@@ -0,0 +1,20 @@
+#ifndef _AUTOBPS_H
+#define _AUTOBPS_H
+
+#include "fujicom.h"
+#include <stdint.h>
+
+#define BAUD_TEST_SIZE          256
+
+// Scratch autobps_negotiate works in, only while it runs
+#define AUTOBPS_SPACE           (sizeof(fuji_baud_rates) + 2 * BAUD_TEST_SIZE)
+
+/**
+ * @brief starting from fujicom_bps, go up to the fastest speed both the
+ *        FujiNet and the UART can manage that a test pattern survives
+ * @param max_bps don't go past this, 0 for no limit
+ * @param space AUTOBPS_SPACE bytes
+ */
+extern void autobps_negotiate(uint32_t max_bps, void *space);
+
+#endif /* _AUTOBPS_H */
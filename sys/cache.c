@@ -0,0 +1,503 @@
+/**
+ * Sector cache between the block driver and the FujiNet
+ *
+ * Entries are found through a small hash table and kept on an LRU
+ * list, most recently used at the head. Unused entries are parked at
+ * the tail so they get handed out before anything is evicted. Only
+ * the table is resident, the sectors themselves live in conventional
+ * memory, an upper memory block or XMS.
+ *
+ * In write-back mode writes only mark the cached copy dirty. Dirty
+ * sectors are written out in runs by cache_flush, which gets called
+ * by the first driver request after the oldest dirty sector reaches
+ * cache_max_age, when DOS is idle, from Media_check and on request
+ * through IOCTL. Never from the timer interrupt: a flush is XMS moves
+ * and serial writes, too much for IRQ0. A dirty entry
+ * is never evicted without being written first.
+ */
+
+#include "cache.h"
+#include "diskio.h"
+#include "readahead.h"
+#include "xms.h"
+#include "ioctl.h"
+#include "timer.h"
+#include <string.h>
+#include <dos.h>
+
+#define CACHE_BUCKETS           64
+#define CACHE_NONE              0xFFFF
+#define CACHE_KEY_FREE          0xFFFFFFFFUL
+#define CACHE_SECTOR_LIMIT      0x1000000UL
+#define CACHE_KEY(unit, sector) ((uint32_t) (unit) << 24 | (sector))
+#define CACHE_HASH(key)         ((uint16_t) ((key) ^ ((key) >> 24)) & (CACHE_BUCKETS - 1))
+#define CACHE_UNIT(key)         ((uint8_t) ((key) >> 24))
+#define CACHE_SECTOR(key)       ((key) & (CACHE_SECTOR_LIMIT - 1))
+
+#define CACHE_DIRTY             0x01
+#define CACHE_PREFETCHED        0x02    // Brought in ahead of DOS asking
+
+uint8_t cache_location;
+uint16_t cache_entries;
+uint32_t cache_hits, cache_misses;
+uint16_t cache_dirty, cache_max_age;
+uint32_t cache_flushed, cache_lost;
+uint16_t cache_generation;
+uint8_t cache_written;
+uint32_t prefetch_sectors, prefetch_hits, prefetch_wasted;
+
+static cache_entry *cache_table;
+static uint16_t cache_bucket[CACHE_BUCKETS];
+static uint16_t lru_head, lru_tail;
+static uint16_t cache_where;
+static uint8_t far *flush_buf;
+static uint16_t dirty_since;
+static bool flush_failed;
+
+static void lru_unlink(uint16_t slot)
+{
+  cache_entry *entry = &cache_table[slot];
+
+
+  if (entry->lru_prev != CACHE_NONE)
+    cache_table[entry->lru_prev].lru_next = entry->lru_next;
+  else
+    lru_head = entry->lru_next;
+  if (entry->lru_next != CACHE_NONE)
+    cache_table[entry->lru_next].lru_prev = entry->lru_prev;
+  else
+    lru_tail = entry->lru_prev;
+  return;
+}
+
+static void lru_push_head(uint16_t slot)
+{
+  cache_table[slot].lru_prev = CACHE_NONE;
+  cache_table[slot].lru_next = lru_head;
+  if (lru_head != CACHE_NONE)
+    cache_table[lru_head].lru_prev = slot;
+  else
+    lru_tail = slot;
+  lru_head = slot;
+  return;
+}
+
+static void lru_push_tail(uint16_t slot)
+{
+  cache_table[slot].lru_next = CACHE_NONE;
+  cache_table[slot].lru_prev = lru_tail;
+  if (lru_tail != CACHE_NONE)
+    cache_table[lru_tail].lru_next = slot;
+  else
+    lru_head = slot;
+  lru_tail = slot;
+  return;
+}
+
+static void hash_unlink(uint16_t slot)
+{
+  uint16_t *link = &cache_bucket[CACHE_HASH(cache_table[slot].key)];
+
+
+  while (*link != slot)
+    link = &cache_table[*link].hash_next;
+  *link = cache_table[slot].hash_next;
+  return;
+}
+
+static uint16_t cache_lookup(uint32_t key)
+{
+  uint16_t slot;
+
+
+  for (slot = cache_bucket[CACHE_HASH(key)]; slot != CACHE_NONE;
+       slot = cache_table[slot].hash_next)
+    if (cache_table[slot].key == key)
+      break;
+  return slot;
+}
+
+static void cache_touch(uint16_t slot)
+{
+  lru_unlink(slot);
+  lru_push_head(slot);
+  return;
+}
+
+static void cache_clean(uint16_t slot)
+{
+  if (cache_table[slot].flags & CACHE_DIRTY) {
+    cache_table[slot].flags &= ~CACHE_DIRTY;
+    cache_dirty--;
+  }
+  return;
+}
+
+/* A prefetched sector leaving the cache without being read was a
+ * wrong guess */
+static void cache_forget_prefetch(uint16_t slot)
+{
+  if (cache_table[slot].flags & CACHE_PREFETCHED)
+    prefetch_wasted++;
+  cache_table[slot].flags &= ~CACHE_PREFETCHED;
+  return;
+}
+
+static void cache_free(uint16_t slot)
+{
+  cache_forget_prefetch(slot);
+  if (cache_table[slot].flags & CACHE_DIRTY) {
+    cache_clean(slot);
+    cache_lost++;
+  }
+  hash_unlink(slot);
+  cache_table[slot].key = CACHE_KEY_FREE;
+  lru_unlink(slot);
+  lru_push_tail(slot);
+  return;
+}
+
+static bool cache_copy_out(uint16_t slot, uint8_t far *buf)
+{
+  if (cache_location == FUJI_CACHE_XMS)
+    return xms_copy_from(cache_where, (uint32_t) slot * SECTOR_SIZE, buf, SECTOR_SIZE);
+
+  _fmemcpy(buf, MK_FP(cache_where + slot * (SECTOR_SIZE / 16), 0), SECTOR_SIZE);
+  return true;
+}
+
+static bool cache_copy_in(uint16_t slot, const uint8_t far *buf)
+{
+  cache_generation++;
+  if (cache_location == FUJI_CACHE_XMS)
+    return xms_copy_to(cache_where, (uint32_t) slot * SECTOR_SIZE, buf, SECTOR_SIZE);
+
+  _fmemcpy(MK_FP(cache_where + slot * (SECTOR_SIZE / 16), 0), buf, SECTOR_SIZE);
+  return true;
+}
+
+/* Write out the run of dirty sectors that slot belongs to */
+static bool cache_flush_run(uint16_t slot)
+{
+  uint32_t start = cache_table[slot].key;
+  uint16_t count, idx, done;
+  uint8_t unit = CACHE_UNIT(start);
+
+
+  for (count = 1; count < WRITEBACK_BATCH && CACHE_SECTOR(start); count++) {
+    idx = cache_lookup(start - 1);
+    if (idx == CACHE_NONE || !(cache_table[idx].flags & CACHE_DIRTY))
+      break;
+    start--;
+  }
+
+  for (count = 0; count < WRITEBACK_BATCH && CACHE_UNIT(start + count) == unit; count++) {
+    idx = cache_lookup(start + count);
+    if (idx == CACHE_NONE || !(cache_table[idx].flags & CACHE_DIRTY)
+        || !cache_copy_out(idx, &flush_buf[count * SECTOR_SIZE]))
+      break;
+  }
+  if (!count)
+    return false;
+
+  done = disk_write(unit, CACHE_SECTOR(start), count, flush_buf);
+  for (idx = 0; idx < done; idx++)
+    cache_clean(cache_lookup(start + idx));
+  cache_flushed += done;
+  return done == count;
+}
+
+/* Take the least recently used entry and give it a new key */
+static uint16_t cache_alloc(uint32_t key)
+{
+  uint16_t slot = lru_tail, bucket;
+
+
+  if ((cache_table[slot].flags & CACHE_DIRTY) && !cache_flush_run(slot))
+    return CACHE_NONE;
+
+  cache_forget_prefetch(slot);
+  if (cache_table[slot].key != CACHE_KEY_FREE)
+    hash_unlink(slot);
+  lru_unlink(slot);
+  lru_push_head(slot);
+
+  bucket = CACHE_HASH(key);
+  cache_table[slot].key = key;
+  cache_table[slot].flags = 0;
+  cache_table[slot].hash_next = cache_bucket[bucket];
+  cache_bucket[bucket] = slot;
+  return slot;
+}
+
+static void cache_store(uint32_t key, const uint8_t far *buf)
+{
+  uint16_t slot;
+
+
+  slot = cache_lookup(key);
+  if (slot == CACHE_NONE)
+    slot = cache_alloc(key);
+  if (slot == CACHE_NONE)
+    return;
+  if (!cache_copy_in(slot, buf))
+    cache_free(slot);
+  return;
+}
+
+void cache_setup(cache_entry *table, uint16_t entries, uint8_t location, uint16_t where)
+{
+  uint16_t idx;
+
+
+  cache_table = table;
+  cache_entries = entries;
+  cache_location = location;
+  cache_where = where;
+
+  for (idx = 0; idx < CACHE_BUCKETS; idx++)
+    cache_bucket[idx] = CACHE_NONE;
+
+  for (idx = 0; idx < entries; idx++) {
+    table[idx].key = CACHE_KEY_FREE;
+    table[idx].flags = 0;
+    table[idx].lru_prev = idx - 1;
+    table[idx].lru_next = idx + 1;
+  }
+  table[0].lru_prev = CACHE_NONE;
+  table[entries - 1].lru_next = CACHE_NONE;
+  lru_head = 0;
+  lru_tail = entries - 1;
+  return;
+}
+
+void cache_writeback(uint16_t segment, uint16_t max_age)
+{
+  flush_buf = MK_FP(segment, 0);
+  cache_max_age = max_age;
+  return;
+}
+
+uint16_t cache_read(uint8_t unit, uint32_t sector, uint16_t count, uint8_t far *buf)
+{
+  uint16_t idx, run, done, slot;
+  uint32_t key;
+
+
+  if (!cache_entries || sector + count > CACHE_SECTOR_LIMIT)
+    return readahead_read(unit, sector, count, buf);
+
+  for (idx = 0; idx < count; idx += done) {
+    key = CACHE_KEY(unit, sector + idx);
+    slot = cache_lookup(key);
+    if (slot != CACHE_NONE) {
+      if (cache_copy_out(slot, &buf[idx * SECTOR_SIZE])) {
+        cache_touch(slot);
+        cache_hits++;
+        if (cache_table[slot].flags & CACHE_PREFETCHED) {
+          cache_table[slot].flags &= ~CACHE_PREFETCHED;
+          prefetch_hits++;
+        }
+        done = 1;
+        continue;
+      }
+      cache_free(slot);
+    }
+
+    // Collect the whole run of misses so it goes out as one request
+    for (run = 1; idx + run < count && cache_lookup(key + run) == CACHE_NONE; run++)
+      ;
+    cache_misses += run;
+
+    done = readahead_read(unit, sector + idx, run, &buf[idx * SECTOR_SIZE]);
+    for (slot = 0; slot < done; slot++)
+      cache_store(key + slot, &buf[(idx + slot) * SECTOR_SIZE]);
+    if (done < run)
+      return idx + done;
+  }
+
+  return idx;
+}
+
+/* Write through. Sectors that are already cached get the new data,
+ * anything else is left alone so a big copy doesn't flush out the
+ * FAT and directory sectors. */
+static uint16_t cache_write_through(uint8_t unit, uint32_t sector, uint16_t count,
+                                    const uint8_t far *buf)
+{
+  uint16_t idx, done, slot;
+  uint32_t key;
+
+
+  done = disk_write(unit, sector, count, buf);
+  if (!cache_entries || sector + count > CACHE_SECTOR_LIMIT)
+    return done;
+
+  for (idx = 0, key = CACHE_KEY(unit, sector); idx < count; idx++, key++) {
+    slot = cache_lookup(key);
+    if (slot == CACHE_NONE)
+      continue;
+
+    // Whatever was pending is superseded by what we just wrote
+    cache_clean(slot);
+
+    // Sectors that failed to write are in an unknown state on the FujiNet
+    if (idx >= done || !cache_copy_in(slot, &buf[idx * SECTOR_SIZE]))
+      cache_free(slot);
+  }
+
+  return done;
+}
+
+uint16_t cache_write(uint8_t unit, uint32_t sector, uint16_t count, const uint8_t far *buf)
+{
+  uint16_t idx, slot;
+  uint32_t key;
+
+
+  readahead_written(unit, sector, count);
+  cache_written |= 1 << unit;
+  if (!cache_max_age || !cache_entries || sector + count > CACHE_SECTOR_LIMIT)
+    return cache_write_through(unit, sector, count, buf);
+
+  for (idx = 0, key = CACHE_KEY(unit, sector); idx < count; idx++, key++) {
+    // Don't let dirty sectors crowd out everything else
+    if (cache_dirty >= cache_entries / 2 && !cache_flush(CACHE_ALL_UNITS))
+      break;
+
+    slot = cache_lookup(key);
+    if (slot == CACHE_NONE)
+      slot = cache_alloc(key);
+    if (slot == CACHE_NONE)
+      break;
+    if (!cache_copy_in(slot, &buf[idx * SECTOR_SIZE])) {
+      cache_clean(slot);
+      cache_free(slot);
+      break;
+    }
+
+    cache_touch(slot);
+    if (!(cache_table[slot].flags & CACHE_DIRTY)) {
+      if (!cache_dirty)
+        dirty_since = BIOS_TICKS;
+      cache_table[slot].flags |= CACHE_DIRTY;
+      cache_dirty++;
+    }
+  }
+
+  // Anything the cache couldn't hold goes straight out
+  if (idx < count)
+    idx += cache_write_through(unit, sector + idx, count - idx, &buf[idx * SECTOR_SIZE]);
+  return idx;
+}
+
+bool cache_flush(uint8_t unit)
+{
+  uint16_t slot;
+
+
+  for (slot = 0; cache_dirty && slot < cache_entries; slot++)
+    if ((cache_table[slot].flags & CACHE_DIRTY)
+        && (unit == CACHE_ALL_UNITS || CACHE_UNIT(cache_table[slot].key) == unit)
+        && !cache_flush_run(slot))
+      return false;
+  return true;
+}
+
+void cache_tick(bool idle)
+{
+  if (!cache_dirty)
+    return;
+
+  // After a failure wait out a full dirty age before trying again
+  if ((!idle || flush_failed)
+      && (uint16_t) (BIOS_TICKS - dirty_since) < cache_max_age)
+    return;
+
+  flush_failed = !cache_flush(CACHE_ALL_UNITS);
+  if (flush_failed)
+    dirty_since = BIOS_TICKS;
+  return;
+}
+
+/* Copy out a cached sector without counting it as a use, false if
+ * it isn't cached */
+bool cache_get(uint8_t unit, uint32_t sector, uint8_t far *buf)
+{
+  uint16_t slot;
+
+
+  if (!cache_entries || sector >= CACHE_SECTOR_LIMIT)
+    return false;
+  slot = cache_lookup(CACHE_KEY(unit, sector));
+  return slot != CACHE_NONE && cache_copy_out(slot, buf);
+}
+
+/* Read sectors DOS hasn't asked for yet into the cache. Ones already
+ * cached are skipped and the rest go out in runs through stage. */
+void cache_prefetch(uint8_t unit, uint32_t sector, uint16_t count, uint8_t far *stage)
+{
+  uint16_t idx, run, done, slot, i;
+  uint32_t key;
+
+
+  if (!cache_entries || sector + count > CACHE_SECTOR_LIMIT)
+    return;
+
+  for (idx = 0, key = CACHE_KEY(unit, sector); idx < count; idx += run) {
+    if (cache_lookup(key + idx) != CACHE_NONE) {
+      run = 1;
+      continue;
+    }
+
+    for (run = 1; idx + run < count && cache_lookup(key + idx + run) == CACHE_NONE; run++)
+      ;
+    done = disk_read(unit, sector + idx, run, stage);
+    for (i = 0; i < done; i++) {
+      cache_store(key + idx + i, &stage[i * SECTOR_SIZE]);
+      slot = cache_lookup(key + idx + i);
+      if (slot != CACHE_NONE)
+        cache_table[slot].flags |= CACHE_PREFETCHED;
+    }
+    prefetch_sectors += done;
+    if (done < run)
+      return;
+  }
+  return;
+}
+
+/* Only fills in sectors we don't have, whatever is cached is newer */
+void cache_preload(uint8_t unit, uint32_t sector, const uint8_t far *buf)
+{
+  uint32_t key = CACHE_KEY(unit, sector);
+
+
+  if (!cache_entries || sector >= CACHE_SECTOR_LIMIT || cache_lookup(key) != CACHE_NONE)
+    return;
+  cache_store(key, buf);
+  return;
+}
+
+bool cache_peek(uint16_t slot, uint8_t far *unit, uint32_t far *sector, uint8_t far *buf)
+{
+  uint32_t key = cache_table[slot].key;
+
+
+  if (key == CACHE_KEY_FREE || (cache_table[slot].flags & CACHE_DIRTY))
+    return false;
+  *unit = CACHE_UNIT(key);
+  *sector = CACHE_SECTOR(key);
+  return cache_copy_out(slot, buf);
+}
+
+void cache_invalidate(uint8_t unit)
+{
+  uint16_t slot;
+
+
+  for (slot = 0; slot < cache_entries; slot++)
+    if (cache_table[slot].key != CACHE_KEY_FREE
+        && CACHE_UNIT(cache_table[slot].key) == unit)
+      cache_free(slot);
+  return;
+}
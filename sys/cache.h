@@ -0,0 +1,91 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Keep the resident table for a full cache around 10K
+#define CACHE_MAX_ENTRIES       1024
+
+// Sectors gathered into one WRITE_MULTI when flushing
+#define WRITEBACK_BATCH         8
+
+#define CACHE_ALL_UNITS         0xFF
+
+typedef struct {
+  uint32_t key;                 // unit << 24 | sector
+  uint16_t hash_next;
+  uint16_t lru_prev, lru_next;
+  uint8_t flags;
+} cache_entry;
+
+extern uint8_t cache_location;
+extern uint16_t cache_entries;
+extern uint32_t cache_hits, cache_misses;
+extern uint16_t cache_dirty, cache_max_age;
+extern uint32_t cache_flushed, cache_lost;
+extern uint16_t cache_generation;       // Bumped whenever cached data changes
+extern uint8_t cache_written;           // Bit per unit written, cleared by cachefile.c
+extern uint32_t prefetch_sectors, prefetch_hits, prefetch_wasted;
+
+/**
+ * @brief hand the cache its table and sector storage
+ * @param where segment for FUJI_CACHE_CONV/UMB, handle for FUJI_CACHE_XMS
+ */
+extern void cache_setup(cache_entry *table, uint16_t entries,
+                        uint8_t location, uint16_t where);
+
+/**
+ * @brief hold writes in the cache for up to max_age ticks
+ * @param segment bounce buffer of WRITEBACK_BATCH sectors
+ */
+extern void cache_writeback(uint16_t segment, uint16_t max_age);
+
+/* Same contract as disk_read/disk_write */
+extern uint16_t cache_read(uint8_t unit, uint32_t sector, uint16_t count,
+                           uint8_t far *buf);
+extern uint16_t cache_write(uint8_t unit, uint32_t sector, uint16_t count,
+                            const uint8_t far *buf);
+
+/**
+ * @brief copy a sector out of the cache without fetching it
+ * @return false if the sector isn't cached
+ */
+extern bool cache_get(uint8_t unit, uint32_t sector, uint8_t far *buf);
+
+/**
+ * @brief pull sectors into the cache before DOS asks for them
+ * @param stage buffer big enough for count sectors
+ */
+extern void cache_prefetch(uint8_t unit, uint32_t sector, uint16_t count,
+                           uint8_t far *stage);
+
+/**
+ * @brief add a sector from somewhere other than the wire, if not cached
+ */
+extern void cache_preload(uint8_t unit, uint32_t sector, const uint8_t far *buf);
+
+/**
+ * @brief copy out a clean entry by table index, false if free or dirty
+ */
+extern bool cache_peek(uint16_t slot, uint8_t far *unit, uint32_t far *sector,
+                       uint8_t far *buf);
+
+/**
+ * @brief forget everything cached for a unit, its image has changed
+ */
+extern void cache_invalidate(uint8_t unit);
+
+/**
+ * @brief write out dirty sectors for a unit or CACHE_ALL_UNITS
+ * @return false if anything could not be written
+ */
+extern bool cache_flush(uint8_t unit);
+
+/**
+ * @brief flush from INT 28h or on the way out of a driver request,
+ *        never from the timer interrupt. idle ignores the dirty age.
+ */
+extern void cache_tick(bool idle);
+
+#endif /* _CACHE_H */
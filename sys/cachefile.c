@@ -0,0 +1,340 @@
+/**
+ * Persistent warm cache
+ *
+ * Clean sectors in the cache are saved to a file on a local disk and
+ * put back into the cache after a reboot. Each sector is stored with
+ * the mount time of the image it came from and is only loaded if the
+ * same image is still mounted, so a remount or a FujiNet restart
+ * quietly throws the old data away.
+ *
+ * The mount time doesn't change when the image is written, so the
+ * header also has a bit per unit written to since its sectors were
+ * saved. The first INT 28h after a write sets the bit in the file and
+ * the next save clears it. A reset between a write and that INT 28h
+ * still leaves old sectors behind, as does an image that is written
+ * from another machine.
+ *
+ * Nothing here happens during Init_cmd or from the timer. Everything
+ * is done from INT 28h, with INT 23h and INT 24h pointed at stubs for
+ * the length of the file call so a bad local disk fails the call
+ * instead of ending the program that is waiting for input. Loading is
+ * a few sectors at a time and stops for good at the first write, the
+ * file may hold an older copy of a sector that was written straight
+ * through. Saving rewrites the whole file, at most every 30 seconds.
+ */
+
+#include "cachefile.h"
+#include "cache.h"
+#include "commands.h"
+#include "diskio.h"
+#include "fujicom.h"
+#include "fujinet.h"
+#include "timer.h"
+#include <string.h>
+#include <dos.h>
+
+#define CACHEFILE_MAGIC         "FNWC"
+#define CACHEFILE_VERSION       2
+#define CACHEFILE_LOAD_STEP     8
+#define CACHEFILE_SAVE_TICKS    (30 * TICKS_PER_SEC)
+
+#define DOS_CREATE      0x3C
+#define DOS_OPEN        0x3D
+#define DOS_CLOSE       0x3E
+#define DOS_READ        0x3F
+#define DOS_WRITE       0x40
+#define DOS_SEEK        0x42
+#define DOS_READ_ONLY   0x00
+#define DOS_READ_WRITE  0x02
+
+#pragma pack(push, 1)
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint16_t sector_size;
+  uint8_t stale;                // Units written since their sectors were saved
+} cachefile_header;
+
+typedef struct {
+  uint8_t unit;
+  uint32_t sector;
+  int32_t mount[2];             // Mount time of the image the sector came from
+} cachefile_record;
+#pragma pack(pop)
+
+enum {
+  CF_OFF = 0,
+  CF_LOAD,
+  CF_READY,
+};
+
+uint32_t cachefile_loaded;
+
+static char cachefile_path[CACHEFILE_PATH_MAX];
+static uint8_t far *stage_buf;
+static uint8_t cf_state;
+static uint32_t cf_offset;
+static uint16_t saved_generation;
+static uint16_t saved_at;
+
+// Static so their addresses are good in DS
+static cachefile_header header;
+static cachefile_record record;
+
+// Defined in iwrap.asm
+extern void crit_fail_vect(void);
+extern void break_ignore_vect(void);
+
+/* Returns handle or -1, mode only matters for DOS_OPEN */
+static int dos_open(uint8_t func, uint8_t mode)
+{
+  uint8_t f = func, m = mode;
+  uint16_t path = (uint16_t) cachefile_path, result;
+  uint8_t failed;
+
+
+  _asm {
+    mov ah, f
+    mov al, m
+    xor cx, cx
+    mov dx, path
+    int 21h
+    sbb cl, cl
+    mov result, ax
+    mov failed, cl
+  }
+  return failed ? -1 : result;
+}
+
+static void dos_close(int handle)
+{
+  uint16_t h = handle;
+
+
+  _asm {
+    push bx
+    mov ah, DOS_CLOSE
+    mov bx, h
+    int 21h
+    pop bx
+  }
+  return;
+}
+
+static bool dos_seek(int handle, uint32_t offset)
+{
+  uint16_t h = handle, hi = U32_MSW(offset), lo = U32_LSW(offset);
+  uint8_t failed;
+
+
+  _asm {
+    push bx
+    mov ax, 4200h
+    mov bx, h
+    mov cx, hi
+    mov dx, lo
+    int 21h
+    sbb cl, cl
+    mov failed, cl
+    pop bx
+  }
+  return !failed;
+}
+
+/* Read or write, true if every byte was moved */
+static bool dos_rw(uint8_t func, int handle, void far *buf, uint16_t length)
+{
+  uint8_t f = func, failed;
+  uint16_t h = handle, len = length, bseg = FP_SEG(buf), boff = FP_OFF(buf), result;
+
+
+  _asm {
+    push bx
+    push ds
+    mov ah, f
+    mov bx, h
+    mov cx, len
+    mov dx, boff
+    mov ds, bseg
+    int 21h
+    pop ds
+    sbb cl, cl
+    mov result, ax
+    mov failed, cl
+    pop bx
+  }
+  return !failed && result == length;
+}
+
+void cachefile_setup(const char *path, uint16_t segment)
+{
+  strcpy(cachefile_path, path);
+  stage_buf = MK_FP(segment, 0);
+  cf_state = CF_LOAD;
+  return;
+}
+
+static bool record_current(void)
+{
+  const int32_t *mount;
+
+
+  if (record.unit >= FN_MAX_DEV || (header.stale & (1 << record.unit))
+      || !unit_mounted(record.unit))
+    return false;
+  mount = unit_mount_time(record.unit);
+  return record.mount[0] == mount[0] && record.mount[1] == mount[1];
+}
+
+static void cachefile_load_step(void)
+{
+  int handle;
+  uint16_t idx;
+
+
+  // Need to know what's mounted before anything can be checked against it
+  if (!cf_offset && !media_refresh())
+    return;
+
+  handle = dos_open(DOS_OPEN, DOS_READ_ONLY);
+  if (handle < 0) {
+    cf_state = CF_READY;
+    return;
+  }
+
+  if (!cf_offset) {
+    if (!dos_rw(DOS_READ, handle, &header, sizeof(header))
+        || memcmp(header.magic, CACHEFILE_MAGIC, sizeof(header.magic))
+        || header.version != CACHEFILE_VERSION || header.sector_size != SECTOR_SIZE) {
+      dos_close(handle);
+      cf_state = CF_READY;
+      return;
+    }
+    cf_offset = sizeof(header);
+  }
+
+  for (idx = 0; idx < CACHEFILE_LOAD_STEP; idx++) {
+    if (!dos_seek(handle, cf_offset)
+        || !dos_rw(DOS_READ, handle, &record, sizeof(record))
+        || !dos_rw(DOS_READ, handle, stage_buf, SECTOR_SIZE)) {
+      cf_state = CF_READY;
+      break;
+    }
+    cf_offset += sizeof(record) + SECTOR_SIZE;
+
+    if (record_current()) {
+      cache_preload(record.unit, record.sector, stage_buf);
+      cachefile_loaded++;
+    }
+  }
+  dos_close(handle);
+
+  // What's in the cache now matches the file
+  if (cf_state == CF_READY) {
+    saved_generation = cache_generation;
+    saved_at = BIOS_TICKS;
+  }
+  return;
+}
+
+static void cachefile_save(void)
+{
+  int handle;
+  uint16_t slot;
+  const int32_t *mount;
+
+
+  saved_at = BIOS_TICKS;
+  handle = dos_open(DOS_CREATE, 0);
+  if (handle < 0)
+    return;
+
+  // Whatever was written has reached the cache or isn't in it
+  memcpy(header.magic, CACHEFILE_MAGIC, sizeof(header.magic));
+  header.version = CACHEFILE_VERSION;
+  header.sector_size = SECTOR_SIZE;
+  header.stale = 0;
+  cache_written = 0;
+  if (!dos_rw(DOS_WRITE, handle, &header, sizeof(header)))
+    goto done;
+
+  for (slot = 0; slot < cache_entries; slot++) {
+    if (!cache_peek(slot, &record.unit, &record.sector, stage_buf)
+        || !unit_mounted(record.unit))
+      continue;
+
+    mount = unit_mount_time(record.unit);
+    record.mount[0] = mount[0];
+    record.mount[1] = mount[1];
+    if (!dos_rw(DOS_WRITE, handle, &record, sizeof(record))
+        || !dos_rw(DOS_WRITE, handle, stage_buf, SECTOR_SIZE))
+      goto done;
+  }
+  saved_generation = cache_generation;
+
+ done:
+  dos_close(handle);
+  return;
+}
+
+/* Flag the units written since the last save in the file's header,
+ * their saved sectors may be older than the image now */
+static void cachefile_mark_stale(void)
+{
+  int handle;
+
+
+  // Nothing saved, nothing to go stale
+  handle = dos_open(DOS_OPEN, DOS_READ_WRITE);
+  if (handle >= 0) {
+    if (dos_rw(DOS_READ, handle, &header, sizeof(header))
+        && !memcmp(header.magic, CACHEFILE_MAGIC, sizeof(header.magic))
+        && header.version == CACHEFILE_VERSION) {
+      header.stale |= cache_written;
+      // A file that can't be kept honest isn't used again this boot
+      if (!dos_seek(handle, 0) || !dos_rw(DOS_WRITE, handle, &header, sizeof(header)))
+        cf_state = CF_OFF;
+    }
+    dos_close(handle);
+  }
+  cache_written = 0;
+  return;
+}
+
+static bool cachefile_save_due(void)
+{
+  return (cache_generation != saved_generation || header.stale)
+    && (uint16_t) (BIOS_TICKS - saved_at) >= CACHEFILE_SAVE_TICKS;
+}
+
+void cachefile_tick(void)
+{
+  void far *old_break, *old_crit;
+
+
+  // INT 28h comes round often, don't touch the vectors for nothing
+  if (cf_state == CF_OFF
+      || (cf_state == CF_READY && !cache_written && !cachefile_save_due()))
+    return;
+
+  old_break = _dos_getvect(0x23);
+  old_crit = _dos_getvect(0x24);
+  _dos_setvect(0x23, MK_FP(getCS(), (uint16_t) break_ignore_vect));
+  _dos_setvect(0x24, MK_FP(getCS(), (uint16_t) crit_fail_vect));
+
+  if (cache_written) {
+    // A sector written through may be older in the file than on the image
+    if (cf_state == CF_LOAD)
+      cf_state = CF_READY;
+    cachefile_mark_stale();
+  }
+
+  if (cf_state == CF_LOAD)
+    cachefile_load_step();
+  else if (cachefile_save_due())
+    cachefile_save();
+
+  _dos_setvect(0x24, old_crit);
+  _dos_setvect(0x23, old_break);
+  return;
+}
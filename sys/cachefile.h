@@ -0,0 +1,22 @@
+#ifndef _CACHEFILE_H
+#define _CACHEFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CACHEFILE_PATH_MAX      64
+
+extern uint32_t cachefile_loaded;
+
+/**
+ * @brief keep the sector cache warm across reboots in a local file
+ * @param segment staging buffer of one sector
+ */
+extern void cachefile_setup(const char *path, uint16_t segment);
+
+/**
+ * @brief load or save a piece of the file, only from INT 28h
+ */
+extern void cachefile_tick(void);
+
+#endif /* _CACHEFILE_H */
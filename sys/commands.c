@@ -4,14 +4,20 @@
 #include "fujicom.h"
 #include "print.h"
 #include "ioctl.h"
+#include "diskio.h"
+#include "cache.h"
+#include "readahead.h"
+#include "timer.h"
+#include "hydrate.h"
+#include "cachefile.h"
+#include "fatchain.h"
+#include "compress.h"
 #include <fuji_f5.h>
 #include <string.h>
 #include <dos.h>
 
 #undef DEBUG
 
-#define SECTOR_SIZE     512
-
 extern void End_code(void);
 
 DOS_BPB fn_bpb_table[FN_MAX_DEV];
@@ -21,90 +27,175 @@ DOS_BPB *fn_bpb_pointers[FN_MAX_DEV + 1]; // leave room for the NULL terminator
 static cmdFrame_t cmd; // FIXME - make this shared with init.c?
 #endif /* OBSOLETE */
 
-// time_t on FujiNet is 64 bits but that is too large to work
-// with. Allocate twice as many 32b bit ints.
-static int32_t mount_status[FN_MAX_DEV * 2];
+// Laid out the way FUJICMD_GET_MEDIA_STATE replies so both arrive in
+// one call
+static struct {
+  // time_t on FujiNet is 64 bits but that is too large to work
+  // with. Allocate twice as many 32b bit ints.
+  int32_t mount_status[FN_MAX_DEV * 2];
+  deviceSlot_t disk_slots[FN_MAX_DEV];
+} media;
 
-static deviceSlot_t disk_slots[FN_MAX_DEV];
+// Units whose image changed since DOS last asked about them
+static uint8_t media_changed[FN_MAX_DEV];
+static uint16_t media_checked;
+static bool media_valid;
 
-uint16_t Media_check_cmd(SYSREQ far *req)
+// Mount time of the image each BPB in fn_bpb_table was read from
+static int32_t bpb_mount[FN_MAX_DEV * 2];
+
+uint16_t media_check_ticks;
+bool is_pcjr;
+
+uint32_t unit_sectors(uint8_t unit)
 {
-  int reply;
-  int64_t old_status, new_status;
+  if (fn_bpb_table[unit].num_sectors)
+    return fn_bpb_table[unit].num_sectors;
+  return fn_bpb_table[unit].num_sectors_32;
+}
 
-  int i=0;
+/* Fetch mount times and slot modes for every unit. A change for any
+ * unit is remembered until DOS asks about that unit. */
+bool media_refresh(void)
+{
+  int32_t old_mount[FN_MAX_DEV * 2];
+  int i;
 
-  // Avoid race condition that only happens on PCjr systems
-  // I do not know why this works. -Thom
-  for (i=0;i<8192;i++);
 
-  if (req->unit >= FN_MAX_DEV) {
-    consolef("Invalid Media Check unit: %i\n", req->unit);
-    return ERROR_BIT | UNKNOWN_UNIT;
+  if (is_pcjr) {
+    // Avoid race condition that only happens on PCjr systems
+    // I do not know why this works. -Thom
+    for (i=0;i<8192;i++);
   }
 
-  old_status = mount_status[req->unit * 2];
-
-  if (!fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_STATUS, FUJI_FIELD_A1,
-                     STATUS_MOUNT_TIME, 0, 0, 0,
-                     NULL, 0, mount_status, sizeof(mount_status)))
-    return ERROR_BIT | NOT_READY;
+  _fmemcpy(old_mount, media.mount_status, sizeof(old_mount));
 
-  // Get read/write state while we're at it
-  if (!fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_READ_DEVICE_SLOTS, FUJI_FIELD_C1234,
-                     0, 0, 0, 0,
-                     NULL, 0, disk_slots, sizeof(disk_slots)))
-    return ERROR_BIT | NOT_READY;
+  if (fujicom_caps & FUJI_CAP_MEDIA_STATE) {
+    if (!fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_GET_MEDIA_STATE, FUJI_FIELD_A1,
+                       STATUS_MOUNT_TIME, 0, 0, 0,
+                       NULL, 0, &media, sizeof(media)))
+      return false;
+  }
+  else {
+    if (!fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_STATUS, FUJI_FIELD_A1,
+                       STATUS_MOUNT_TIME, 0, 0, 0,
+                       NULL, 0, media.mount_status, sizeof(media.mount_status)))
+      return false;
+
+    // Get read/write state while we're at it
+    if (!fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_READ_DEVICE_SLOTS, FUJI_FIELD_C1234,
+                       0, 0, 0, 0,
+                       NULL, 0, media.disk_slots, sizeof(media.disk_slots)))
+      return false;
+  }
 
 #if 0
-  consolef("UNIT: %i\n", req->unit);
-  consolef("MOUNT STATUS reply: 0x%04x\n", reply);
-  dumpHex(mount_status, sizeof(mount_status));
+  dumpHex(media.mount_status, sizeof(media.mount_status));
 #endif
 
-  new_status = mount_status[req->unit * 2];
+  // Any unit whose image changed has stale sectors in the cache
+  for (i = 0; i < FN_MAX_DEV; i++)
+    if (old_mount[i * 2] != media.mount_status[i * 2]
+        || old_mount[i * 2 + 1] != media.mount_status[i * 2 + 1]) {
+      media_changed[i] = 1;
+      cache_invalidate(i);
+      readahead_invalidate(i);
+      hydrate_drop(i);
+    }
+
+  media_checked = BIOS_TICKS;
+  media_valid = true;
+  return true;
+}
+
+uint16_t Media_check_cmd(SYSREQ far *req)
+{
+  uint8_t unit = req->unit;
+
+
+  if (unit >= FN_MAX_DEV) {
+    consolef("Invalid Media Check unit: %i\n", unit);
+    return ERROR_BIT | UNKNOWN_UNIT;
+  }
+
+  // DOS asks before nearly every directory operation, a recent answer is good enough
+  if (!media_valid || (uint16_t) (BIOS_TICKS - media_checked) >= media_check_ticks)
+    if (!media_refresh())
+      return ERROR_BIT | NOT_READY;
 
 #if 0
-  consolef("MEDIA CHECK: 0x%08lx == 0x%08lx\n", (uint32_t) old_status, (uint32_t) new_status);
+  consolef("MEDIA CHECK %i: 0x%08lx %i\n", unit, media.mount_status[unit * 2], media_changed[unit]);
 #endif
 
-  if (!new_status)
+  if (!media.mount_status[unit * 2])
     req->media.return_info = 0;
-  else if (old_status != new_status)
+  else if (media_changed[unit])
     req->media.return_info = -1;
-  else
+  else {
     req->media.return_info = 1;
 
+    // Keep the write-back window short around directory operations
+    cache_flush(unit);
+  }
+  media_changed[unit] = 0;
+
   return OP_COMPLETE;
 }
 
-uint16_t Build_bpb_cmd(SYSREQ far *req)
+bool unit_mounted(uint8_t unit)
 {
-  int reply;
-  uint8_t far *buf;
+  return media.mount_status[unit * 2] || media.mount_status[unit * 2 + 1];
+}
+
+const int32_t *unit_mount_time(uint8_t unit)
+{
+  return &media.mount_status[unit * 2];
+}
+
+/* Load a unit's BPB from its boot sector, unless the one we have came
+ * from the image that is mounted right now. Returns false if the boot
+ * sector couldn't be read. */
+bool bpb_refresh(uint8_t unit, uint8_t far *buf)
+{
+  int32_t *mount = &media.mount_status[unit * 2];
+
+
+  if (unit_mounted(unit) && bpb_mount[unit * 2] == mount[0]
+      && bpb_mount[unit * 2 + 1] == mount[1])
+    return true;
+
+  if (!cache_read(unit, 0, 1, buf))
+    return false;
+
+  _fmemcpy(&fn_bpb_table[unit], &buf[0x0b], sizeof(DOS_BPB));
+  bpb_mount[unit * 2] = mount[0];
+  bpb_mount[unit * 2 + 1] = mount[1];
 
+  // Now that we know how big the image is
+  if (unit_mounted(unit))
+    hydrate_start(unit, unit_sectors(unit));
 
+#if 0
+  consolef("BPB for %i\n", unit);
+  dumpHex((uint8_t far *) &fn_bpb_table[unit], sizeof(DOS_BPB));
+#endif
+
+  return true;
+}
+
+uint16_t Build_bpb_cmd(SYSREQ far *req)
+{
   if (req->unit >= FN_MAX_DEV) {
     consolef("Invalid BPB unit: %i\n", req->unit);
     return ERROR_BIT | UNKNOWN_UNIT;
   }
 
   // DOS gave us a buffer to use
-  buf = req->bpb.buffer_ptr;
-  if (!fuji_bus_call(FUJI_DEVICEID_DISK + req->unit, FUJICMD_READ, FUJI_FIELD_C1234,
-                     0, 0, 0, 0,
-                     NULL, 0, buf, SECTOR_SIZE)) {
-    consolef("FujiNet read fail: %i\n", reply);
+  if (!bpb_refresh(req->unit, req->bpb.buffer_ptr)) {
+    consolef("FujiNet read fail: %i\n", req->unit);
     return ERROR_BIT | READ_FAULT;
   }
 
-  _fmemcpy(fn_bpb_pointers[req->unit], &buf[0x0b], sizeof(DOS_BPB));
-
-#if 0
-  consolef("BPB for %i\n", req->unit);
-  dumpHex((uint8_t far *) fn_bpb_pointers[req->unit], sizeof(DOS_BPB));
-#endif
-
   req->bpb.table = MK_FP(getCS(), fn_bpb_pointers[req->unit]);
 
   return OP_COMPLETE;
@@ -136,6 +227,86 @@ uint16_t Ioctl_input_cmd(SYSREQ far *req)
   _fmemcpy(query->signature, "FUJI", 4);
   query->unit = req->unit;
 
+  if (query->query == FUJI_IOCTL_CACHE_STATS) {
+    fuji_ioctl_cache_stats far *stats = (fuji_ioctl_cache_stats far *) query;
+
+
+    if (req->io.count < sizeof(*stats))
+      return ERROR_BIT | UNKNOWN_CMD;
+    stats->location = cache_location;
+    stats->sectors = cache_entries;
+    stats->hits = cache_hits;
+    stats->misses = cache_misses;
+    stats->max_age = cache_max_age;
+    stats->dirty = cache_dirty;
+    stats->flushed = cache_flushed;
+    stats->lost = cache_lost;
+    stats->warm = cachefile_loaded;
+  }
+  else if (query->query == FUJI_IOCTL_READAHEAD_STATS) {
+    fuji_ioctl_readahead_stats far *stats = (fuji_ioctl_readahead_stats far *) query;
+
+
+    if (req->io.count < sizeof(*stats))
+      return ERROR_BIT | UNKNOWN_CMD;
+    stats->window = readahead_window;
+    stats->fetched = readahead_fetched;
+    stats->hits = readahead_hits;
+    stats->wasted = readahead_wasted;
+  }
+  else if (query->query == FUJI_IOCTL_HYDRATE_STATS) {
+    fuji_ioctl_hydrate_stats far *stats = (fuji_ioctl_hydrate_stats far *) query;
+
+
+    if (req->io.count < sizeof(*stats))
+      return ERROR_BIT | UNKNOWN_CMD;
+    stats->max_kb = hydrate_max_kb;
+    stats->sectors = hydrate_units[req->unit].total;
+    stats->hydrated = hydrate_units[req->unit].done;
+  }
+  else if (query->query == FUJI_IOCTL_FATCHAIN_STATS) {
+    fuji_ioctl_fatchain_stats far *stats = (fuji_ioctl_fatchain_stats far *) query;
+
+
+    if (req->io.count < sizeof(*stats))
+      return ERROR_BIT | UNKNOWN_CMD;
+    stats->window = fatchain_window;
+    stats->prefetched = prefetch_sectors;
+    stats->hits = prefetch_hits;
+    stats->wasted = prefetch_wasted;
+  }
+  else if (query->query == FUJI_IOCTL_BUS_STATS) {
+    fuji_ioctl_bus_stats far *stats = (fuji_ioctl_bus_stats far *) query;
+
+
+    if (req->io.count < sizeof(*stats))
+      return ERROR_BIT | UNKNOWN_CMD;
+    stats->retries = fujicom_retries;
+    stats->short_ticks = fujicom_timeouts[FUJI_TIMEOUT_SHORT];
+    stats->slow_ticks = fujicom_timeouts[FUJI_TIMEOUT_SLOW];
+    stats->long_ticks = fujicom_timeouts[FUJI_TIMEOUT_LONG];
+    stats->calls = fujicom_stats.calls;
+    stats->retried = fujicom_stats.retries;
+    stats->timeouts = fujicom_stats.timeouts;
+    stats->bad_frames = fujicom_stats.bad_frames;
+    stats->naks = fujicom_stats.naks;
+    stats->failed = fujicom_stats.failures;
+  }
+  else if (query->query == FUJI_IOCTL_COMPRESS_STATS) {
+    fuji_ioctl_compress_stats far *stats = (fuji_ioctl_compress_stats far *) query;
+
+
+    if (req->io.count < sizeof(*stats))
+      return ERROR_BIT | UNKNOWN_CMD;
+    stats->caps = fujicom_caps & (FUJI_CAP_RLE | FUJI_CAP_LZ);
+    stats->read_raw = compress_stats.read_raw;
+    stats->read_wire = compress_stats.read_wire;
+    stats->write_raw = compress_stats.write_raw;
+    stats->write_wire = compress_stats.write_wire;
+    stats->decode_clocks = compress_stats.decode_clocks;
+    stats->encode_clocks = compress_stats.encode_clocks;
+  }
+
   return OP_COMPLETE;
 }
 
@@ -163,30 +334,24 @@ uint16_t Input_cmd(SYSREQ far *req)
   else
     sector = req->io.start_sector;
 
-  if (fn_bpb_table[req->unit].num_sectors)
-    sector_max = fn_bpb_table[req->unit].num_sectors;
-  else
-    sector_max = fn_bpb_table[req->unit].num_sectors_32;
+  sector_max = unit_sectors(req->unit);
 
 #if 0
   consolef("SECTOR: %i 0x%08lx %i SM: %i\n", req->length, sector, req->io.count, sector_max);
 #endif
 
-  for (idx = 0; idx < req->io.count; idx++, sector++) {
-    if (sector >= sector_max) {
-      consolef("FN Invalid sector read %li on %i\n", sector, req->unit);
-      return ERROR_BIT | NOT_FOUND;
-    }
-
-    if (!fuji_bus_call(FUJI_DEVICEID_DISK + req->unit, FUJICMD_READ, FUJI_FIELD_C1234,
-                       U16_LSB(U32_LSW(sector)), U16_MSB(U32_LSW(sector)),
-                       U16_LSB(U32_MSW(sector)), U16_MSB(U32_MSW(sector)),
-                       NULL, 0, &buf[idx * SECTOR_SIZE], SECTOR_SIZE))
-      break;
+  if (sector >= sector_max || req->io.count > sector_max - sector) {
+    consolef("FN Invalid sector read %li on %i\n",
+             sector < sector_max ? sector_max : sector, req->unit);
+    return ERROR_BIT | NOT_FOUND;
   }
+
+  idx = cache_read(req->unit, sector, req->io.count, buf);
   if (!idx)
     return ERROR_BIT | GENERAL_FAIL;
 
+  fatchain_read(req->unit, sector, idx);
+
   req->io.count = idx;
   return OP_COMPLETE;
 }
@@ -220,7 +385,7 @@ uint16_t Output_cmd(SYSREQ far *req)
     return ERROR_BIT | UNKNOWN_UNIT;
   }
 
-  if (disk_slots[req->unit].mode != SLOT_READWRITE)
+  if (media.disk_slots[req->unit].mode != SLOT_READWRITE)
     return ERROR_BIT | WRITE_PROTECT;
 
   if (req->length > 22)
@@ -228,27 +393,19 @@ uint16_t Output_cmd(SYSREQ far *req)
   else
     sector = req->io.start_sector;
 
-  if (fn_bpb_table[req->unit].num_sectors)
-    sector_max = fn_bpb_table[req->unit].num_sectors;
-  else
-    sector_max = fn_bpb_table[req->unit].num_sectors_32;
+  sector_max = unit_sectors(req->unit);
 
 #if 0
   consolef("WRITE SECTOR: %i 0x%08lx %i\n", req->length, sector, req->io.count);
 #endif
 
-  for (idx = 0; idx < req->io.count; idx++, sector++) {
-    if (sector >= sector_max) {
-      consolef("FN Invalid sector write %i on %i:\n", sector, req->unit);
-      return ERROR_BIT | NOT_FOUND;
-    }
-
-    if (!fuji_bus_call(FUJI_DEVICEID_DISK + req->unit, FUJICMD_WRITE, FUJI_FIELD_C1234,
-                       U16_LSB(U32_LSW(sector)), U16_MSB(U32_LSW(sector)),
-                       U16_LSB(U32_MSW(sector)), U16_MSB(U32_MSW(sector)),
-                       &buf[idx * SECTOR_SIZE], SECTOR_SIZE, NULL, 0))
-      break;
+  if (sector >= sector_max || req->io.count > sector_max - sector) {
+    consolef("FN Invalid sector write %li on %i:\n",
+             sector < sector_max ? sector_max : sector, req->unit);
+    return ERROR_BIT | NOT_FOUND;
   }
+
+  idx = cache_write(req->unit, sector, req->io.count, buf);
   if (!idx)
     return ERROR_BIT | GENERAL_FAIL;
 
@@ -275,6 +432,15 @@ uint16_t Output_flush_cmd(SYSREQ far *req)
 
 uint16_t Ioctl_output_cmd(SYSREQ far *req)
 {
+  fuji_ioctl_query far *query = (fuji_ioctl_query far *) req->io.buffer_ptr;
+
+
+  if (req->io.count >= sizeof(*query) && query->query == FUJI_IOCTL_FLUSH) {
+    if (!cache_flush(CACHE_ALL_UNITS))
+      return ERROR_BIT | WRITE_FAULT;
+    return OP_COMPLETE;
+  }
+
   consolef("IOCTL OUTPUT CALLED\n");
   return UNKNOWN_CMD;
 }
@@ -3,6 +3,7 @@
 
 #include "sys_hdr.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 extern __segment getCS(void);
 #pragma aux getCS = \
@@ -11,6 +12,15 @@ extern __segment getCS(void);
 extern DOS_BPB fn_bpb_table[];
 extern DOS_BPB *fn_bpb_pointers[];
 
+extern uint16_t media_check_ticks;
+extern bool is_pcjr;
+
+extern uint32_t unit_sectors(uint8_t unit);
+extern bool media_refresh(void);
+extern bool unit_mounted(uint8_t unit);
+extern const int32_t *unit_mount_time(uint8_t unit);
+extern bool bpb_refresh(uint8_t unit, uint8_t far *buf);
+
 extern uint16_t Init_cmd(SYSREQ far *req);
 extern uint16_t Media_check_cmd(SYSREQ far *req);
 extern uint16_t Build_bpb_cmd(SYSREQ far *req);
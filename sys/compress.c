@@ -0,0 +1,186 @@
+/**
+ * FujiBus payload compression
+ *
+ * A compressed payload starts with its decoded length, two bytes
+ * little endian, followed by tokens:
+ *
+ *   00-7F  n + 1 literal bytes follow
+ *   80-BF  repeat the next byte n - 0x80 + 3 times
+ *   C0-FF  copy n - 0xC0 + 3 bytes from a distance given by the next
+ *          two bytes, little endian, back in the decoded output (LZ)
+ *
+ * Output that stops short of the decoded length is padded with zeros,
+ * so an all zero sector is nothing but its length. A compressed reply
+ * has to decode to exactly the length that was asked for. The driver only
+ * sends literals and repeats, working out matches is too slow on an
+ * 8088, but it decodes all three. Replies are decoded in place: the
+ * compressed bytes are moved to the end of the buffer and decoded
+ * towards the front, so the FujiNet must not send a reply whose
+ * output would catch up with its input.
+ */
+
+#include "compress.h"
+#include "fujicom.h"
+#include "timing.h"
+#include <fuji_f5.h>
+#include <string.h>
+#include <dos.h>
+
+#define TOKEN_REPEAT    0x80
+#define TOKEN_MATCH     0xC0
+#define LITERAL_MAX     128
+#define RUN_MIN         3
+#define RUN_MAX         (0x40 + RUN_MIN - 1)
+
+compress_counters compress_stats;
+uint8_t *compress_buf;
+static uint16_t compress_size;
+
+void compress_setup(uint8_t *buf, uint16_t size)
+{
+  compress_buf = buf;
+  compress_size = size;
+  return;
+}
+
+bool compress_eligible(uint8_t device, uint8_t command)
+{
+  if (!(fujicom_caps & FUJI_CAP_RLE))
+    return false;
+
+  if (device >= FUJI_DEVICEID_DISK && device <= FUJI_DEVICEID_DISK_LAST)
+    return command == FUJICMD_READ || command == FUJICMD_WRITE
+      || command == FUJICMD_READ_MULTI || command == FUJICMD_WRITE_MULTI;
+
+  if (device >= FUJI_DEVICEID_NETWORK && device <= FUJI_DEVICEID_NETWORK_LAST)
+    return command == FUJICMD_READ || command == FUJICMD_WRITE;
+
+  return false;
+}
+
+uint16_t compress_encode(const uint8_t far *src, uint16_t len)
+{
+  uint16_t idx, run, out, literal, max, end;
+  uint32_t start;
+
+
+  if (!compress_buf || len < COMPRESS_MIN)
+    return 0;
+
+  start = timing_now();
+
+  // Has to come out smaller or it isn't worth it
+  max = len - 1 < compress_size ? len - 1 : compress_size;
+
+  compress_buf[0] = len & 0xFF;
+  compress_buf[1] = len >> 8;
+  out = 2;
+
+  // Trailing zeros are implied by the length
+  for (end = len; end && !src[end - 1]; end--)
+    ;
+
+  for (idx = 0, literal = 0; idx < end; ) {
+    for (run = 1; idx + run < end && run < RUN_MAX && src[idx + run] == src[idx]; run++)
+      ;
+
+    if (run < RUN_MIN) {
+      // Start a new literal token or grow the current one
+      if (!literal || compress_buf[literal] == LITERAL_MAX - 1) {
+        if (out + 2 > max)
+          return 0;
+        literal = out++;
+        compress_buf[literal] = 0;
+      }
+      else {
+        if (out + 1 > max)
+          return 0;
+        compress_buf[literal]++;
+      }
+      compress_buf[out++] = src[idx++];
+      continue;
+    }
+
+    if (out + 2 > max)
+      return 0;
+    compress_buf[out++] = TOKEN_REPEAT + run - RUN_MIN;
+    compress_buf[out++] = src[idx];
+    idx += run;
+    literal = 0;
+  }
+
+  if (start)
+    compress_stats.encode_clocks += timing_now() - start;
+  compress_stats.write_raw += len;
+  compress_stats.write_wire += out;
+  return out;
+}
+
+uint16_t compress_decode(uint8_t far *buf, uint16_t len, uint16_t size)
+{
+  uint16_t in, out, decoded, count, distance;
+  uint8_t token;
+  uint32_t start;
+
+
+  if (len < 2)
+    return 0;
+
+  start = timing_now();
+
+  // Decode towards the front from the end of the buffer
+  in = size - len;
+  _fmemmove(&buf[in], buf, len);
+  decoded = buf[in] | buf[in + 1] << 8;
+  in += 2;
+  // Anything else is a reply to some other request
+  if (decoded != size)
+    return 0;
+
+  for (out = 0; in < size; ) {
+    token = buf[in++];
+
+    if (token < TOKEN_REPEAT) {
+      count = token + 1;
+      if (out + count > decoded || in + count > size)
+        return 0;
+      // Output is behind input, a forward copy is safe
+      for (; count; count--)
+        buf[out++] = buf[in++];
+      continue;
+    }
+
+    count = (token & 0x3F) + RUN_MIN;
+    if (out + count > decoded)
+      return 0;
+
+    if (token < TOKEN_MATCH) {
+      if (in >= size)
+        return 0;
+      token = buf[in++];
+      if (out + count > in)
+        return 0;
+      _fmemset(&buf[out], token, count);
+      out += count;
+      continue;
+    }
+
+    if (in + 2 > size)
+      return 0;
+    distance = buf[in] | buf[in + 1] << 8;
+    in += 2;
+    if (!distance || distance > out || out + count > in)
+      return 0;
+    // Byte at a time, a match may overlap its own output
+    for (; count; count--, out++)
+      buf[out] = buf[out - distance];
+  }
+
+  _fmemset(&buf[out], 0, decoded - out);
+
+  if (start)
+    compress_stats.decode_clocks += timing_now() - start;
+  compress_stats.read_raw += decoded;
+  compress_stats.read_wire += len;
+  return decoded;
+}
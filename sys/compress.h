@@ -0,0 +1,48 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bit in the FujiBus header fields byte, the payload is compressed */
+#define FUJI_FIELD_COMPRESSED   0x80
+
+// Smallest payload worth trying to compress
+#define COMPRESS_MIN            64
+
+typedef struct {
+  uint32_t read_raw;            // Reply bytes after decoding
+  uint32_t read_wire;           // The same replies as they came over the line
+  uint32_t write_raw;           // Payload bytes before encoding
+  uint32_t write_wire;          // The same payloads as they were sent
+  uint32_t decode_clocks;       // PIT clocks spent decoding, needs TIMING
+  uint32_t encode_clocks;       // PIT clocks spent encoding, needs TIMING
+} compress_counters;
+
+extern compress_counters compress_stats;
+
+/**
+ * @brief give the encoder somewhere to put compressed writes
+ */
+extern void compress_setup(uint8_t *buf, uint16_t size);
+
+/**
+ * @brief does this command carry a payload that may be compressed
+ */
+extern bool compress_eligible(uint8_t device, uint8_t command);
+
+/**
+ * @brief compress len bytes of src into the encoder buffer
+ * @return compressed length, 0 if it didn't come out any smaller
+ */
+extern uint16_t compress_encode(const uint8_t far *src, uint16_t len);
+extern uint8_t *compress_buf;
+
+/**
+ * @brief decode a compressed reply of len bytes in place
+ * @param size room in buf, the reply must decode to exactly this
+ * @return decoded length, 0 if the reply is bad
+ */
+extern uint16_t compress_decode(uint8_t far *buf, uint16_t len, uint16_t size);
+
+#endif /* _COMPRESS_H */
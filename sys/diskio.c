@@ -0,0 +1,179 @@
+/**
+ * Sector transfers between the block driver and FujiNet disk devices
+ */
+
+#include "diskio.h"
+#include "fujicom.h"
+#include "hydrate.h"
+#include <fuji_f5.h>
+
+#undef DEBUG
+
+#ifdef DEBUG
+#include "print.h"
+#endif
+
+/* READ_MULTI/WRITE_MULTI carry the starting sector in aux1-aux3 and
+   the count in aux4 */
+#define MULTI_SECTOR_LIMIT      0x1000000UL
+
+/* Each bit in the status bitmap is one sector, LSB of the first byte
+   is the first sector. Count how many succeeded before the first
+   failure since that's all DOS can be told about. */
+static uint16_t leading_ok(const uint8_t far *bitmap, uint16_t count)
+{
+  uint16_t idx;
+
+
+  for (idx = 0; idx < count; idx++)
+    if (!(bitmap[idx >> 3] & (1 << (idx & 7))))
+      break;
+  return idx;
+}
+
+static uint8_t use_multi(uint32_t sector, uint16_t count)
+{
+  return (fujicom_caps & FUJI_CAP_MULTI_SECTOR) && count > 1
+    && sector + count <= MULTI_SECTOR_LIMIT;
+}
+
+/* Without multi-sector transfers keep a few single sector reads in
+   flight, so the FujiNet is looking up the next sector while this one
+   is still coming down the line */
+static uint16_t wire_read_tagged(uint8_t unit, uint32_t sector, uint16_t count,
+                                 uint8_t far *buf)
+{
+  uint16_t idx, sent, left;
+  uint8_t tags[FUJI_TAGS_MAX];
+  uint32_t next;
+
+
+  for (idx = sent = 0; idx < count; idx++) {
+    for (; sent < count && sent - idx < FUJI_TAGS_MAX; sent++) {
+      next = sector + sent;
+      tags[sent % FUJI_TAGS_MAX] =
+        fuji_bus_submit(FUJI_DEVICEID_DISK + unit, FUJICMD_READ, FUJI_FIELD_C1234,
+                        U16_LSB(U32_LSW(next)), U16_MSB(U32_LSW(next)),
+                        U16_LSB(U32_MSW(next)), U16_MSB(U32_MSW(next)),
+                        NULL, 0, NULL, 0, &buf[sent * SECTOR_SIZE], SECTOR_SIZE);
+      if (!tags[sent % FUJI_TAGS_MAX])
+        break;
+    }
+
+    // Nothing could be tagged, let the caller do it the slow way
+    if (sent == idx)
+      break;
+
+    if (!fuji_bus_wait(tags[idx % FUJI_TAGS_MAX])) {
+      // The caller tries this one again on its own, free the rest
+      for (left = idx + 1; left < sent; left++)
+        fuji_bus_wait(tags[left % FUJI_TAGS_MAX]);
+      return idx;
+    }
+  }
+  return idx;
+}
+
+uint16_t wire_read(uint8_t unit, uint32_t sector, uint16_t count, uint8_t far *buf)
+{
+  uint16_t idx, chunk, ok;
+  uint8_t bitmap[DISKIO_MULTI_MAX / 8];
+
+
+  if (use_multi(sector, count)) {
+    for (idx = 0; idx < count; idx += ok, sector += ok) {
+      chunk = count - idx;
+      if (chunk > DISKIO_MULTI_MAX)
+        chunk = DISKIO_MULTI_MAX;
+
+      if (!fuji_bus_call_status(FUJI_DEVICEID_DISK + unit, FUJICMD_READ_MULTI, FUJI_FIELD_C1234,
+                                U16_LSB(U32_LSW(sector)), U16_MSB(U32_LSW(sector)),
+                                U16_LSB(U32_MSW(sector)), chunk,
+                                NULL, 0, bitmap, (chunk + 7) / 8,
+                                &buf[idx * SECTOR_SIZE], chunk * SECTOR_SIZE))
+        break;
+
+      ok = leading_ok(bitmap, chunk);
+#ifdef DEBUG
+      if (ok < chunk)
+        consolef("READ_MULTI %li: %i of %i\n", sector, ok, chunk);
+#endif
+      if (ok < chunk)
+        return idx + ok;
+    }
+    return idx;
+  }
+
+  idx = 0;
+  if (count > 1 && (fujicom_caps & FUJI_CAP_TAGGED)) {
+    idx = wire_read_tagged(unit, sector, count, buf);
+    sector += idx;
+  }
+
+  for (; idx < count; idx++, sector++) {
+    if (!fuji_bus_call(FUJI_DEVICEID_DISK + unit, FUJICMD_READ, FUJI_FIELD_C1234,
+                       U16_LSB(U32_LSW(sector)), U16_MSB(U32_LSW(sector)),
+                       U16_LSB(U32_MSW(sector)), U16_MSB(U32_MSW(sector)),
+                       NULL, 0, &buf[idx * SECTOR_SIZE], SECTOR_SIZE))
+      break;
+  }
+  return idx;
+}
+
+uint16_t wire_write(uint8_t unit, uint32_t sector, uint16_t count, const uint8_t far *buf)
+{
+  uint16_t idx, chunk, ok;
+  uint8_t bitmap[DISKIO_MULTI_MAX / 8];
+
+
+  if (use_multi(sector, count)) {
+    for (idx = 0; idx < count; idx += ok, sector += ok) {
+      chunk = count - idx;
+      if (chunk > DISKIO_MULTI_MAX)
+        chunk = DISKIO_MULTI_MAX;
+
+      if (!fuji_bus_call(FUJI_DEVICEID_DISK + unit, FUJICMD_WRITE_MULTI, FUJI_FIELD_C1234,
+                         U16_LSB(U32_LSW(sector)), U16_MSB(U32_LSW(sector)),
+                         U16_LSB(U32_MSW(sector)), chunk,
+                         &buf[idx * SECTOR_SIZE], chunk * SECTOR_SIZE,
+                         bitmap, (chunk + 7) / 8))
+        break;
+
+      ok = leading_ok(bitmap, chunk);
+      if (ok < chunk)
+        return idx + ok;
+    }
+    return idx;
+  }
+
+  for (idx = 0; idx < count; idx++, sector++) {
+    if (!fuji_bus_call(FUJI_DEVICEID_DISK + unit, FUJICMD_WRITE, FUJI_FIELD_C1234,
+                       U16_LSB(U32_LSW(sector)), U16_MSB(U32_LSW(sector)),
+                       U16_LSB(U32_MSW(sector)), U16_MSB(U32_MSW(sector)),
+                       &buf[idx * SECTOR_SIZE], SECTOR_SIZE, NULL, 0))
+      break;
+  }
+  return idx;
+}
+
+uint16_t disk_read(uint8_t unit, uint32_t sector, uint16_t count, uint8_t far *buf)
+{
+  uint16_t idx;
+
+
+  // Whatever has already been pulled into memory doesn't need the wire
+  idx = hydrate_read(unit, sector, count, buf);
+  if (idx < count)
+    idx += wire_read(unit, sector + idx, count - idx, &buf[idx * SECTOR_SIZE]);
+  return idx;
+}
+
+uint16_t disk_write(uint8_t unit, uint32_t sector, uint16_t count, const uint8_t far *buf)
+{
+  uint16_t done;
+
+
+  done = wire_write(unit, sector, count, buf);
+  hydrate_written(unit, sector, done, buf);
+  return done;
+}
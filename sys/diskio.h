@@ -0,0 +1,24 @@
+#ifndef _DISKIO_H
+#define _DISKIO_H
+
+#include <stdint.h>
+
+#define SECTOR_SIZE     512
+
+/* Sectors moved per READ_MULTI/WRITE_MULTI frame, keeps the payload
+   comfortably under 64K */
+#define DISKIO_MULTI_MAX        64
+
+/* All of these return the number of leading sectors that were
+   transferred. The disk_ versions use a hydrated copy of the image
+   when there is one, the wire_ versions always talk to the FujiNet. */
+extern uint16_t wire_read(uint8_t unit, uint32_t sector, uint16_t count,
+                          uint8_t far *buf);
+extern uint16_t wire_write(uint8_t unit, uint32_t sector, uint16_t count,
+                           const uint8_t far *buf);
+extern uint16_t disk_read(uint8_t unit, uint32_t sector, uint16_t count,
+                          uint8_t far *buf);
+extern uint16_t disk_write(uint8_t unit, uint32_t sector, uint16_t count,
+                           const uint8_t far *buf);
+
+#endif /* _DISKIO_H */
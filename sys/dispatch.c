@@ -1,5 +1,6 @@
 #include "dispatch.h"
 #include "commands.h"
+#include "cache.h"
 #include "sys_hdr.h"
 #include "pushpop.h"
 #include "print.h" // For debugging only
@@ -22,6 +23,8 @@ uint16_t our_ss, our_sp;
 
 static SYSREQ __far *fpRequest = (SYSREQ __far *) 0;
 
+volatile uint8_t driver_busy;
+
 typedef uint16_t(*driverFunction_t)(SYSREQ far *req);
 
 static driverFunction_t currentFunction;
@@ -96,7 +99,11 @@ void far Interrupt(void)
 #ifdef DEBUG
     consolef("Command 0x%02x", fpRequest->command);
 #endif
+    driver_busy++;
     fpRequest->status = currentFunction(fpRequest);
+    // Dirty sectors past their age, INT 28h may never come
+    cache_tick(false);
+    driver_busy--;
 #ifdef DEBUG
     consolef(" result: 0x%04x\n", fpRequest->status);
 #endif
@@ -1,4 +1,9 @@
 #ifndef _DISPATCH_H
 #define _DISPATCH_H
 
+#include <stdint.h>
+
+/* Non-zero while a DOS request or INT F5 call is being handled */
+extern volatile uint8_t driver_busy;
+
 #endif /* _DISPATCH_H */
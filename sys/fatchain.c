@@ -0,0 +1,158 @@
+/**
+ * FAT cluster chain prefetch
+ *
+ * When DOS reads the start of a cluster in the data area, look the
+ * cluster up in the FAT and prefetch the clusters the file continues
+ * with into the sector cache, even if they are scattered over the
+ * image. Only FAT sectors that are already cached are used, DOS will
+ * have read them to find the file in the first place. FAT32 images
+ * aren't handled.
+ */
+
+#include "fatchain.h"
+#include "cache.h"
+#include "commands.h"
+#include "diskio.h"
+#include <dos.h>
+
+#define FAT12_MAX_CLUSTERS      4085
+#define FAT_BAD                 0xFFFF
+
+typedef struct {
+  uint16_t spau;
+  uint16_t fat_start;
+  uint32_t data_start;
+  uint16_t clusters;
+  bool fat12;
+} fat_geometry;
+
+uint16_t fatchain_window;
+
+static uint8_t far *stage_buf;
+
+// The FAT sector last copied out of the cache, one extra byte for
+// FAT12 entries that straddle two sectors
+static uint8_t fat_buf[SECTOR_SIZE + 1];
+static uint32_t fat_buf_sector;
+static uint8_t fat_buf_unit = 0xFF;
+
+// Static rather than on the stack, SS isn't DS inside the driver
+static fat_geometry geo;
+
+void fatchain_setup(uint16_t segment, uint16_t window)
+{
+  stage_buf = MK_FP(segment, 0);
+  fatchain_window = window;
+  return;
+}
+
+static bool fat_geometry_get(uint8_t unit, fat_geometry *geo)
+{
+  DOS_BPB *bpb = &fn_bpb_table[unit];
+  uint32_t sectors;
+
+
+  if (bpb->bps != SECTOR_SIZE || !bpb->spau || !bpb->spfat)
+    return false;
+
+  geo->spau = bpb->spau;
+  geo->fat_start = bpb->rs;
+  geo->data_start = bpb->rs + (uint32_t) bpb->num_FATs * bpb->spfat
+    + (bpb->root_entries * 32 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  sectors = unit_sectors(unit);
+  if (sectors <= geo->data_start)
+    return false;
+  sectors = (sectors - geo->data_start) / geo->spau;
+  if (sectors > 0xFFF0)
+    return false;
+  geo->clusters = sectors;
+  geo->fat12 = geo->clusters < FAT12_MAX_CLUSTERS;
+  return true;
+}
+
+static bool fat_load(uint8_t unit, uint32_t sector)
+{
+  if (fat_buf_unit == unit && fat_buf_sector == sector)
+    return true;
+
+  fat_buf_unit = 0xFF;
+  if (!cache_get(unit, sector, fat_buf))
+    return false;
+  fat_buf_unit = unit;
+  fat_buf_sector = sector;
+  return true;
+}
+
+/* Next cluster in the chain, FAT_BAD at the end or if unknown */
+static uint16_t fat_next(uint8_t unit, fat_geometry *geo, uint16_t cluster)
+{
+  uint32_t offset;
+  uint16_t pos, value;
+  uint8_t next_byte;
+
+
+  offset = geo->fat12 ? cluster + cluster / 2 : (uint32_t) cluster * 2;
+  pos = offset % SECTOR_SIZE;
+  if (!fat_load(unit, geo->fat_start + offset / SECTOR_SIZE))
+    return FAT_BAD;
+
+  if (geo->fat12) {
+    if (pos == SECTOR_SIZE - 1) {
+      value = fat_buf[pos];
+      if (!fat_load(unit, fat_buf_sector + 1))
+        return FAT_BAD;
+      next_byte = fat_buf[0];
+    }
+    else {
+      value = fat_buf[pos];
+      next_byte = fat_buf[pos + 1];
+    }
+    value |= (uint16_t) next_byte << 8;
+    value = cluster & 1 ? value >> 4 : value & 0x0FFF;
+  }
+  else
+    value = fat_buf[pos] | (uint16_t) fat_buf[pos + 1] << 8;
+
+  if (value < 2 || value >= geo->clusters + 2)
+    return FAT_BAD;
+  return value;
+}
+
+void fatchain_read(uint8_t unit, uint32_t sector, uint16_t count)
+{
+  uint16_t cluster, next, run, left, len;
+  uint32_t first;
+
+
+  if (!fatchain_window || !cache_entries || !fat_geometry_get(unit, &geo))
+    return;
+
+  // Only reads that start a cluster are worth following
+  if (sector < geo.data_start || (sector - geo.data_start) % geo.spau)
+    return;
+
+  // Start from the last cluster the read covered
+  cluster = (sector + count - 1 - geo.data_start) / geo.spau + 2;
+
+  for (left = fatchain_window; left; left -= run) {
+    next = fat_next(unit, &geo, cluster);
+    if (next == FAT_BAD)
+      break;
+
+    // Gather clusters that follow on from each other into one read
+    first = geo.data_start + (uint32_t) (next - 2) * geo.spau;
+    for (run = 1, cluster = next; run < left; run++, cluster = next) {
+      if ((run + 1) * geo.spau > FATCHAIN_STAGE)
+        break;
+      next = fat_next(unit, &geo, cluster);
+      if (next != cluster + 1)
+        break;
+    }
+
+    len = run * geo.spau;
+    if (len > FATCHAIN_STAGE)
+      len = FATCHAIN_STAGE;
+    cache_prefetch(unit, first, len, stage_buf);
+  }
+  return;
+}
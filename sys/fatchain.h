@@ -0,0 +1,22 @@
+#ifndef _FATCHAIN_H
+#define _FATCHAIN_H
+
+#include <stdint.h>
+
+// Staging buffer for prefetched runs, in sectors
+#define FATCHAIN_STAGE          16
+
+extern uint16_t fatchain_window;
+
+/**
+ * @brief enable following cluster chains up to window clusters ahead
+ * @param segment staging buffer of FATCHAIN_STAGE sectors
+ */
+extern void fatchain_setup(uint16_t segment, uint16_t window);
+
+/**
+ * @brief look at a completed read and prefetch where its file goes next
+ */
+extern void fatchain_read(uint8_t unit, uint32_t sector, uint16_t count);
+
+#endif /* _FATCHAIN_H */
@@ -7,10 +7,15 @@
 
 #include "fujicom.h"
 #include "portio.h"
+#include "commands.h"
+#include "timer.h"
+#include "timing.h"
+#include "compress.h"
 #include <dos.h>
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <conio.h>
 
 #if defined(DEBUG) || defined(INIT_INFO)
 #include "../sys/print.h" // debug
@@ -18,22 +23,54 @@
 
 #include <env.h>
 
-#define TIMEOUT         100
+/* Receive timeouts are the longest gap allowed between two bytes of a
+ * reply, in milliseconds. FUJI_TIMEOUT=SHORT[,SLOW[,LONG]] overrides
+ * the first three. */
+#define TIMEOUT_SHORT	2 * 1000
 #define TIMEOUT_SLOW	15 * 1000
 /* FUJICMD_COPY_FILE runs entirely on the FujiNet side (source read + dest
  * write against TNFS/SD) and sends nothing on the wire until it is done, so
  * it needs a much longer receive timeout than every other command. Keep
  * this in sync with FUJICMD_COPY_FILE in fujinet-commands.h. */
 #define FUJICMD_COPY_FILE 0xD8
-#define TIMEOUT_COPY	120 * 1000
-#define MAX_RETRIES	1
+#define TIMEOUT_LONG	120 * 1000UL
+/* Old firmware may simply not answer FUJICMD_GET_CAPABILITIES, don't
+ * hold up boot waiting for it. */
+#define TIMEOUT_PROBE	1000
+#define MAX_RETRIES	2
+#define MS_PER_TICK	55
+#define MS_TO_TICKS(ms)	(((ms) + MS_PER_TICK - 1) / MS_PER_TICK)
 #ifndef SERIAL_BPS
 #define SERIAL_BPS      115200
 #endif /* SERIAL_BPS */
+/* Standard PC serial crystal, UARTs divide it by 16 * divisor.
+ * FUJI_CLOCK=HZ for cards with a faster one. */
+#define UART_CLOCK      1843200UL
+#define UART_CLOCK_DIV  16
 
 union REGS f5regs;
 struct SREGS f5status;
 
+// UART registers and bits used when switching to interrupt receive
+#define UART_IER        1
+#define UART_FCR        2
+#define UART_LCR        3
+#define UART_LSR        5
+#define LCR_DLAB        0x80
+#define LSR_DR          0x01
+#define LSR_TEMT        0x40
+#define IER_RX_DATA     0x01
+#define FCR_ENABLE      0x01
+#define FCR_CLEAR_RX    0x02
+#define FCR_CLEAR_TX    0x04
+#define FCR_TRIGGER_8   0x80
+
+#define PIC1_MASK       0x21
+#define PIC2_MASK       0xA1
+#define PIC_CASCADE_IRQ 2
+
+static unsigned fujicom_irq = COM1_IRQ;
+
 enum {
   SLIP_END     = 0xC0,
   SLIP_ESCAPE  = 0xDB,
@@ -59,10 +96,83 @@ typedef struct {
   uint8_t far *data;
 } fujibus_packet;
 
-#define MAX_PACKET (sizeof(fujibus_header) + 4) // header + aux
+#define MAX_PACKET (sizeof(fujibus_header) + FUJI_STATUS_MAX) // header + aux/status
 static uint8_t fb_buffer[MAX_PACKET];
 static fujibus_packet *fb_packet = (fujibus_packet *) fb_buffer;
 
+/* Tagged commands sent with fuji_bus_submit */
+typedef struct {
+  uint8_t tag;                  // 0 if this entry is free
+  uint8_t device;
+  uint8_t command;
+  uint8_t state;                // FUJI_TAG_*
+  void far *status;
+  uint16_t status_length;
+  void far *reply;
+  uint16_t reply_length;
+  uint16_t sent;
+  uint32_t start;
+} fuji_outstanding;
+
+static fuji_outstanding fuji_pending[FUJI_TAGS_MAX];
+static uint8_t fuji_in_flight;
+static uint8_t next_tag = 1;
+
+/* Set while fb_buffer, the UART and the tag table are in use. Only
+ * something running from an interrupt can find it set, since
+ * whatever it interrupted can't carry on until it returns, so a plain
+ * flag is enough and the interrupted call is never the one turned
+ * away. */
+volatile uint8_t fuji_bus_busy;
+static fuji_deferred_fn fuji_deferred[FUJI_DEFER_MAX];
+
+uint16_t fujicom_caps;
+uint32_t fujicom_clock = UART_CLOCK;
+uint32_t fujicom_bps;
+fujicom_counters fujicom_stats;
+uint8_t fujicom_retries = MAX_RETRIES;
+uint16_t fujicom_timeouts[FUJI_TIMEOUT_CLASSES] = {
+  MS_TO_TICKS(TIMEOUT_SHORT),
+  MS_TO_TICKS(TIMEOUT_SLOW),
+  MS_TO_TICKS(TIMEOUT_LONG),
+  MS_TO_TICKS(TIMEOUT_PROBE),
+};
+
+/* Commands that don't use TIMEOUT_SLOW. Short commands are answered
+ * straight away by the FujiNet, so a lost byte is noticed quickly, long
+ * ones wait on the network or the SD card before replying. The same
+ * command byte means different things to different devices: a sector
+ * READ is quick, a network READ or STATUS may be waiting on a
+ * server, so the short entries only cover the FUJI device and disks. */
+enum {
+  FUJI_TIMEOUT_ANY_DEVICE = 0,
+  FUJI_TIMEOUT_DISK_ONLY,       // FUJI device and disks, everything else is SLOW
+};
+
+typedef struct {
+  uint8_t command;
+  uint8_t devices;              // FUJI_TIMEOUT_ANY_DEVICE/DISK_ONLY
+  uint8_t timeout;              // FUJI_TIMEOUT_*
+} fuji_timeout_policy;
+
+static const fuji_timeout_policy fuji_timeout_table[] = {
+  {FUJICMD_STATUS,              FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_READ,                FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_WRITE,               FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_READ_MULTI,          FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_WRITE_MULTI,         FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_GET_MEDIA_STATE,     FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_GET_BAUD_RATES,      FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_SET_BAUD,            FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_BAUD_TEST,           FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_READ_DEVICE_SLOTS,   FUJI_TIMEOUT_DISK_ONLY,  FUJI_TIMEOUT_SHORT},
+  {FUJICMD_OPEN,                FUJI_TIMEOUT_ANY_DEVICE, FUJI_TIMEOUT_LONG},
+  {FUJICMD_COPY_FILE,           FUJI_TIMEOUT_ANY_DEVICE, FUJI_TIMEOUT_LONG},
+  {FUJICMD_MOUNT_IMAGE,         FUJI_TIMEOUT_ANY_DEVICE, FUJI_TIMEOUT_LONG},
+  {FUJICMD_MOUNT_ALL,           FUJI_TIMEOUT_ANY_DEVICE, FUJI_TIMEOUT_LONG},
+  {FUJICMD_GET_CAPABILITIES,    FUJI_TIMEOUT_ANY_DEVICE, FUJI_TIMEOUT_PROBE},
+};
+
 // Not worth making these into functions, I'm sure they'd eat more bytes
 const uint8_t fuji_field_numbytes_table[] = {0, 1, 2, 3, 4, 2, 4, 4};
 #define fuji_field_numbytes(descr) fuji_field_numbytes_table[descr]
@@ -70,15 +180,17 @@ const uint8_t fuji_field_numbytes_table[] = {0, 1, 2, 3, 4, 2, 4, 4};
 void fujicom_init(void)
 {
   unsigned divisor;
-  const char *fuji_port, *comma;
-  unsigned port_len;
+  const char *fuji_port, *comma, *opt;
+  unsigned port_len, idx;
   unsigned long bps = SERIAL_BPS;
   int comp = 1;
-  unsigned base = COM1_UART, irq = COM1_INTERRUPT;
+  unsigned base = COM1_UART, irq = COM1_IRQ;
 
 
   if (getenv("FUJI_BPS"))
     bps = strtoul(getenv("FUJI_BPS"), NULL, 10);
+  if (getenv("FUJI_CLOCK"))
+    fujicom_clock = strtoul(getenv("FUJI_CLOCK"), NULL, 10);
 
   fuji_port = getenv("FUJI_PORT");
   if (fuji_port) {
@@ -97,15 +209,15 @@ void fujicom_init(void)
       switch (comp) {
       case 2:
         base = COM2_UART;
-        irq = COM2_INTERRUPT;
+        irq = COM2_IRQ;
         break;
       case 3:
         base = COM3_UART;
-        irq = COM3_INTERRUPT;
+        irq = COM3_IRQ;
         break;
       case 4:
         base = COM4_UART;
-        irq = COM4_INTERRUPT;
+        irq = COM4_IRQ;
         break;
       }
     }
@@ -114,24 +226,123 @@ void fujicom_init(void)
       irq = atoi(comma + 1);
   }
 
-  divisor = 115200UL / bps;
+  if (getenv("FUJI_RETRIES"))
+    fujicom_retries = atoi(getenv("FUJI_RETRIES"));
+
+  // FUJI_TIMEOUT=SHORT,SLOW,LONG in ms, empty fields keep the default
+  opt = getenv("FUJI_TIMEOUT");
+  for (idx = FUJI_TIMEOUT_SHORT; opt && idx <= FUJI_TIMEOUT_LONG; idx++) {
+    if (isdigit(*opt)) {
+      fujicom_timeouts[idx] = MS_TO_TICKS(strtoul(opt, NULL, 10));
+      if (!fujicom_timeouts[idx])
+        fujicom_timeouts[idx] = 1;
+    }
+    opt = strchr(opt, ',');
+    if (opt)
+      opt++;
+  }
+
+  fujicom_irq = irq;
+  fujicom_bps = bps;
+  divisor = fujicom_clock / UART_CLOCK_DIV / bps;
   port_init(base, divisor);
 #if defined(DEBUG) || defined(INIT_INFO)
   consolef("Port: %xh  BPS: %ld/%d\n", port_uart_base, (int32_t) bps, divisor);
+  consolef("Retries: %d  Timeouts: %d/%d/%d ticks\n", fujicom_retries,
+           fujicom_timeouts[FUJI_TIMEOUT_SHORT], fujicom_timeouts[FUJI_TIMEOUT_SLOW],
+           fujicom_timeouts[FUJI_TIMEOUT_LONG]);
 #endif
 
   return;
 }
 
-uint16_t fuji_calc_checksum(const void far *ptr, uint16_t len, uint16_t seed)
+/* Let port_putbuf_slip fill the transmit FIFO 16 bytes at a time,
+ * only call this on a UART identified as a 16550A */
+void fujicom_enable_tx_fifo(void)
 {
-  uint16_t idx, chk;
-  uint8_t far *buf = (uint8_t far *) ptr;
+  outp(port_uart_base + UART_FCR, FCR_ENABLE | FCR_CLEAR_TX);
+  port_tx_fifo = 1;
+  return;
+}
+
+/* Divisor for bps, or 0 if the UART clock can't get within 2% of it */
+uint16_t fujicom_divisor(uint32_t bps)
+{
+  uint32_t divisor, actual;
+
+
+  if (!bps)
+    return 0;
+  divisor = (fujicom_clock / UART_CLOCK_DIV + bps / 2) / bps;
+  if (!divisor || divisor > 0xFFFF)
+    return 0;
+  actual = fujicom_clock / UART_CLOCK_DIV / divisor;
+  if ((actual > bps ? actual - bps : bps - actual) > bps / 50)
+    return 0;
+  return divisor;
+}
+
+/* Change speed without touching the rest of the UART setup, once
+ * whatever is still being sent has gone */
+bool fujicom_set_bps(uint32_t bps)
+{
+  uint16_t divisor = fujicom_divisor(bps);
+  uint8_t lcr;
 
 
-  for (idx = 0, chk = seed; idx < len; idx++)
-    chk = ((chk + buf[idx]) >> 8) + ((chk + buf[idx]) & 0xFF);
-  return chk;
+  if (!divisor)
+    return false;
+
+  while (!(inp(port_uart_base + UART_LSR) & LSR_TEMT))
+    ;
+
+  _disable();
+  lcr = inp(port_uart_base + UART_LCR);
+  outp(port_uart_base + UART_LCR, lcr | LCR_DLAB);
+  outp(port_uart_base, divisor & 0xFF);
+  outp(port_uart_base + 1, divisor >> 8);
+  outp(port_uart_base + UART_LCR, lcr);
+  _enable();
+
+  fujicom_bps = bps;
+  return true;
+}
+
+/* Switch the receive side over to port_rx_isr. Only worth doing on
+ * UARTs with a working FIFO, everything else stays on polled I/O. */
+void fujicom_enable_irq(void)
+{
+  void (__interrupt __far *old)(void);
+  unsigned vector = PORT_IRQ_VECTOR(fujicom_irq);
+
+
+  _disable();
+
+  old = _dos_getvect(vector);
+  port_rx_old_off = FP_OFF(old);
+  port_rx_old_seg = FP_SEG(old);
+  _dos_setvect(vector, MK_FP(getCS(), port_rx_isr));
+
+  port_irq = fujicom_irq;
+  port_rx_head = port_rx_tail = 0;
+  port_rx_irq = 1;
+
+  outp(port_uart_base + UART_FCR, FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX | FCR_TRIGGER_8);
+  outp(port_uart_base + UART_IER, IER_RX_DATA);
+
+  if (fujicom_irq < 8)
+    outp(PIC1_MASK, inp(PIC1_MASK) & ~(1 << fujicom_irq));
+  else {
+    outp(PIC2_MASK, inp(PIC2_MASK) & ~(1 << (fujicom_irq - 8)));
+    outp(PIC1_MASK, inp(PIC1_MASK) & ~(1 << PIC_CASCADE_IRQ));
+  }
+
+  _enable();
+
+#if defined(DEBUG) || defined(INIT_INFO)
+  consolef("Receive: IRQ %d, ring buffer\n", fujicom_irq);
+#endif
+  return;
 }
 
 void packet_fail(fujibus_packet *packet, uint16_t rlen, const char *message, ...)
@@ -151,14 +362,289 @@ void packet_fail(fujibus_packet *packet, uint16_t rlen, const char *message, ...
   return;
 }
 
+/* Ask the firmware which FujiBus extensions it will use. We offer
+ * everything we implement and get back the subset both sides agree
+ * on. Firmware that doesn't know the command leaves fujicom_caps at
+ * zero and the driver sticks to the original protocol. */
+void fujicom_get_caps(uint16_t offer)
+{
+  uint16_t caps = 0;
+
+
+  offer &= FUJI_CAPS_HOST;
+  if (!fuji_bus_call(FUJI_DEVICEID_FUJINET, FUJICMD_GET_CAPABILITIES, FUJI_FIELD_A1_A2,
+                     U16_LSB(offer), U16_MSB(offer), 0, 0,
+                     NULL, 0, &caps, sizeof(caps)))
+    caps = 0;
+
+  fujicom_caps = caps & offer;
+#if defined(DEBUG) || defined(INIT_INFO)
+  consolef("FujiBus extensions: %04x\n", fujicom_caps);
+#endif
+  return;
+}
+
+static bool fuji_bus_disk(uint8_t device)
+{
+  return device == FUJI_DEVICEID_FUJINET
+    || (device >= FUJI_DEVICEID_DISK && device <= FUJI_DEVICEID_DISK_LAST);
+}
+
+static uint8_t fuji_bus_timeout(uint8_t device, uint8_t fuji_cmd)
+{
+  uint8_t idx;
+  bool disk = fuji_bus_disk(device);
+
+
+  for (idx = 0; idx < sizeof(fuji_timeout_table) / sizeof(fuji_timeout_table[0]); idx++)
+    if (fuji_timeout_table[idx].command == fuji_cmd
+        && (disk || fuji_timeout_table[idx].devices == FUJI_TIMEOUT_ANY_DEVICE))
+      return fuji_timeout_table[idx].timeout;
+  return FUJI_TIMEOUT_SLOW;
+}
+
+/* Sending a short command again after a lost reply does no harm, but
+ * a network READ or an OPEN may already have happened on the FujiNet
+ * side. Only those get retried after a timeout, everything can be
+ * retried after a NAK because the FujiNet didn't act on it. */
+static bool fuji_bus_repeatable(uint8_t device, uint8_t timeout)
+{
+  return timeout == FUJI_TIMEOUT_SHORT && fuji_bus_disk(device);
+}
+
+/* Throw away whatever is left of a broken reply, waiting until the
+ * line has been quiet for a tick so the next receive starts cleanly
+ * on the SLIP_END in front of the answer to the retransmit. */
+#define RESYNC_MAX_TICKS 9
+static void fujicom_resync(void)
+{
+  uint16_t start, quiet;
+
+
+  start = quiet = BIOS_TICKS;
+  while (BIOS_TICKS - quiet < 2 && BIOS_TICKS - start < RESYNC_MAX_TICKS) {
+    if (port_rx_irq) {
+      if (port_rx_tail != port_rx_head) {
+        port_rx_tail = port_rx_head;
+        quiet = BIOS_TICKS;
+      }
+    }
+    else if (inp(port_uart_base + UART_LSR) & LSR_DR) {
+      inp(port_uart_base);
+      quiet = BIOS_TICKS;
+    }
+  }
+  return;
+}
+
+/* Validate a reply, returning PACKET_ACK if it can be used, PACKET_NAK
+ * if the FujiNet turned the command down, or 0 if it was lost. */
+static int fuji_bus_check(fujibus_packet *packet, uint8_t device, uint16_t rlen)
+{
+  uint16_t ck1, ck2;
+
+
+  if (!rlen) {
+    fujicom_stats.timeouts++;
+    return 0;
+  }
+
+  if (rlen < sizeof(fujibus_header) || rlen != packet->header.length) {
+#ifdef DEBUG
+    packet_fail(packet, rlen,
+                "SHORT PACKET R:%d E:%d\n", rlen, packet->header.length);
+#endif
+    fujicom_stats.bad_frames++;
+    return 0;
+  }
+
+  // FIXME - validate that fb_packet->fields is zero?
+
+  /* port_getbuf_slip_dual summed the packet as it came in, including
+   * the checksum byte itself. The sum is the byte total modulo 255
+   * kept in 1-255, so take the checksum byte back out the same way. */
+  ck1 = packet->header.checksum;
+  ck2 = (port_rx_sum + 255 - ck1) % 255;
+  if (!ck2)
+    ck2 = 255;
+
+  if (ck1 != ck2) {
+#ifdef DEBUG
+    packet_fail(packet, rlen, "CHECKSUM MISMATCH C:%02x E:%02x\n", ck2, ck1);
+#endif
+    fujicom_stats.bad_frames++;
+    return 0;
+  }
+
+  if (packet->header.device != device) {
+#ifdef DEBUG
+    packet_fail(packet, rlen,
+                "WRONG DEVICE %02x != %02x\n", packet->header.device, device);
+#endif
+    fujicom_stats.bad_frames++;
+    return 0;
+  }
+
+  if (packet->header.command == PACKET_NAK) {
+    fujicom_stats.naks++;
+    return PACKET_NAK;
+  }
+
+  if (packet->header.command != PACKET_ACK) {
+#ifdef DEBUG
+    packet_fail(packet, rlen, "NOT ACK 0x%02x\n", packet->header.command);
+#endif
+    fujicom_stats.bad_frames++;
+    return 0;
+  }
+
+  return PACKET_ACK;
+}
+
+static bool fuji_bus_claim(void)
+{
+  if (fuji_bus_busy) {
+    fujicom_stats.busy++;
+    return false;
+  }
+  fuji_bus_busy = 1;
+  return true;
+}
+
+static fuji_outstanding *fuji_tag_lookup(uint8_t tag)
+{
+  uint8_t idx;
+
+
+  for (idx = 0; idx < FUJI_TAGS_MAX; idx++)
+    if (fuji_pending[idx].tag == tag)
+      return &fuji_pending[idx];
+  return NULL;
+}
+
+static void fuji_tag_finish(fuji_outstanding *req, uint8_t state, uint16_t received)
+{
+  if (req->state == FUJI_TAG_PENDING)
+    fuji_in_flight--;
+  req->state = state;
+  timing_record(req->device, req->command, req->start, req->sent, received);
+  return;
+}
+
+/* Read the rest of a reply nobody wants */
+static void fuji_bus_discard(uint16_t length, uint16_t ticks)
+{
+  uint16_t chunk;
+
+
+  for (; length; length -= chunk) {
+    chunk = length < FUJI_STATUS_MAX ? length : FUJI_STATUS_MAX;
+    if (port_getbuf_slip_dual(NULL, 0, &fb_buffer[sizeof(fujibus_header)], chunk,
+                              ticks | PORT_RX_CONTINUE) != chunk)
+      break;
+  }
+  return;
+}
+
+/* Take one tagged reply off the line: the header first, to find out
+ * whose it is, then the status block and data straight into that
+ * command's buffers. Returns false if nothing arrived in time. */
+static bool fuji_bus_receive(uint16_t ticks)
+{
+  fuji_outstanding *req;
+  uint16_t rlen, payload, status_length, data_length;
+  int code;
+
+
+  rlen = port_getbuf_slip_dual(fb_packet, sizeof(fujibus_header), NULL, 0, ticks);
+  if (rlen < sizeof(fujibus_header)) {
+    fujicom_stats.timeouts++;
+    return false;
+  }
+
+  payload = fb_packet->header.length - sizeof(fujibus_header);
+  req = fuji_tag_lookup((fb_packet->header.fields & FUJI_FIELD_TAG_MASK) >> FUJI_FIELD_TAG_SHIFT);
+  if (fb_packet->header.length < sizeof(fujibus_header)
+      || !req || req->state != FUJI_TAG_PENDING || req->device != fb_packet->header.device) {
+    fujicom_stats.bad_frames++;
+    if (fb_packet->header.length > sizeof(fujibus_header))
+      fuji_bus_discard(payload, ticks);
+    return true;
+  }
+
+  status_length = payload < req->status_length ? payload : req->status_length;
+  data_length = payload - status_length;
+  if (data_length > req->reply_length) {
+    fujicom_stats.bad_frames++;
+    fuji_bus_discard(payload, ticks);
+    fuji_tag_finish(req, FUJI_TAG_FAILED, rlen);
+    return true;
+  }
+
+  // Zero length reads would start the checksum over
+  if (status_length)
+    rlen += port_getbuf_slip_dual(NULL, 0, &fb_buffer[sizeof(fujibus_header)], status_length,
+                                  ticks | PORT_RX_CONTINUE);
+  if (data_length)
+    rlen += port_getbuf_slip_dual(NULL, 0, req->reply, data_length, ticks | PORT_RX_CONTINUE);
+
+  code = fuji_bus_check(fb_packet, req->device, rlen);
+  if (code == PACKET_ACK && (fb_packet->header.fields & FUJI_FIELD_COMPRESSED)) {
+    if (!compress_eligible(req->device, req->command) || !data_length
+        || !compress_decode(req->reply, data_length, req->reply_length)) {
+      fujicom_stats.bad_frames++;
+      code = 0;
+    }
+  }
+
+  if (code == PACKET_ACK && status_length)
+    _fmemcpy(req->status, &fb_buffer[sizeof(fujibus_header)], status_length);
+  fuji_tag_finish(req, code == PACKET_ACK ? FUJI_TAG_DONE : FUJI_TAG_FAILED, rlen);
+  return true;
+}
+
+/* Collect every tagged reply still outstanding, before the line is
+ * used for anything else. A lost one is given up on after the longest
+ * timeout of the commands still waiting. */
+static void fuji_bus_settle(void)
+{
+  uint8_t idx;
+  uint16_t timeout, ticks;
+
+
+  while (fuji_in_flight) {
+    timeout = fujicom_timeouts[FUJI_TIMEOUT_SHORT];
+    for (idx = 0; idx < FUJI_TAGS_MAX; idx++)
+      if (fuji_pending[idx].tag && fuji_pending[idx].state == FUJI_TAG_PENDING) {
+        ticks = fujicom_timeouts[fuji_bus_timeout(fuji_pending[idx].device,
+                                                  fuji_pending[idx].command)];
+        if (ticks > timeout)
+          timeout = ticks;
+      }
+
+    if (!fuji_bus_receive(timeout))
+      for (idx = 0; idx < FUJI_TAGS_MAX; idx++)
+        if (fuji_pending[idx].tag && fuji_pending[idx].state == FUJI_TAG_PENDING)
+          fuji_tag_finish(&fuji_pending[idx], FUJI_TAG_FAILED, 0);
+  }
+  return;
+}
+
 bool fuji_bus_call(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
 		   uint8_t aux1, uint8_t aux2, uint8_t aux3, uint8_t aux4,
 		   const void far *data, size_t data_length,
 		   void far *reply, size_t reply_length)
 {
-  int code;
-  uint16_t ck1, ck2;
-  uint16_t rlen;
+  return fuji_bus_call_status(device, fuji_cmd, fields, aux1, aux2, aux3, aux4,
+                              data, data_length, NULL, 0, reply, reply_length);
+}
+
+/* Frame and send a command, returns the packet length */
+static uint16_t fuji_bus_send(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
+                              uint8_t aux1, uint8_t aux2, uint8_t aux3, uint8_t aux4,
+                              const void far *data, size_t data_length)
+{
+  uint16_t ck1;
   uint16_t idx, numbytes;
   uint8_t *ptr = &fb_buffer[sizeof(fujibus_header)];
 
@@ -171,7 +657,7 @@ bool fuji_bus_call(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
   fb_packet->data = ptr;
 
   idx = 0;
-  numbytes = fuji_field_numbytes(fields);
+  numbytes = fuji_field_numbytes(fields & FUJI_FIELD_AUX_MASK);
   if (numbytes) {
     ptr[idx++] = aux1;
     numbytes--;
@@ -192,9 +678,9 @@ bool fuji_bus_call(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
   fb_packet->header.length += idx + data_length;
 
   // Data is spread across two buffers: ours and data
-  ck1 = fuji_calc_checksum(fb_packet, sizeof(fb_packet->header) + idx, 0);
+  ck1 = port_checksum(fb_packet, sizeof(fb_packet->header) + idx, 0);
   if (data)
-    ck1 = fuji_calc_checksum(data, data_length, ck1);
+    ck1 = port_checksum(data, data_length, ck1);
   fb_packet->header.checksum = ck1;
 
   port_putc(SLIP_END);
@@ -202,64 +688,258 @@ bool fuji_bus_call(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
   if (data)
     port_putbuf_slip(data, data_length);
   port_putc(SLIP_END);
+  return fb_packet->header.length;
+}
 
-  fb_packet->data = reply;
-  rlen = port_getbuf_slip_dual(fb_packet, sizeof(fb_packet->header),
-                               fb_packet->data, reply_length,
-                               fuji_cmd == FUJICMD_COPY_FILE ? TIMEOUT_COPY : TIMEOUT_SLOW);
+/* Same as fuji_bus_call, but the first status_length bytes of the
+ * reply are a status block that goes to a separate buffer
+ * instead of the caller's reply buffer. */
+bool fuji_bus_call_status(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
+                          uint8_t aux1, uint8_t aux2, uint8_t aux3, uint8_t aux4,
+                          const void far *data, size_t data_length,
+                          void far *status, size_t status_length,
+                          void far *reply, size_t reply_length)
+{
+  int code;
+  uint16_t rlen, hlen, numbytes;
+  uint8_t timeout, attempt;
+  bool compressed;
+  uint16_t sent, received;
+  uint32_t start;
 
-#if 0 //def DEBUG
-  if (rlen)
-    dumpHex(fb_packet, rlen, 0);
-  consolef("RECEIVED LEN %d\n", rlen);
-#endif
-  if (rlen < sizeof(fujibus_header) || rlen != fb_packet->header.length) {
-#ifdef DEBUG
-    packet_fail(fb_packet, rlen,
-                "SHORT PACKET R:%d E:%d\n", rlen, fb_packet->header.length);
-#endif
+
+  if (status_length > FUJI_STATUS_MAX || !fuji_bus_claim())
     return false;
+
+  // Replies to tagged commands still on their way would get in the way
+  fuji_bus_settle();
+
+  timeout = fuji_bus_timeout(device, fuji_cmd);
+  fujicom_stats.calls++;
+  start = timing_now();
+  sent = received = 0;
+
+  compressed = compress_eligible(device, fuji_cmd);
+  if (compressed && data) {
+    numbytes = compress_encode(data, data_length);
+    if (numbytes) {
+      data = compress_buf;
+      data_length = numbytes;
+      fields |= FUJI_FIELD_COMPRESSED;
+    }
   }
 
-  // FIXME - validate that fb_packet->fields is zero?
+  for (attempt = 0; ; attempt++) {
+    if (attempt) {
+      fujicom_stats.retries++;
+      fujicom_resync();
+    }
 
-  // Need to zero out checksum in order to calculate
-  ck1 = fb_packet->header.checksum;
-  fb_packet->header.checksum = 0;
+    // Anything already in the ring is left over from an earlier reply
+    if (port_rx_irq)
+      port_rx_tail = port_rx_head;
 
-  // Data is spread across two buffers: ours and reply
-  ck2 = fuji_calc_checksum(fb_packet, sizeof(fb_packet->header), 0);
-  if (fb_packet->data)
-    ck2 = fuji_calc_checksum(fb_packet->data, rlen - sizeof(fujibus_header), ck2);
-  ck2 = (uint8_t) ck2;
+    // The last reply landed on top of the packet, build it again
+    sent += fuji_bus_send(device, fuji_cmd, fields, aux1, aux2, aux3, aux4,
+                          data, data_length);
 
-  if (ck1 != ck2) {
-#ifdef DEBUG
-    packet_fail(fb_packet, rlen, "CHECKSUM MISMATCH C:%02x E:%02x\n", ck2, ck1);
-#endif
-    return false;
-  }
+    hlen = sizeof(fb_packet->header) + status_length;
+    rlen = port_getbuf_slip_dual(fb_packet, hlen, reply, reply_length,
+                                 fujicom_timeouts[timeout]);
 
-  if (fb_packet->header.device != device) {
-#ifdef DEBUG
-    packet_fail(fb_packet, rlen,
-                "WRONG DEVICE %02x != %02x\n", fb_packet->header.device, device);
+#if 0 //def DEBUG
+    if (rlen)
+      dumpHex(fb_packet, rlen, 0);
+    consolef("RECEIVED LEN %d\n", rlen);
 #endif
-    return false;
+    received += rlen;
+    code = fuji_bus_check(fb_packet, device, rlen);
+
+    // A compressed reply is expanded over the top of itself
+    if (code == PACKET_ACK && (fb_packet->header.fields & FUJI_FIELD_COMPRESSED)) {
+      if (!compressed || !reply || rlen <= hlen
+          || !compress_decode(reply, rlen - hlen, reply_length)) {
+        fujicom_stats.bad_frames++;
+        code = 0;
+      }
+    }
+
+    if (code == PACKET_ACK)
+      break;
+
+    if (attempt >= fujicom_retries
+        || (code != PACKET_NAK && !fuji_bus_repeatable(device, timeout))) {
+      fujicom_stats.failures++;
+      break;
+    }
   }
 
-  if (fb_packet->header.command != PACKET_ACK) {
-#ifdef DEBUG
-    packet_fail(fb_packet, rlen, "NOT ACK 0x%02x\n", fb_packet->header.command);
-#endif
+  timing_record(device, fuji_cmd, start, sent, received);
+
+  if (code == PACKET_ACK && status_length)
+    _fmemcpy(status, &fb_buffer[sizeof(fujibus_header)], status_length);
+
+  fuji_bus_busy = 0;
+  return code == PACKET_ACK;
+}
+
+/* Send a command without waiting for the reply. The tag goes in the
+ * header fields byte and comes back in the reply, so replies can be
+ * matched up whatever order the FujiNet finishes in. */
+uint8_t fuji_bus_submit(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
+                        uint8_t aux1, uint8_t aux2, uint8_t aux3, uint8_t aux4,
+                        const void far *data, size_t data_length,
+                        void far *status, size_t status_length,
+                        void far *reply, size_t reply_length)
+{
+  fuji_outstanding *req = NULL;
+  uint8_t idx, tag;
+
+
+  // Polled receive can't hold on to a reply that comes out of turn
+  if (!(fujicom_caps & FUJI_CAP_TAGGED) || !port_rx_irq || status_length > FUJI_STATUS_MAX)
+    return 0;
+
+  for (idx = 0; idx < FUJI_TAGS_MAX; idx++)
+    if (!fuji_pending[idx].tag)
+      req = &fuji_pending[idx];
+  if (!req || !fuji_bus_claim())
+    return 0;
+
+  // Go round all the tags so a late reply can't be taken for a new one
+  do {
+    tag = next_tag;
+    next_tag = next_tag % FUJI_TAG_LAST + 1;
+  } while (fuji_tag_lookup(tag));
+
+  if (!fuji_in_flight && port_rx_irq)
+    port_rx_tail = port_rx_head;
+
+  req->tag = tag;
+  req->device = device;
+  req->command = fuji_cmd;
+  req->state = FUJI_TAG_PENDING;
+  req->status = status;
+  req->status_length = status_length;
+  req->reply = reply;
+  req->reply_length = reply_length;
+  req->start = timing_now();
+  fuji_in_flight++;
+  fujicom_stats.calls++;
+
+  req->sent = fuji_bus_send(device, fuji_cmd, (fields & ~FUJI_FIELD_TAG_MASK)
+                            | tag << FUJI_FIELD_TAG_SHIFT,
+                            aux1, aux2, aux3, aux4, data, data_length);
+  fuji_bus_busy = 0;
+  return tag;
+}
+
+/* Wait for a tagged command to finish and release its tag */
+bool fuji_bus_wait(uint8_t tag)
+{
+  fuji_outstanding *req = fuji_tag_lookup(tag);
+  bool success;
+
+
+  if (!req || !fuji_bus_claim())
     return false;
+
+  while (req->state == FUJI_TAG_PENDING)
+    if (!fuji_bus_receive(fujicom_timeouts[fuji_bus_timeout(req->device, req->command)]))
+      fuji_tag_finish(req, FUJI_TAG_FAILED, 0);
+
+  success = req->state == FUJI_TAG_DONE;
+  if (!success)
+    fujicom_stats.failures++;
+  req->tag = 0;
+  fuji_bus_busy = 0;
+  return success;
+}
+
+/* Where a tagged command has got to, without waiting */
+uint8_t fuji_bus_state(uint8_t tag)
+{
+  fuji_outstanding *req = fuji_tag_lookup(tag);
+
+
+  return req ? req->state : 0;
+}
+
+/* Worst case is every byte escaped, plus an END either side */
+uint16_t fuji_bus_reply_wire(size_t status_length, size_t reply_length)
+{
+  return 2 * (sizeof(fujibus_header) + status_length + reply_length) + 2;
+}
+
+/* Take in tagged replies that have started arriving in the receive
+ * ring, without waiting for the ones that haven't */
+void fuji_bus_pump(void)
+{
+  if (!fuji_in_flight || !port_rx_irq || port_rx_head == port_rx_tail
+      || !fuji_bus_claim())
+    return;
+
+  while (fuji_in_flight && port_rx_head != port_rx_tail)
+    if (!fuji_bus_receive(fujicom_timeouts[FUJI_TIMEOUT_SHORT]))
+      break;
+  fuji_bus_busy = 0;
+  return;
+}
+
+/* Queue a routine to be called from the timer tick once the bus is
+ * free, for callers that were turned away with REPLY_BUSY. A routine
+ * that is already waiting isn't queued twice. */
+bool fuji_bus_defer(fuji_deferred_fn func)
+{
+  uint8_t idx, free_idx = FUJI_DEFER_MAX;
+
+
+  _disable();
+  for (idx = 0; idx < FUJI_DEFER_MAX; idx++) {
+    if (fuji_deferred[idx] == func)
+      break;
+    if (!fuji_deferred[idx])
+      free_idx = idx;
   }
+  if (idx == FUJI_DEFER_MAX && free_idx < FUJI_DEFER_MAX)
+    fuji_deferred[idx = free_idx] = func;
+  _enable();
+  return idx < FUJI_DEFER_MAX;
+}
 
-  return true;
+/* Call everything that was waiting for the bus */
+void fuji_bus_run_deferred(void)
+{
+  fuji_deferred_fn func;
+  uint8_t idx;
+
+
+  for (idx = 0; idx < FUJI_DEFER_MAX; idx++) {
+    _disable();
+    func = fuji_deferred[idx];
+    fuji_deferred[idx] = NULL;
+    _enable();
+    if (func)
+      func();
+  }
+  return;
 }
 
 void fujicom_done(void)
 {
+  // Driver is going away, don't leave the ISR hooked
+  if (port_rx_irq) {
+    _disable();
+    outp(port_uart_base + UART_IER, 0);
+    if (fujicom_irq < 8)
+      outp(PIC1_MASK, inp(PIC1_MASK) | (1 << fujicom_irq));
+    else
+      outp(PIC2_MASK, inp(PIC2_MASK) | (1 << (fujicom_irq - 8)));
+    _dos_setvect(PORT_IRQ_VECTOR(fujicom_irq),
+                 MK_FP(port_rx_old_seg, port_rx_old_off));
+    port_rx_irq = 0;
+    _enable();
+  }
   return;
 }
 
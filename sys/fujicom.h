@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <fuji_f5.h>
 
 #define U32_MSW(v) ((uint16_t)(((uint32_t)(v) >> 16) & 0xFFFF))  // Most Significant Word
 #define U32_LSW(v) ((uint16_t)((uint32_t)(v) & 0xFFFF))          // Least Significant Word
@@ -45,15 +46,155 @@ typedef struct {
 
 #define STATUS_MOUNT_TIME       0x01
 
+/* FUJICMD_GET_BAUD_RATES reply */
+#define FUJI_BAUD_RATES_MAX     8
+typedef struct {
+  uint32_t saved;               // Last rate that passed FUJICMD_BAUD_TEST, 0 if none
+  uint32_t rates[FUJI_BAUD_RATES_MAX];  // Lowest first, unused ones are 0
+  uint8_t count;
+} fuji_baud_rates;
+
+/* Largest status block fuji_bus_call_status can split off a reply */
+#define FUJI_STATUS_MAX         16
+
+/* FujiBus extensions this driver implements, see FUJI_CAP_* */
+#define FUJI_CAPS_HOST          (FUJI_CAP_MULTI_SECTOR | FUJI_CAP_MEDIA_STATE | FUJI_CAP_BAUD \
+                                 | FUJI_CAP_RLE | FUJI_CAP_LZ | FUJI_CAP_TAGGED \
+                                 | FUJI_CAP_READ_STATUS)
+
+/* Header fields byte: aux descriptor in the low bits, tag above it */
+#define FUJI_FIELD_AUX_MASK     0x07
+#define FUJI_FIELD_TAG_MASK     0x78
+#define FUJI_FIELD_TAG_SHIFT    3
+#define FUJI_TAG_LAST           15
+
+/* Tagged commands that can be waiting for a reply at once */
+#define FUJI_TAGS_MAX           4
+
+/* fuji_bus_state */
+enum {
+  FUJI_TAG_PENDING = 1,
+  FUJI_TAG_DONE,
+  FUJI_TAG_FAILED,
+};
+
+/* Routines that can be waiting for the bus to come free */
+#define FUJI_DEFER_MAX          4
+typedef void (far *fuji_deferred_fn)(void);
+
+/* Receive timeout classes, see fuji_timeout_table */
+enum {
+  FUJI_TIMEOUT_SHORT = 0,
+  FUJI_TIMEOUT_SLOW,
+  FUJI_TIMEOUT_LONG,
+  FUJI_TIMEOUT_PROBE,
+  FUJI_TIMEOUT_CLASSES,
+};
+
+typedef struct {
+  uint32_t calls;
+  uint32_t retries;             // Packets sent again
+  uint32_t timeouts;            // Replies that never arrived
+  uint32_t bad_frames;          // Replies that were short or corrupt
+  uint32_t naks;
+  uint32_t failures;            // Calls that gave up
+  uint32_t busy;                // Calls turned away while the bus was in use
+} fujicom_counters;
+
+extern uint16_t fujicom_caps;
+extern uint32_t fujicom_clock;
+extern uint32_t fujicom_bps;
+extern fujicom_counters fujicom_stats;
+extern uint8_t fujicom_retries;
+extern uint16_t fujicom_timeouts[FUJI_TIMEOUT_CLASSES];   // In ticks
+extern volatile uint8_t fuji_bus_busy;
+
 /**
  * @brief start fujicom
  */
 extern void fujicom_init(void);
 
+/**
+ * @brief negotiate FujiBus extensions with the firmware
+ * @param offer the FUJI_CAPS_HOST bits to ask for
+ */
+extern void fujicom_get_caps(uint16_t offer);
+
+/**
+ * @brief UART divisor for bps, 0 if the clock can't get close enough
+ */
+extern uint16_t fujicom_divisor(uint32_t bps);
+
+/**
+ * @brief change the line speed, false if the UART clock can't do it
+ */
+extern bool fujicom_set_bps(uint32_t bps);
+
+/**
+ * @brief send through the 16550A transmit FIFO in bursts
+ */
+extern void fujicom_enable_tx_fifo(void);
+
+/**
+ * @brief receive through the UART interrupt instead of polling
+ */
+extern void fujicom_enable_irq(void);
+
 extern bool fuji_bus_call(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
                           uint8_t aux1, uint8_t aux2, uint8_t aux3, uint8_t aux4,
                           const void far *data, size_t data_length,
                           void far *reply, size_t reply_length);
+extern bool fuji_bus_call_status(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
+                                 uint8_t aux1, uint8_t aux2, uint8_t aux3, uint8_t aux4,
+                                 const void far *data, size_t data_length,
+                                 void far *status, size_t status_length,
+                                 void far *reply, size_t reply_length);
+
+/**
+ * @brief send a tagged command without waiting for the reply
+ * @return the tag to pass to fuji_bus_wait, 0 if the command can't be
+ *         tagged and has to go through fuji_bus_call_status instead,
+ *         always 0 without the receive IRQ
+ */
+extern uint8_t fuji_bus_submit(uint8_t device, uint8_t fuji_cmd, uint8_t fields,
+                               uint8_t aux1, uint8_t aux2, uint8_t aux3, uint8_t aux4,
+                               const void far *data, size_t data_length,
+                               void far *status, size_t status_length,
+                               void far *reply, size_t reply_length);
+
+/**
+ * @brief wait for the reply to a tagged command, replies to other tags
+ *        that arrive first are put away for their own fuji_bus_wait
+ */
+extern bool fuji_bus_wait(uint8_t tag);
+
+/**
+ * @brief FUJI_TAG_* for a tagged command, 0 if the tag isn't in use
+ */
+extern uint8_t fuji_bus_state(uint8_t tag);
+
+/**
+ * @brief most receive ring bytes the reply to a tagged command can
+ *        take, for callers that leave replies in the ring
+ */
+extern uint16_t fuji_bus_reply_wire(size_t status_length, size_t reply_length);
+
+/**
+ * @brief collect tagged replies already in the receive ring
+ */
+extern void fuji_bus_pump(void);
+
+/**
+ * @brief call func from the timer tick once the bus is free, it must
+ *        preserve all registers and not call DOS
+ * @return false if too many routines are already waiting
+ */
+extern bool fuji_bus_defer(fuji_deferred_fn func);
+
+/**
+ * @brief call the routines fuji_bus_defer queued, the bus must be free
+ */
+extern void fuji_bus_run_deferred(void);
 
 /**
  * @brief end fujicom
@@ -0,0 +1,119 @@
+/**
+ * Hydrate small images into XMS
+ *
+ * Once a unit's BPB shows an image no bigger than hydrate_max_kb, an
+ * XMS block is allocated for it and the INT 28h hook streams the
+ * image in, front to back, HYDRATE_CHUNK sectors at a time. Never from
+ * the timer: a chunk is a long wire_read and an XMS move, and the tick
+ * may have interrupted a program in the middle of its own XMS call. Reads of
+ * sectors that have arrived are served from XMS, anything past that
+ * still goes over the wire. Writes always go to the FujiNet and
+ * update the copy, so dropping it never loses data.
+ */
+
+#include "hydrate.h"
+#include "diskio.h"
+#include "fujinet.h"
+#include "xms.h"
+#include <dos.h>
+
+uint16_t hydrate_max_kb;
+hydrate_unit hydrate_units[FN_MAX_DEV];
+
+static uint8_t far *stage_buf;
+
+void hydrate_setup(uint16_t segment, uint16_t max_kb)
+{
+  stage_buf = MK_FP(segment, 0);
+  hydrate_max_kb = max_kb;
+  return;
+}
+
+void hydrate_drop(uint8_t unit)
+{
+  hydrate_unit *hu = &hydrate_units[unit];
+
+
+  if (hu->handle)
+    xms_free(hu->handle);
+  hu->handle = 0;
+  hu->total = hu->done = 0;
+  return;
+}
+
+void hydrate_start(uint8_t unit, uint32_t sectors)
+{
+  hydrate_unit *hu = &hydrate_units[unit];
+  uint32_t kbytes = (sectors * SECTOR_SIZE + 1023) / 1024;
+
+
+  hydrate_drop(unit);
+  if (!hydrate_max_kb || !sectors || kbytes > hydrate_max_kb)
+    return;
+
+  hu->handle = xms_alloc(kbytes);
+  if (hu->handle)
+    hu->total = sectors;
+  return;
+}
+
+uint16_t hydrate_read(uint8_t unit, uint32_t sector, uint16_t count, uint8_t far *buf)
+{
+  hydrate_unit *hu = &hydrate_units[unit];
+  uint16_t avail;
+
+
+  if (!hu->handle || sector >= hu->done)
+    return 0;
+
+  avail = hu->done - sector < count ? hu->done - sector : count;
+  if (!xms_copy_from(hu->handle, sector * SECTOR_SIZE, buf, avail * SECTOR_SIZE)) {
+    hydrate_drop(unit);
+    return 0;
+  }
+  return avail;
+}
+
+void hydrate_written(uint8_t unit, uint32_t sector, uint16_t count, const uint8_t far *buf)
+{
+  hydrate_unit *hu = &hydrate_units[unit];
+
+
+  // Sectors past done will be fetched with the new data later
+  if (!hu->handle || sector >= hu->done)
+    return;
+  if (sector + count > hu->done)
+    count = hu->done - sector;
+  if (!xms_copy_to(hu->handle, sector * SECTOR_SIZE, buf, count * SECTOR_SIZE))
+    hydrate_drop(unit);
+  return;
+}
+
+void hydrate_tick(void)
+{
+  hydrate_unit *hu;
+  uint8_t unit;
+  uint16_t count, got;
+
+
+  for (unit = 0; unit < FN_MAX_DEV; unit++) {
+    hu = &hydrate_units[unit];
+    if (hu->handle && hu->done < hu->total)
+      break;
+  }
+  if (unit == FN_MAX_DEV)
+    return;
+
+  count = HYDRATE_CHUNK;
+  if (hu->done + count > hu->total)
+    count = hu->total - hu->done;
+
+  // The wire keeps working if this image won't come across
+  got = wire_read(unit, hu->done, count, stage_buf);
+  if (!got || !xms_copy_to(hu->handle, hu->done * SECTOR_SIZE, stage_buf, got * SECTOR_SIZE)) {
+    hydrate_drop(unit);
+    return;
+  }
+  hu->done += got;
+  return;
+}
@@ -0,0 +1,47 @@
+#ifndef _HYDRATE_H
+#define _HYDRATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sectors pulled per background step, also the staging buffer size
+#define HYDRATE_CHUNK           16
+
+typedef struct {
+  uint16_t handle;              // XMS block holding the image, 0 if none
+  uint32_t total;               // Sectors in the image
+  uint32_t done;                // Sectors 0 to done-1 are in memory
+} hydrate_unit;
+
+extern uint16_t hydrate_max_kb;
+extern hydrate_unit hydrate_units[];
+
+/**
+ * @brief enable hydration of images up to max_kb
+ * @param segment staging buffer of HYDRATE_CHUNK sectors
+ */
+extern void hydrate_setup(uint16_t segment, uint16_t max_kb);
+
+/**
+ * @brief start pulling a freshly mounted image into memory
+ */
+extern void hydrate_start(uint8_t unit, uint32_t sectors);
+
+/**
+ * @brief forget the copy of an image that is no longer mounted
+ */
+extern void hydrate_drop(uint8_t unit);
+
+/* Returns how many leading sectors were served from memory */
+extern uint16_t hydrate_read(uint8_t unit, uint32_t sector, uint16_t count,
+                             uint8_t far *buf);
+extern void hydrate_written(uint8_t unit, uint32_t sector, uint16_t count,
+                            const uint8_t far *buf);
+
+/**
+ * @brief pull the next chunk of any image still hydrating, only from
+ *        INT 28h
+ */
+extern void hydrate_tick(void);
+
+#endif /* _HYDRATE_H */
@@ -5,11 +5,24 @@
 #include "id8250.h"
 #include "print.h"
 #include "dispatch.h"
+#include "diskio.h"
+#include "cache.h"
+#include "readahead.h"
+#include "timer.h"
+#include "hydrate.h"
+#include "cachefile.h"
+#include "fatchain.h"
+#include "timing.h"
+#include "compress.h"
+#include "xms.h"
+#include "ioctl.h"
+#include "autobps.h"
 #include <fuji_f5.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <dos.h>
 
 #ifndef VERSION
@@ -18,6 +31,9 @@
 
 #include <stdio.h>
 
+// About a second, mounting an image and then typing DIR takes longer
+#define MEDIA_CHECK_DEFAULT     TICKS_PER_SEC
+
 #if defined(__WATCOMC__)
 
 #define CC_VERSION_MINOR	(__WATCOMC__ % 100)
@@ -59,11 +75,28 @@ uint8_t get_set_time(uint8_t set_flag);
 void check_uart();
 uint16_t parse_config(const uint8_t far *config_sys);
 void find_drive_letter(uint8_t num_units);
+uint16_t caps_offer(void);
+void setup_autobps(void);
+void setup_compress(void);
+void setup_timing(void);
+void setup_cache(void);
+void setup_readahead(void);
+void setup_writeback(void);
+void setup_hydrate(void);
+void setup_fatchain(void);
+void setup_cachefile(uint8_t num_units);
+void preload_bpb(void);
+
+/* Everything from here up stays resident. Near allocations have to
+ * come before far ones so they stay inside our segment. */
+static uint32_t resident_top;
+static uint32_t resident_limit;
+
+static char first_drive;
 
 uint16_t Init_cmd(SYSREQ far *req)
 {
-  uint8_t err;
-  uint16_t unused;
+  uint8_t err, dos_major;
 
 
   regs.h.ah = 0x30;
@@ -73,15 +106,37 @@ uint16_t Init_cmd(SYSREQ far *req)
 	   " on MS-DOS %i.%i\n",
 	   CC_VERSION_MAJOR, CC_VERSION_MINOR,
 	   regs.h.al, regs.h.ah);
-  unused = parse_config(req->init.bpb_ptr);
+  dos_major = regs.h.al;
+  parse_config(req->init.bpb_ptr);
   environ = (char **) &config_env;
 
-  req->init.end_ptr = MK_FP(getCS(), (uint8_t *) &driver_end - unused);
+  // DOS 5+ tells us how far we're allowed to grow
+  resident_limit = (uint32_t) *(uint16_t far *) MK_FP(0x40, 0x13) * 1024;
+  if (dos_major >= 5 && req->init.end_ptr)
+    resident_limit = ((uint32_t) FP_SEG(req->init.end_ptr) << 4) + FP_OFF(req->init.end_ptr);
+  resident_limit -= (uint32_t) getCS() << 4;
+  // The options are read with getenv until the end of Init_cmd, so
+  // config_env has to stay out of the way of init_alloc
+  resident_top = (uint16_t) &driver_end;
+
+  req->init.end_ptr = MK_FP(getCS(), (uint8_t *) &driver_end);
 
   fujicom_init();
   check_uart();
 
+  // PCjr is the only machine with model byte FD
+  is_pcjr = *(uint8_t far *) MK_FP(0xF000, 0xFFFE) == 0xFD;
+
+  // MEDIACHECK=TICKS - how long a media check answer stays good
+  media_check_ticks = MEDIA_CHECK_DEFAULT;
+  if (getenv("MEDIACHECK"))
+    media_check_ticks = atoi(getenv("MEDIACHECK"));
+
   err = get_fujinet_version();
+  if (!err) {
+    fujicom_get_caps(caps_offer());
+    setup_autobps();
+  }
   if (!err)
     err = get_set_time(!getenv("NOTIME"));
 
@@ -124,6 +179,21 @@ uint16_t Init_cmd(SYSREQ far *req)
 
   find_drive_letter(req->init.num_units);
 
+  setup_timing();
+  setup_compress();
+  setup_cache();
+  setup_readahead();
+  setup_writeback();
+  setup_hydrate();
+  setup_fatchain();
+  setup_cachefile(req->init.num_units);
+  preload_bpb();
+  req->init.end_ptr = MK_FP(getCS() + (uint16_t) (resident_top >> 4),
+                            (uint16_t) resident_top & 15);
+
+  // Deferred bus work and INT F5 async callbacks need the ticks even
+  // with none of the caches set up
+  install_background();
   setf5();
   consolef("INT F5 Functions installed.\n");
 
@@ -204,6 +274,9 @@ void check_uart()
   switch (uart) {
   case UART_16550A:
     consolef("Serial port is 16550A w/FIFO\n");
+    fujicom_enable_tx_fifo();
+    if (!getenv("NOIRQ"))
+      fujicom_enable_irq();
     break;
 
   case UART_16550:
@@ -226,7 +299,7 @@ void check_uart()
   return;
 }
 
-/* Parse CONFIG.SYS command line, returns number of bytes remaining in config_env */
+/* Parse CONFIG.SYS command line, returns number of bytes used in config_env */
 #define IS_CONFIG_EOL(c) (c == '\r' || c == '\n')
 uint16_t parse_config(const uint8_t far *config_sys)
 {
@@ -333,5 +406,383 @@ void find_drive_letter(uint8_t num_units)
   // Undocumented but reliable field:
   // The number of current block devices in the List of Lists at 0x20
   first = lol[0x20] + 'A';
+  first_drive = first;
   consolef("FujiNet attached to drives %c:-%c:\n", first, first + num_units - 1);
 }
+
+/* Grow the resident image. Returns NULL if it won't fit in our segment
+ * or below what DOS said we could use. */
+void *init_alloc(uint16_t size)
+{
+  void *ptr;
+
+
+  if (resident_top + size > 0xFFF0 || resident_top + size > resident_limit)
+    return NULL;
+  ptr = (void *) (uint16_t) resident_top;
+  resident_top += size;
+  return ptr;
+}
+
+/* Same but paragraph aligned and allowed to go past 64K, returns
+ * segment or 0 */
+uint16_t init_alloc_seg(uint16_t paragraphs)
+{
+  uint32_t base = (resident_top + 15) & ~15UL;
+
+
+  if (base + ((uint32_t) paragraphs << 4) > resident_limit)
+    return 0;
+  resident_top = base + ((uint32_t) paragraphs << 4);
+  return getCS() + (uint16_t) (base >> 4);
+}
+
+/* COMPRESS[=RLE] - compression is only offered when asked for, RLE
+ * leaves out LZ. Tagged replies can only be taken as they come with
+ * port_rx_isr filling the ring, so no receive IRQ means no tags. */
+uint16_t caps_offer(void)
+{
+  const char *opt;
+  uint16_t offer = FUJI_CAPS_HOST & ~(FUJI_CAP_RLE | FUJI_CAP_LZ);
+
+
+  if (getenv("NOPIPELINE") || !port_rx_irq)
+    offer &= ~FUJI_CAP_TAGGED;
+
+  opt = getenv("COMPRESS");
+  if (opt) {
+    offer |= FUJI_CAP_RLE;
+    if (stricmp(opt, "RLE"))
+      offer |= FUJI_CAP_LZ;
+  }
+  return offer;
+}
+
+/* Room to compress writes into, bigger ones go as they are unless
+ * they shrink to fit */
+#define COMPRESS_BUF_SIZE       1024
+void setup_compress(void)
+{
+  uint8_t *buf;
+
+
+  if (!(fujicom_caps & FUJI_CAP_RLE))
+    return;
+
+  buf = init_alloc(COMPRESS_BUF_SIZE);
+  if (!buf)
+    consolef("Not enough memory to compress writes\n");
+  else
+    compress_setup(buf, COMPRESS_BUF_SIZE);
+  consolef("Compression: RLE%s\n", fujicom_caps & FUJI_CAP_LZ ? ", LZ" : "");
+  return;
+}
+
+/* AUTOBPS[=MAX] - starting from FUJI_BPS, go up to the fastest speed
+ * both the FujiNet and the UART can manage, but not past MAX */
+void setup_autobps(void)
+{
+  const char *opt;
+  uint32_t mark;
+  void *space;
+
+
+  opt = getenv("AUTOBPS");
+  if (!opt)
+    return;
+
+  if (!(fujicom_caps & FUJI_CAP_BAUD)) {
+    consolef("AUTOBPS needs speed negotiation in firmware\n");
+    return;
+  }
+
+  mark = resident_top;
+  space = init_alloc(AUTOBPS_SPACE);
+  if (!space) {
+    consolef("Not enough memory for AUTOBPS\n");
+    return;
+  }
+  autobps_negotiate(strtoul(opt, NULL, 10), space);
+
+  resident_top = mark;
+  consolef("Serial line at %ld bps\n", (int32_t) fujicom_bps);
+  return;
+}
+
+/* TIMING - keep latency histograms of every FujiBus call */
+void setup_timing(void)
+{
+  fuji_timing_stats *stats;
+
+
+  if (!getenv("TIMING"))
+    return;
+
+  stats = init_alloc(sizeof(*stats));
+  if (!stats) {
+    consolef("Not enough memory for timing\n");
+    return;
+  }
+
+  timing_setup(stats);
+  consolef("Timing FujiBus calls\n");
+  return;
+}
+
+/* CACHE=KB[,CONV|UMB|XMS] - without a location try XMS, then an
+ * upper memory block, then plain conventional memory */
+void setup_cache(void)
+{
+  const char *opt, *where;
+  uint16_t kbytes, entries, paragraphs, handle = 0;
+  uint8_t location = FUJI_CACHE_NONE;
+  uint32_t mark;
+  cache_entry *table;
+  static const char *location_names[] = {"", "conventional", "upper", "extended"};
+
+
+  opt = getenv("CACHE");
+  if (!opt)
+    return;
+
+  kbytes = atoi(opt);
+  entries = kbytes * (1024 / SECTOR_SIZE);
+  if (entries > CACHE_MAX_ENTRIES) {
+    entries = CACHE_MAX_ENTRIES;
+    kbytes = entries / (1024 / SECTOR_SIZE);
+  }
+  if (!entries)
+    return;
+  paragraphs = entries * (SECTOR_SIZE / 16);
+  where = strchr(opt, ',');
+
+  mark = resident_top;
+  table = init_alloc(entries * sizeof(cache_entry));
+  if (!table) {
+    consolef("Not enough memory for sector cache\n");
+    return;
+  }
+
+  if ((!where || !stricmp(where, ",XMS")) && xms_init()) {
+    handle = xms_alloc(kbytes);
+    if (handle)
+      location = FUJI_CACHE_XMS;
+  }
+  if (!location && (!where || !stricmp(where, ",UMB")) && xms_init()) {
+    handle = xms_alloc_umb(paragraphs);
+    if (handle)
+      location = FUJI_CACHE_UMB;
+  }
+  if (!location && (!where || !stricmp(where, ",CONV"))) {
+    handle = init_alloc_seg(paragraphs);
+    if (handle)
+      location = FUJI_CACHE_CONV;
+  }
+
+  if (!location) {
+    resident_top = mark;
+    consolef("Not enough memory for sector cache\n");
+    return;
+  }
+
+  cache_setup(table, entries, location, handle);
+  consolef("Sector cache %iK in %s memory\n", kbytes, location_names[location]);
+  return;
+}
+
+/* READAHEAD=N - prefetch N sectors once a unit is read sequentially */
+void setup_readahead(void)
+{
+  const char *opt;
+  uint16_t window, segment;
+
+
+  opt = getenv("READAHEAD");
+  if (!opt)
+    return;
+
+  window = atoi(opt);
+  if (window > DISKIO_MULTI_MAX)
+    window = DISKIO_MULTI_MAX;
+  if (window < 2)
+    return;
+
+  // One sector per round trip gains nothing from prefetching
+  if (!(fujicom_caps & FUJI_CAP_MULTI_SECTOR)) {
+    consolef("Read-ahead needs multi-sector support in firmware\n");
+    return;
+  }
+
+  segment = init_alloc_seg(window * (SECTOR_SIZE / 16));
+  if (!segment) {
+    consolef("Not enough memory for read-ahead\n");
+    return;
+  }
+
+  readahead_setup(segment, window);
+  consolef("Read-ahead %i sectors\n", window);
+  return;
+}
+
+/* WRITEBACK[=SECONDS] - hold writes in the sector cache for at most
+ * SECONDS before they are sent to the FujiNet */
+#define WRITEBACK_DEFAULT_AGE   2
+#define WRITEBACK_MAX_AGE       3600
+void setup_writeback(void)
+{
+  const char *opt;
+  uint16_t seconds, segment;
+
+
+  opt = getenv("WRITEBACK");
+  if (!opt)
+    return;
+
+  if (!cache_entries) {
+    consolef("Write-back needs CACHE=\n");
+    return;
+  }
+
+  seconds = atoi(opt);
+  if (!seconds)
+    seconds = WRITEBACK_DEFAULT_AGE;
+  if (seconds > WRITEBACK_MAX_AGE)
+    seconds = WRITEBACK_MAX_AGE;
+
+  segment = init_alloc_seg(WRITEBACK_BATCH * (SECTOR_SIZE / 16));
+  if (!segment) {
+    consolef("Not enough memory for write-back\n");
+    return;
+  }
+
+  cache_writeback(segment, seconds * TICKS_PER_SEC);
+  consolef("Write-back cache, flushed within %i seconds\n", seconds);
+  return;
+}
+
+/* HYDRATE[=KB] - copy images up to KB into XMS in the background */
+#define HYDRATE_DEFAULT_KB      720
+void setup_hydrate(void)
+{
+  const char *opt;
+  uint16_t kbytes, segment;
+
+
+  opt = getenv("HYDRATE");
+  if (!opt)
+    return;
+
+  kbytes = atoi(opt);
+  if (!kbytes)
+    kbytes = HYDRATE_DEFAULT_KB;
+
+  if (!xms_init()) {
+    consolef("Hydrate needs an XMS driver\n");
+    return;
+  }
+
+  segment = init_alloc_seg(HYDRATE_CHUNK * (SECTOR_SIZE / 16));
+  if (!segment) {
+    consolef("Not enough memory for hydrate\n");
+    return;
+  }
+
+  hydrate_setup(segment, kbytes);
+  consolef("Hydrating images up to %iK into XMS\n", kbytes);
+  return;
+}
+
+/* FATPREFETCH[=CLUSTERS] - follow the FAT from each cluster DOS reads and
+ * prefetch up to CLUSTERS of where the file goes next */
+#define FATPREFETCH_DEFAULT     4
+#define FATPREFETCH_MAX         64
+void setup_fatchain(void)
+{
+  const char *opt;
+  uint16_t clusters, segment;
+
+
+  opt = getenv("FATPREFETCH");
+  if (!opt)
+    return;
+
+  if (!cache_entries) {
+    consolef("FAT prefetch needs CACHE=\n");
+    return;
+  }
+
+  clusters = atoi(opt);
+  if (!clusters)
+    clusters = FATPREFETCH_DEFAULT;
+  if (clusters > FATPREFETCH_MAX)
+    clusters = FATPREFETCH_MAX;
+
+  segment = init_alloc_seg(FATCHAIN_STAGE * (SECTOR_SIZE / 16));
+  if (!segment) {
+    consolef("Not enough memory for FAT prefetch\n");
+    return;
+  }
+
+  fatchain_setup(segment, clusters);
+  consolef("FAT prefetch %i clusters\n", clusters);
+  return;
+}
+
+/* CACHEFILE=D:\PATH - save the sector cache to a file on a local disk */
+void setup_cachefile(uint8_t num_units)
+{
+  const char *opt;
+  char drive;
+  uint16_t segment;
+
+
+  opt = getenv("CACHEFILE");
+  if (!opt)
+    return;
+
+  if (!cache_entries) {
+    consolef("Cache file needs CACHE=\n");
+    return;
+  }
+
+  // Has to be a full path on a drive that isn't ours
+  drive = toupper(opt[0]);
+  if (strlen(opt) >= CACHEFILE_PATH_MAX || opt[1] != ':'
+      || (drive >= first_drive && drive < first_drive + num_units)) {
+    consolef("Cache file must be a full path on a local drive\n");
+    return;
+  }
+
+  segment = init_alloc_seg(SECTOR_SIZE / 16);
+  if (!segment) {
+    consolef("Not enough memory for cache file\n");
+    return;
+  }
+
+  cachefile_setup(opt, segment);
+  consolef("Cache file %s\n", opt);
+  return;
+}
+
+/* Images that are already mounted get their real BPB instead of the
+ * 360K default. Borrows memory past the resident end for the boot
+ * sector. */
+void preload_bpb(void)
+{
+  uint8_t unit;
+  uint16_t segment;
+  uint32_t mark;
+
+
+  if (!media_refresh())
+    return;
+
+  mark = resident_top;
+  segment = init_alloc_seg(SECTOR_SIZE / 16);
+  if (segment)
+    for (unit = 0; unit < FN_MAX_DEV; unit++)
+      if (unit_mounted(unit))
+        bpb_refresh(unit, MK_FP(segment, 0));
+  resident_top = mark;
+  return;
+}
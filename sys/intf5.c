@@ -1,11 +1,188 @@
 #include "fujicom.h"
+#include "portio.h"
 #include "print.h"
 #include "commands.h"
+#include "dispatch.h"
+#include "timing.h"
 #include <fuji_f5.h>
+#include <string.h>
 #include <dos.h>
 
 #pragma data_seg("_CODE")
 
+/* Requests submitted with FUJIINT_ASYNC. Without tagged commands or
+ * interrupt driven receive the command is done on the spot and the
+ * handle just holds the result. Replies wait in the receive ring until
+ * the caller or the timer tick collects them, so a reply that might
+ * not fit next to the others still outstanding is done on the spot
+ * too. */
+typedef struct {
+  uint8_t in_use;
+  uint8_t tag;                  // 0 once the reply is in
+  uint8_t result;               // REPLY_* once it's done, 0 before
+  uint16_t wire;                // Ring bytes held for the reply
+  fuji_deferred_fn callback;
+} intf5_async;
+
+#define FUJI_ASYNC_MAX          4
+static intf5_async async_reqs[FUJI_ASYNC_MAX];
+static uint16_t async_wire;
+
+static intf5_async *async_lookup(uint8_t handle)
+{
+  if (!handle || handle > FUJI_ASYNC_MAX || !async_reqs[handle - 1].in_use)
+    return NULL;
+  return &async_reqs[handle - 1];
+}
+
+static uint8_t async_result(intf5_async *req, bool block)
+{
+  if (!req->result
+      && (block || fuji_bus_state(req->tag) != FUJI_TAG_PENDING)) {
+    req->result = fuji_bus_wait(req->tag) ? REPLY_COMPLETE : REPLY_ERROR;
+    req->tag = 0;
+    async_wire -= req->wire;
+    req->wire = 0;
+  }
+  return req->result;
+}
+
+static uint16_t intf5_submit(uint16_t descrdir, uint16_t devcom, uint16_t aux12,
+                             uint16_t aux34, void far *ptr, uint16_t length)
+{
+  intf5_async *req = NULL;
+  uint8_t idx;
+  const void far *data = NULL;
+  void far *reply = NULL;
+  uint16_t data_length = 0, reply_length = 0, wire;
+
+
+  for (idx = 0; idx < FUJI_ASYNC_MAX && !req; idx++)
+    if (!async_reqs[idx].in_use)
+      req = &async_reqs[idx];
+  if (!req)
+    return REPLY_ERROR;
+
+  switch (descrdir & FUJIINT_DIRECTION) {
+  case FUJIINT_READ:
+    reply = ptr;
+    reply_length = length;
+    break;
+  case FUJIINT_WRITE:
+    data = ptr;
+    data_length = length;
+    break;
+  }
+
+  req->tag = 0;
+  req->result = 0;
+  req->callback = NULL;
+  req->wire = 0;
+  wire = fuji_bus_reply_wire(0, reply_length);
+  if (port_rx_irq && async_wire + wire < PORT_RX_RING) {
+    req->tag = fuji_bus_submit(devcom & 0xFF, devcom >> 8, descrdir >> 8,
+                               aux12 & 0xFF, aux12 >> 8, aux34 & 0xFF, aux34 >> 8,
+                               data, data_length, NULL, 0, reply, reply_length);
+    if (req->tag) {
+      req->wire = wire;
+      async_wire += wire;
+    }
+  }
+  if (!req->tag)
+    req->result = fuji_bus_call(devcom & 0xFF, devcom >> 8, descrdir >> 8,
+                                aux12 & 0xFF, aux12 >> 8, aux34 & 0xFF, aux34 >> 8,
+                                data, data_length, reply, reply_length)
+      ? REPLY_COMPLETE : REPLY_ERROR;
+
+  req->in_use = 1;
+  return (req - async_reqs + 1) << 8 | REPLY_COMPLETE;
+}
+
+/* Finish off async requests with a completion routine, from the timer
+ * tick while the bus is free */
+void intf5_async_tick(void)
+{
+  intf5_async *req;
+  fuji_deferred_fn callback;
+  uint8_t idx, result, handle;
+
+
+  fuji_bus_pump();
+
+  for (idx = 0; idx < FUJI_ASYNC_MAX; idx++) {
+    req = &async_reqs[idx];
+    if (!req->in_use || !req->callback || !async_result(req, false))
+      continue;
+
+    callback = req->callback;
+    result = req->result;
+    handle = idx + 1;
+    req->in_use = 0;
+    _asm {
+      mov al, result
+      mov ah, handle
+      call dword ptr callback
+    }
+  }
+  return;
+}
+
+/* FUJIINT_DRIVER - queries answered by the driver without talking to
+ * the FujiNet, returns REPLY_* */
+static uint8_t intf5_driver(uint8_t query, uint8_t handle, void far *ptr, uint16_t length)
+{
+  intf5_async *req;
+
+
+  switch (query) {
+  case FUJIDRV_TIMING_GET:
+    if (!timing_stats)
+      return REPLY_ERROR;
+    if (length > sizeof(*timing_stats))
+      length = sizeof(*timing_stats);
+    _fmemcpy(ptr, timing_stats, length);
+    return REPLY_COMPLETE;
+
+  case FUJIDRV_TIMING_RESET:
+    if (!timing_stats)
+      return REPLY_ERROR;
+    timing_reset();
+    return REPLY_COMPLETE;
+
+  case FUJIDRV_BUS_DEFER:
+    return fuji_bus_defer((fuji_deferred_fn) ptr) ? REPLY_COMPLETE : REPLY_ERROR;
+
+  case FUJIDRV_ASYNC_POLL:
+  case FUJIDRV_ASYNC_WAIT:
+    req = async_lookup(handle);
+    if (!req)
+      return REPLY_ERROR;
+    if (fuji_bus_busy)
+      return REPLY_BUSY;
+    driver_busy++;
+    fuji_bus_pump();
+    if (async_result(req, query == FUJIDRV_ASYNC_WAIT))
+      req->in_use = 0;
+    driver_busy--;
+    return req->result ? req->result : REPLY_PENDING;
+
+  case FUJIDRV_ASYNC_CALLBACK:
+    req = async_lookup(handle);
+    if (!req)
+      return REPLY_ERROR;
+    req->callback = (fuji_deferred_fn) ptr;
+    return REPLY_COMPLETE;
+
+  case FUJIDRV_CAPS_GET:
+    if (length > sizeof(fujicom_caps))
+      length = sizeof(fujicom_caps);
+    _fmemcpy(ptr, &fujicom_caps, length);
+    return REPLY_COMPLETE;
+  }
+
+  return REPLY_ERROR;
+}
+
 /*
  * DL		== direction
  * DH           == field descriptor
@@ -21,10 +198,25 @@ int intf5(uint16_t descrdir, uint16_t devcom, uint16_t aux12, uint16_t aux34,
 	  void far *ptr, uint16_t length)
 #pragma aux intf5 parm [dx] [ax] [cx] [si] [es bx] [di] value [ax]
 {
-  bool success;
+  bool success = false;
+  uint16_t result;
 
   _enable();
 
+  if ((descrdir & 0xFF) == FUJIINT_DRIVER)
+    return intf5_driver(devcom >> 8, aux12 & 0xFF, ptr, length);
+
+  // Called from an interrupt that broke in on a bus call
+  if (fuji_bus_busy)
+    return REPLY_BUSY;
+
+  driver_busy++;
+  if (descrdir & FUJIINT_ASYNC) {
+    result = intf5_submit(descrdir, devcom, aux12, aux34, ptr, length);
+    driver_busy--;
+    return result;
+  }
+
   switch (descrdir & 0xFF) {
   case FUJIINT_NONE: // No Payload
     success = fuji_bus_call(devcom & 0xFF, devcom >> 8, descrdir >> 8,
@@ -42,6 +234,7 @@ int intf5(uint16_t descrdir, uint16_t devcom, uint16_t aux12, uint16_t aux34,
                             (uint8_t far *) ptr, length, NULL, 0);
     break;
   }
+  driver_busy--;
 
   return success ? 'C' : 'E';
 }
@@ -1,7 +1,86 @@
 #include <stdint.h>
 
+enum {
+  FUJI_IOCTL_IDENTIFY           = 0,
+  FUJI_IOCTL_CACHE_STATS        = 1,
+  FUJI_IOCTL_READAHEAD_STATS    = 2,
+  FUJI_IOCTL_FLUSH              = 3,    // IOCTL output, write back dirty sectors
+  FUJI_IOCTL_HYDRATE_STATS      = 4,
+  FUJI_IOCTL_FATCHAIN_STATS     = 5,
+  FUJI_IOCTL_BUS_STATS          = 6,
+  FUJI_IOCTL_COMPRESS_STATS     = 7,
+};
+
+enum {
+  FUJI_CACHE_NONE = 0,
+  FUJI_CACHE_CONV,
+  FUJI_CACHE_UMB,
+  FUJI_CACHE_XMS,
+};
+
 typedef struct {
   uint8_t query;
   char signature[4];
   uint8_t unit;
 } fuji_ioctl_query;
+
+typedef struct {
+  fuji_ioctl_query id;
+  uint8_t location;             // FUJI_CACHE_*
+  uint16_t sectors;             // Cache size in sectors, 0 if disabled
+  uint32_t hits;
+  uint32_t misses;
+  uint16_t max_age;             // Write-back dirty age in ticks, 0 if write through
+  uint16_t dirty;               // Sectors waiting to be written
+  uint32_t flushed;             // Sectors written back
+  uint32_t lost;                // Dirty sectors dropped by a remount or error
+  uint32_t warm;                // Sectors loaded from the cache file
+} fuji_ioctl_cache_stats;
+
+typedef struct {
+  fuji_ioctl_query id;
+  uint16_t window;              // Sectors per prefetch, 0 if disabled
+  uint32_t fetched;             // Sectors read ahead of DOS asking
+  uint32_t hits;                // Requested sectors served from prefetch
+  uint32_t wasted;              // Prefetched sectors thrown away unused
+} fuji_ioctl_readahead_stats;
+
+typedef struct {
+  fuji_ioctl_query id;
+  uint16_t max_kb;              // Largest image hydrated, 0 if disabled
+  uint32_t sectors;             // Sectors in this unit's image, 0 if not hydrating
+  uint32_t hydrated;            // Sectors already in memory
+} fuji_ioctl_hydrate_stats;
+
+typedef struct {
+  fuji_ioctl_query id;
+  uint16_t window;              // Clusters followed per read, 0 if disabled
+  uint32_t prefetched;          // Sectors fetched by following the FAT
+  uint32_t hits;                // Prefetched sectors DOS went on to read
+  uint32_t wasted;              // Prefetched sectors evicted unread
+} fuji_ioctl_fatchain_stats;
+
+typedef struct {
+  fuji_ioctl_query id;
+  uint8_t retries;              // Retransmits allowed per call
+  uint16_t short_ticks;         // Receive timeout for status and sector I/O
+  uint16_t slow_ticks;          // Receive timeout for everything else
+  uint16_t long_ticks;          // Receive timeout for OPEN, COPY_FILE and mounts
+  uint32_t calls;
+  uint32_t retried;             // Packets sent again
+  uint32_t timeouts;            // Replies that never arrived
+  uint32_t bad_frames;          // Replies that were short or corrupt
+  uint32_t naks;
+  uint32_t failed;              // Calls that gave up
+} fuji_ioctl_bus_stats;
+
+typedef struct {
+  fuji_ioctl_query id;
+  uint16_t caps;                // FUJI_CAP_RLE and FUJI_CAP_LZ if in use
+  uint32_t read_raw;            // Reply bytes after decoding
+  uint32_t read_wire;           // The same replies as sent by the FujiNet
+  uint32_t write_raw;           // Payload bytes before encoding
+  uint32_t write_wire;          // The same payloads as sent to the FujiNet
+  uint32_t decode_clocks;       // PIT clocks spent decoding, needs TIMING
+  uint32_t encode_clocks;       // PIT clocks spent encoding, needs TIMING
+} fuji_ioctl_compress_stats;
@@ -1,5 +1,8 @@
 _TEXT	segment word public 'CODE'
 	extern	intf5_:near
+	extern	timer_tick_:near
+	extern	idle_tick_:near
+	extern	_bg_stack_top:word
 
 	; Macro to create an interrupt wrapper for a given C function
 INTERRUPT MACRO func
@@ -32,8 +35,111 @@ INTERRUPT MACRO func
 	func&vect_ ENDP
 ENDM
 
+; FUJIDRV_SIGNATURE, right in front of the INT F5 entry point so
+; programs can tell this driver from older ones before sending it
+; FUJIINT_DRIVER queries
+	db	'FUJIDRV', 0
 	INTERRUPT	intf5_
 
+; Storage for old INT 08h handler address
+	PUBLIC	_old_timer_off
+	PUBLIC	_old_timer_seg
+_old_timer_off	dw	0
+_old_timer_seg	dw	0
+
+; Storage for old INT 28h handler address
+	PUBLIC	_old_idle_off
+	PUBLIC	_old_idle_seg
+_old_idle_off	dw	0
+_old_idle_seg	dw	0
+
+; Set while timer_tick or idle_tick is running so neither re-enters
+_bg_active	db	0
+_bg_ss		dw	0
+_bg_sp		dw	0
+
+; Macro to call a background C function on our own stack with DS=CS.
+; Bus calls can take a while so interrupts are back on while it runs.
+BACKGROUND MACRO func
+	push	ax
+	push	bx
+	push	cx
+	push	dx
+	push	si
+	push	di
+	push	bp
+	push	ds
+	push	es
+	push	cs
+	pop	ds
+
+	cli
+	mov	cs:_bg_ss, ss
+	mov	cs:_bg_sp, sp
+	mov	ax, cs
+	mov	ss, ax
+	mov	sp, cs:_bg_stack_top
+	sti
+
+	call	func
+
+	cli
+	mov	ss, cs:_bg_ss
+	mov	sp, cs:_bg_sp
+
+	pop	es
+	pop	ds
+	pop	bp
+	pop	di
+	pop	si
+	pop	dx
+	pop	cx
+	pop	bx
+	pop	ax
+ENDM
+
+; INT 08h timer wrapper - lets the old handler count the tick and
+; acknowledge the PIC first, since bus timeouts watch the BIOS tick
+	PUBLIC	timer_vect_
+timer_vect_ PROC NEAR
+	pushf
+	call	dword ptr cs:[_old_timer_off]
+
+	cmp	byte ptr cs:_bg_active, 0
+	jne	timer_done
+	mov	byte ptr cs:_bg_active, 1
+	BACKGROUND	timer_tick_
+	mov	byte ptr cs:_bg_active, 0
+timer_done:
+	iret
+timer_vect_ ENDP
+
+; INT 28h idle wrapper - calls idle_tick_, chains to old handler
+	PUBLIC	idle_vect_
+idle_vect_ PROC NEAR
+	cmp	byte ptr cs:_bg_active, 0
+	jne	idle_chain
+	mov	byte ptr cs:_bg_active, 1
+	BACKGROUND	idle_tick_
+	mov	byte ptr cs:_bg_active, 0
+idle_chain:
+	jmp	dword ptr cs:[_old_idle_off]
+idle_vect_ ENDP
+
+; INT 24h while the cache file is open - fail the call instead of
+; asking, the program in the foreground knows nothing about the file
+	PUBLIC	crit_fail_vect_
+crit_fail_vect_ PROC NEAR
+	mov	al, 3
+	iret
+crit_fail_vect_ ENDP
+
+; INT 23h at the same time - a Ctrl-C mustn't end that program either
+	PUBLIC	break_ignore_vect_
+break_ignore_vect_ PROC NEAR
+	iret
+break_ignore_vect_ ENDP
+
 _TEXT	ends
 
 	end
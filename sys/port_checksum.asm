@@ -0,0 +1,53 @@
+	PUBLIC	_port_checksum
+
+;-----------------------------------------------------------------------------
+; uint16_t port_checksum(const void far *buf, uint16_t len, uint16_t seed)
+; FujiBus checksum of a buffer: add each byte and fold the carry back in
+;
+; Parameters: buf (far pointer), len (word), seed (checksum so far)
+; Returns: Checksum in AX, 0-255
+;
+; Register usage:
+;   AL = current byte
+;   DL = running checksum
+;   CX = remaining bytes
+;   SI = source buffer pointer (auto-incremented)
+;
+; Stack layout:
+;   [bp+10] = seed parameter
+;   [bp+8]  = len parameter
+;   [bp+6]  = buf segment
+;   [bp+4]  = buf offset
+;   [bp+2]  = return address
+;   [bp+0]  = saved BP
+;-----------------------------------------------------------------------------
+_port_checksum	PROC	NEAR
+	push	bp
+	mov	bp, sp
+	push	cx
+	push	dx
+	push	si
+	push	ds
+
+	mov	dl, [bp+10]		; DL = seed
+	mov	cx, [bp+8]		; CX = length
+	lds	si, [bp+4]		; DS:SI = buffer
+	jcxz	cksum_done
+
+cksum_loop:
+	lodsb
+	add	dl, al
+	adc	dl, 0			; End-around carry
+	loop	cksum_loop
+
+cksum_done:
+	mov	al, dl
+	xor	ah, ah
+
+	pop	ds
+	pop	si
+	pop	dx
+	pop	cx
+	pop	bp
+	ret
+_port_checksum	ENDP
@@ -5,9 +5,15 @@
 ; On entry: SI = end tick count, ES = BIOS_DATA_SEG
 ; On exit: AL = character received, or jumps to timeout_label if timeout
 ; Destroys: AH, DX
+;
+; When port_rx_isr is active the character comes from the receive ring
+; and interrupts stay enabled, otherwise the UART is polled directly.
 ;-----------------------------------------------------------------------------
 SLIPD_WAIT_CHAR MACRO timeout_label
-	LOCAL wait_loop, skip_timeout, got_char
+	LOCAL wait_loop, skip_timeout, got_char, ring_wait, ring_char, have_char
+
+	cmp	byte ptr cs:_port_rx_irq, 0
+	jne	ring_wait
 
 	mov	dx, SLIPD_LOCAL_UART_BASE
 	add	dx, UART_LSR_OFF
@@ -36,6 +42,31 @@ got_char:
 	mov	dx, SLIPD_LOCAL_UART_BASE
 	add	dx, UART_RBR_OFF
 	in	al, dx
+	jmp	have_char
+
+ring_wait:
+	sti
+	mov	al, cs:_port_rx_tail
+	cmp	al, cs:_port_rx_head
+	jne	ring_char
+
+	mov	ax, es:[BIOS_TICK_OFFSET]
+	cmp	ax, si
+	jb	ring_wait
+
+	; Timeout occurred
+	jmp	timeout_label
+
+ring_char:
+	push	bx
+	mov	bl, al
+	xor	bh, bh
+	mov	al, byte ptr cs:_port_rx_ring[bx]
+	inc	bl
+	mov	cs:_port_rx_tail, bl
+	pop	bx
+
+have_char:
 ENDM
 
 ;-----------------------------------------------------------------------------
@@ -47,11 +78,14 @@ ENDM
 ; Operation: Same as port_getbuf_slip but splits output:
 ; - First hdr_len bytes go to hdr_buf (near pointer, DS segment)
 ; - Remaining bytes go to data_buf (far pointer, specified segment)
+; - The FujiBus checksum of every decoded byte is left in _port_rx_sum,
+;   so the caller doesn't have to go over the packet again
 ;
 ; Parameters:
 ;   hdr_buf (near pointer), hdr_len (word),
 ;   data_buf (far pointer - segment:offset), data_len (word),
-;   timeout (word in ms)
+;   timeout (word in timer ticks, PORT_RX_CONTINUE to carry on with a
+;     frame instead of waiting for the start of the next one)
 ; Returns: Total number of decoded bytes (header + data)
 ;
 ; Register usage:
@@ -66,7 +100,7 @@ ENDM
 ;   ES = BIOS_DATA_SEG (0x40) for tick counter
 ;
 ; Stack layout:
-;   [bp+14] = timeout parameter (converted to ticks in place)
+;   [bp+14] = timeout parameter
 ;   [bp+12] = data_len parameter
 ;   [bp+10] = data_buf offset
 ;   [bp+8]  = data_buf segment
@@ -82,6 +116,7 @@ ENDM
 ;   [bp-12] = saved ES
 ;   [bp-14] = saved DS (original)
 ;   [bp-16] = _port_uart_base (copy)
+;   [bp-18] = running checksum
 ;-----------------------------------------------------------------------------
 
 SLIPD_PARAM_HDR_BUF	EQU	[bp+4]
@@ -91,6 +126,8 @@ SLIPD_PARAM_DATA_SEG	EQU	[bp+10]
 SLIPD_PARAM_DATA_LEN	EQU	[bp+12]
 SLIPD_PARAM_TIMEOUT	EQU	[bp+14]
 SLIPD_LOCAL_UART_BASE	EQU	[bp-16]
+SLIPD_LOCAL_SUM		EQU	byte ptr [bp-18]
+PORT_RX_CONTINUE	EQU	8000h
 
 _port_getbuf_slip_dual PROC NEAR
 	push	bp			; [bp+0]
@@ -111,28 +148,38 @@ _port_getbuf_slip_dual PROC NEAR
 	mov	ax, _port_uart_base
 	push	ax			; [bp-16]
 
+	xor	ax, ax
+	push	ax			; [bp-18] Checksum starts at zero
+
+	; BX = bytes written accumulator
+	xor	bx, bx
+
 	; Check for zero total length
 	mov	ax, SLIPD_PARAM_HDR_LEN
 	add	ax, SLIPD_PARAM_DATA_LEN
 	test	ax, ax
 	jz	slipd_done		; Zero total length
 
-	; Convert timeout from ms to ticks and store in place
-	mov	ax, SLIPD_PARAM_TIMEOUT
-	xor	dx, dx
-	push	cx
-	mov	cx, 55
-	div	cx			; AX = timeout in ticks
-	pop	cx
-	mov	SLIPD_PARAM_TIMEOUT, ax	; Overwrite parameter with ticks
-
-	; BX = bytes written accumulator
-	xor	bx, bx
-
 	; Set ES to BIOS data segment
 	mov	ax, BIOS_DATA_SEG
 	mov	es, ax
 
+	; Carry on with a frame an earlier call stopped part way through,
+	; adding to the checksum it left behind
+	test	word ptr SLIPD_PARAM_TIMEOUT, PORT_RX_CONTINUE
+	jz	slipd_sync
+	and	word ptr SLIPD_PARAM_TIMEOUT, NOT PORT_RX_CONTINUE
+	mov	al, _port_rx_sum
+	mov	SLIPD_LOCAL_SUM, al
+	test	cx, cx
+	jnz	slipd_read_next		; Header buffer first
+	mov	cx, SLIPD_PARAM_DATA_LEN
+	mov	word ptr SLIPD_PARAM_DATA_LEN, 0
+	mov	di, SLIPD_PARAM_DATA_OFF
+	mov	dx, SLIPD_PARAM_DATA_SEG
+	mov	ds, dx
+	jmp	slipd_read_next
+
 	; Phase 1: Sync to frame - discard until SLIP_END
 slipd_sync:
 	mov	si, es:[BIOS_TICK_OFFSET]
@@ -160,6 +207,8 @@ slipd_decode_loop:
 slipd_store_byte:
 	; Write byte to current buffer (DS:[DI])
 	mov	ds:[di], al
+	add	SLIPD_LOCAL_SUM, al	; Checksum with end-around carry
+	adc	SLIPD_LOCAL_SUM, 0
 	inc	di
 	inc	bx			; Count byte written
 	dec	cx
@@ -206,11 +255,13 @@ slipd_check_esc_esc:
 
 slipd_done:
 	sti
-	mov	ax, bx			; AX = total bytes written
-
+	pop	ax			; [bp-18] AL = checksum
 	pop	dx			; [bp-16] Discard _port_uart_base copy
 
 	pop	ds			; [bp-14]
+	mov	_port_rx_sum, al
+	mov	ax, bx			; AX = total bytes written
+
 	pop	es			; [bp-12]
 	pop	si			; [bp-10]
 	pop	di			; [bp-8]
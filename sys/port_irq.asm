@@ -0,0 +1,96 @@
+	PUBLIC	_port_rx_irq
+	PUBLIC	_port_irq
+	PUBLIC	_port_rx_head
+	PUBLIC	_port_rx_tail
+	PUBLIC	_port_rx_overruns
+	PUBLIC	_port_rx_ring
+	PUBLIC	_port_rx_old_off
+	PUBLIC	_port_rx_old_seg
+	PUBLIC	port_rx_isr_
+
+	; Interrupt Identification Register bits
+IIR_NO_INT	EQU	01h		; No interrupt pending on this UART
+
+	; 8259 PIC ports
+PIC1_CMD	EQU	20h
+PIC2_CMD	EQU	0A0h
+PIC_EOI		EQU	20h
+
+;-----------------------------------------------------------------------------
+; Receive ring buffer shared between port_rx_isr and SLIPD_WAIT_CHAR
+;
+; The ring is exactly 256 bytes so head and tail can be byte registers
+; that wrap on their own. The ISR only ever writes head, the receive
+; routines only ever write tail, so no locking is needed. Everything
+; is addressed through CS because both sides run with DS pointing
+; somewhere else.
+;-----------------------------------------------------------------------------
+_port_rx_irq	db	0		; Non-zero when ISR receive is active
+_port_irq	db	0		; Hardware IRQ line, for EOI
+_port_rx_head	db	0		; Next slot the ISR will fill
+_port_rx_tail	db	0		; Next slot the reader will take
+_port_rx_overruns dw	0		; Bytes dropped because ring was full
+_port_rx_old_off dw	0		; Previous handler for shared IRQs
+_port_rx_old_seg dw	0
+_port_rx_ring	db	256 dup(0)
+
+;-----------------------------------------------------------------------------
+; UART receive interrupt handler
+; Drains the receive FIFO into the ring buffer and acknowledges the PIC.
+; If the UART has nothing pending the interrupt belongs to another
+; device sharing the line, so chain to the previous handler.
+;-----------------------------------------------------------------------------
+port_rx_isr_	PROC	NEAR
+	push	ax
+	push	bx
+	push	dx
+
+	mov	dx, cs:_port_uart_base
+	add	dx, UART_IIR_OFF
+	in	al, dx
+	test	al, IIR_NO_INT
+	jnz	rx_isr_chain
+
+	add	dx, UART_LSR_OFF - UART_IIR_OFF
+	xor	bh, bh
+
+rx_isr_drain:
+	in	al, dx
+	test	al, LSR_DR
+	jz	rx_isr_eoi
+
+	sub	dx, UART_LSR_OFF - UART_RBR_OFF
+	in	al, dx
+	add	dx, UART_LSR_OFF - UART_RBR_OFF
+
+	mov	bl, cs:_port_rx_head
+	mov	byte ptr cs:_port_rx_ring[bx], al
+	inc	bl
+	cmp	bl, cs:_port_rx_tail
+	je	rx_isr_overrun		; Full - drop byte, keep draining
+	mov	cs:_port_rx_head, bl
+	jmp	rx_isr_drain
+
+rx_isr_overrun:
+	inc	word ptr cs:_port_rx_overruns
+	jmp	rx_isr_drain
+
+rx_isr_eoi:
+	mov	al, PIC_EOI
+	cmp	byte ptr cs:_port_irq, 8
+	jb	rx_isr_master
+	out	PIC2_CMD, al
+rx_isr_master:
+	out	PIC1_CMD, al
+
+	pop	dx
+	pop	bx
+	pop	ax
+	iret
+
+rx_isr_chain:
+	pop	dx
+	pop	bx
+	pop	ax
+	jmp	dword ptr cs:[_port_rx_old_off]
+port_rx_isr_	ENDP
@@ -32,6 +32,9 @@ ENDM
 ;   - 0xDB -> sends 0xDB 0xDD
 ;   - Other -> sends as-is
 ;
+; When _port_tx_fifo is set the 16550A transmit FIFO is filled in
+; bursts instead of waiting for THRE before every byte.
+;
 ; Parameters: buf (far pointer), len (word)
 ; Returns: Number of encoded bytes transmitted (including frame markers)
 ;
@@ -41,6 +44,8 @@ ENDM
 ;   CX = remaining bytes to encode (counts down to 0)
 ;   DX = UART port addresses
 ;   SI = source buffer pointer (auto-incremented)
+;   DI = scan pointer (FIFO path only)
+;   ES = source buffer segment, for scasb (FIFO path only)
 ;   BP = stack frame pointer
 ;
 ; Stack layout:
@@ -54,12 +59,22 @@ ENDM
 ;   [bp-6]  = saved DX
 ;   [bp-8]  = saved SI
 ;   [bp-10] = saved DS
+;   [bp-12] = saved DI
+;   [bp-14] = _port_uart_base (copy)
+;   [bp-16] = saved ES                  (FIFO path only)
+;   [bp-18] = free transmit FIFO slots  (FIFO path only)
+;   [bp-20] = offset of next SLIP_END   (FIFO path only)
+;   [bp-22] = offset of next SLIP_ESC   (FIFO path only)
 ;-----------------------------------------------------------------------------
 
 SLIP_PUT_PARAM_BUF_OFF	EQU	[bp+4]
 SLIP_PUT_PARAM_BUF_SEG	EQU	[bp+6]
 SLIP_PUT_PARAM_LEN	EQU	[bp+8]
-SLIP_PUT_LOCAL_UART_BASE EQU	[bp-12]
+SLIP_PUT_LOCAL_UART_BASE EQU	[bp-14]
+SLIP_PUT_FREE		EQU	[bp-18]
+SLIP_PUT_NEXT_END	EQU	[bp-20]
+SLIP_PUT_NEXT_ESC	EQU	[bp-22]
+TX_FIFO_DEPTH		EQU	16
 
 _port_putbuf_slip PROC NEAR
 	push	bp			; [bp+0]
@@ -69,13 +84,21 @@ _port_putbuf_slip PROC NEAR
 	push	dx			; [bp-6]
 	push	si			; [bp-8]
 	push	ds			; [bp-10]
+	push	di			; [bp-12]
 
 	; Save _port_uart_base on stack before switching DS
 	mov	ax, _port_uart_base
-	push	ax				; [bp-12]
+	push	ax				; [bp-14]
+	mov	dl, _port_tx_fifo		; Read before DS changes
 
+	; Normalize the buffer pointer so offsets of the end of the
+	; buffer, which the FIFO path compares, can't wrap
 	mov	si, SLIP_PUT_PARAM_BUF_OFF	; Get buffer offset
-	mov	ax, SLIP_PUT_PARAM_BUF_SEG	; Get buffer segment
+	mov	ax, si
+	mov	cl, 4
+	shr	ax, cl
+	add	ax, SLIP_PUT_PARAM_BUF_SEG	; Get buffer segment
+	and	si, 0Fh
 	mov	ds, ax				; Switch DS to buffer segment
 	mov	cx, SLIP_PUT_PARAM_LEN		; CX = length to encode
 
@@ -85,6 +108,9 @@ _port_putbuf_slip PROC NEAR
 	test	cx, cx
 	jz	slip_put_end		; Nothing to send
 
+	test	dl, dl
+	jnz	slip_fifo_start
+
 slip_put_loop:
 	lodsb				; Load byte from [DS:SI], increment SI
 
@@ -103,7 +129,8 @@ slip_put_send:
 slip_put_end:
 	mov	ax, bx			; Return encoded byte count
 
-	pop	dx			; [bp-12] Discard _port_uart_base copy
+	pop	dx			; [bp-14] Discard _port_uart_base copy
+	pop	di			; [bp-12]
 	pop	ds			; [bp-10]
 	pop	si			; [bp-8]
 	pop	dx			; [bp-6]
@@ -128,4 +155,134 @@ slip_put_encode_esc:
 	mov	al, SLIP_ESC_ESC
 	jmp	slip_put_send
 
+	; Same encoding, sent through the transmit FIFO. THRE means the
+	; whole FIFO is empty, so after seeing it the next TX_FIFO_DEPTH
+	; bytes go out without looking at the LSR. Runs with no SLIP_END or
+	; SLIP_ESC in them are found with scasb and written with a string
+	; instruction on a 186, or a tight loop on an 8088.
+slip_fifo_start:
+	push	es			; [bp-16]
+	xor	ax, ax
+	push	ax			; [bp-18] Free FIFO slots
+	push	ax			; [bp-20] Offset of next SLIP_END
+	push	ax			; [bp-22] Offset of next SLIP_ESC
+	push	ds
+	pop	es			; ES:DI scans the source buffer
+
+	mov	al, SLIP_END
+	call	slip_scan
+	mov	SLIP_PUT_NEXT_END, di
+	mov	al, SLIP_ESC
+	call	slip_scan
+	mov	SLIP_PUT_NEXT_ESC, di
+
+slip_fifo_loop:
+	jcxz	slip_fifo_done
+
+	; AX = bytes before the next one that needs escaping
+	mov	ax, SLIP_PUT_NEXT_END
+	cmp	ax, SLIP_PUT_NEXT_ESC
+	jb	slip_fifo_nearest
+	mov	ax, SLIP_PUT_NEXT_ESC
+slip_fifo_nearest:
+	sub	ax, si
+	jz	slip_fifo_special
+
+	cmp	word ptr SLIP_PUT_FREE, 0
+	jne	slip_fifo_room
+	call	slip_fifo_wait
+slip_fifo_room:
+	mov	di, SLIP_PUT_FREE
+	cmp	ax, di
+	jbe	slip_fifo_run
+	mov	ax, di			; Only as much as the FIFO takes
+slip_fifo_run:
+	sub	SLIP_PUT_FREE, ax
+	sub	cx, ax
+	add	bx, ax
+
+	mov	dx, SLIP_PUT_LOCAL_UART_BASE
+	add	dx, UART_THR_OFF
+	push	cx
+	mov	cx, ax
+IFDEF CPU186
+	rep	outsb
+ELSE
+slip_fifo_copy:
+	lodsb
+	out	dx, al
+	loop	slip_fifo_copy
+ENDIF
+	pop	cx
+	jmp	slip_fifo_loop
+
+slip_fifo_special:
+	lodsb
+	dec	cx
+	mov	ah, SLIP_ESC_END
+	cmp	al, SLIP_END
+	je	slip_fifo_escape
+	mov	ah, SLIP_ESC_ESC
+slip_fifo_escape:
+	mov	al, SLIP_ESC
+	call	slip_fifo_put
+	mov	al, ah
+	call	slip_fifo_put
+	add	bx, 2
+
+	; Look for the next one of the kind just sent
+	cmp	ah, SLIP_ESC_END
+	mov	al, SLIP_END
+	je	slip_fifo_next_end
+	mov	al, SLIP_ESC
+	call	slip_scan
+	mov	SLIP_PUT_NEXT_ESC, di
+	jmp	slip_fifo_loop
+slip_fifo_next_end:
+	call	slip_scan
+	mov	SLIP_PUT_NEXT_END, di
+	jmp	slip_fifo_loop
+
+slip_fifo_done:
+	add	sp, 6			; [bp-22] to [bp-18]
+	pop	es			; [bp-16]
+	jmp	slip_put_end
+
+	; DI = offset of the next AL in the CX bytes at SI, or SI + CX
+slip_scan:
+	mov	di, si
+	jcxz	slip_scan_done
+	push	cx
+	repne	scasb
+	pop	cx
+	jne	slip_scan_done
+	dec	di			; Back onto the match
+slip_scan_done:
+	ret
+
+	; Send AL through the FIFO, waiting for THRE when it is full
+slip_fifo_put:
+	cmp	word ptr SLIP_PUT_FREE, 0
+	jne	slip_fifo_put_room
+	call	slip_fifo_wait
+slip_fifo_put_room:
+	dec	word ptr SLIP_PUT_FREE
+	mov	dx, SLIP_PUT_LOCAL_UART_BASE
+	add	dx, UART_THR_OFF
+	out	dx, al
+	ret
+
+	; Wait until the FIFO is empty, preserves AX
+slip_fifo_wait:
+	push	ax
+	mov	dx, SLIP_PUT_LOCAL_UART_BASE
+	add	dx, UART_LSR_OFF
+slip_fifo_wait_loop:
+	in	al, dx
+	test	al, LSR_THRE
+	jz	slip_fifo_wait_loop
+	pop	ax
+	mov	word ptr SLIP_PUT_FREE, TX_FIFO_DEPTH
+	ret
+
 _port_putbuf_slip ENDP
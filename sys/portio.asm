@@ -16,11 +16,15 @@
 	;.8086
 
 	PUBLIC	_port_uart_base
+	PUBLIC	_port_rx_sum
+	PUBLIC	_port_tx_fifo
 
 	.data
 
 ; Global variable to store UART base address
 _port_uart_base	DW	3F8h		; Default to COM1
+_port_rx_sum	DB	0		; Checksum of the last packet received
+_port_tx_fifo	DB	0		; Non-zero to send in 16 byte FIFO bursts
 
 	.code
 
@@ -76,8 +80,10 @@ qemu_debug_char PROC	NEAR
 qemu_debug_char ENDP
 
 	include port_init.asm
+	include port_irq.asm
 	include port_getbuf_slip_dual.asm
 	include port_putc.asm
 	include port_putbuf_slip.asm
+	include port_checksum.asm
 
 	END
@@ -13,7 +13,29 @@
 #define COM4_UART         0x2e8
 #define COM4_INTERRUPT    11
 
+/* Hardware IRQ lines matching the interrupts above */
+#define COM1_IRQ          4
+#define COM2_IRQ          3
+#define COM3_IRQ          4
+#define COM4_IRQ          3
+
+#define PORT_IRQ_VECTOR(irq) ((irq) < 8 ? (irq) + 0x08 : (irq) - 8 + 0x70)
+
 extern uint16_t port_uart_base;
+extern uint8_t port_rx_sum;
+extern uint8_t port_tx_fifo;
+
+/* Interrupt driven receive, see port_irq.asm. The ring holds one byte
+ * less than its size. */
+#define PORT_RX_RING      256
+extern uint8_t port_rx_irq;
+extern uint8_t port_irq;
+extern volatile uint8_t port_rx_head;
+extern volatile uint8_t port_rx_tail;
+extern volatile uint16_t port_rx_overruns;
+extern uint16_t port_rx_old_off;
+extern uint16_t port_rx_old_seg;
+extern void port_rx_isr(void);
 
 extern void cdecl port_init(uint16_t base, uint16_t divisor);
 extern uint16_t cdecl port_getbuf_slip_dual(void *hdr_buf, uint16_t hdr_len,
@@ -21,5 +43,10 @@ extern uint16_t cdecl port_getbuf_slip_dual(void *hdr_buf, uint16_t hdr_len,
                                             uint16_t timeout);
 extern int cdecl port_putc(uint8_t c);
 extern uint16_t cdecl port_putbuf_slip(const void far *buf, uint16_t len);
+extern uint16_t cdecl port_checksum(const void far *buf, uint16_t len, uint16_t seed);
+
+#define PORT_TICKS_PER_SECOND 18
 
-#define PORT_TICKS_PER_SECOND 1000
+/* OR into the port_getbuf_slip_dual timeout to keep decoding the frame
+ * the last call stopped in, the checksum carries on from port_rx_sum */
+#define PORT_RX_CONTINUE      0x8000
@@ -0,0 +1,134 @@
+/**
+ * Sequential read-ahead
+ *
+ * When a unit's reads keep starting where the previous one ended, a
+ * short read is stretched into a full window and the extra sectors
+ * are parked in a staging buffer for the requests that follow. With
+ * multi-sector transfers that turns a string of round trips into one.
+ */
+
+#include "readahead.h"
+#include "diskio.h"
+#include "commands.h"
+#include "fujinet.h"
+#include <string.h>
+#include <dos.h>
+
+#define STAGE_NONE      0xFF
+
+uint16_t readahead_window;
+uint32_t readahead_hits, readahead_wasted, readahead_fetched;
+
+static uint8_t far *stage_buf;
+static uint8_t stage_unit = STAGE_NONE;
+static uint32_t stage_sector;
+static uint16_t stage_count;
+static uint8_t stage_used[DISKIO_MULTI_MAX / 8];
+
+static uint32_t next_sector[FN_MAX_DEV];
+static uint8_t streak[FN_MAX_DEV];
+
+void readahead_setup(uint16_t segment, uint16_t window)
+{
+  stage_buf = MK_FP(segment, 0);
+  readahead_window = window;
+  return;
+}
+
+/* Anything staged that nobody asked for was a wasted transfer */
+static void stage_discard(void)
+{
+  uint16_t idx;
+
+
+  if (stage_unit == STAGE_NONE)
+    return;
+
+  for (idx = 0; idx < stage_count; idx++)
+    if (!(stage_used[idx >> 3] & (1 << (idx & 7))))
+      readahead_wasted++;
+  stage_unit = STAGE_NONE;
+  return;
+}
+
+static void stage_copy(uint16_t offset, uint16_t count, uint8_t far *buf)
+{
+  uint16_t idx;
+
+
+  _fmemcpy(buf, &stage_buf[offset * SECTOR_SIZE], count * SECTOR_SIZE);
+  for (idx = offset; idx < offset + count; idx++)
+    stage_used[idx >> 3] |= 1 << (idx & 7);
+  return;
+}
+
+uint16_t readahead_read(uint8_t unit, uint32_t sector, uint16_t count, uint8_t far *buf)
+{
+  uint16_t idx = 0, avail, remain, got, fetch;
+  uint32_t sector_max;
+
+
+  if (!readahead_window)
+    return disk_read(unit, sector, count, buf);
+
+  if (stage_unit == unit && sector >= stage_sector
+      && sector < stage_sector + stage_count) {
+    avail = stage_sector + stage_count - sector;
+    idx = count < avail ? count : avail;
+    stage_copy(sector - stage_sector, idx, buf);
+    readahead_hits += idx;
+  }
+
+  if (idx < count) {
+    remain = count - idx;
+    sector_max = unit_sectors(unit);
+    fetch = readahead_window;
+    if (sector + idx + fetch > sector_max)
+      fetch = sector_max - sector - idx;
+
+    if (streak[unit] >= READAHEAD_TRIGGER && remain < fetch) {
+      stage_discard();
+      got = disk_read(unit, sector + idx, fetch, stage_buf);
+      if (got) {
+        stage_unit = unit;
+        stage_sector = sector + idx;
+        stage_count = got;
+        memset(stage_used, 0, sizeof(stage_used));
+        if (got > remain)
+          readahead_fetched += got - remain;
+        else
+          remain = got;
+        stage_copy(0, remain, &buf[idx * SECTOR_SIZE]);
+        idx += remain;
+      }
+    }
+    else
+      idx += disk_read(unit, sector + idx, remain, &buf[idx * SECTOR_SIZE]);
+  }
+
+  if (sector == next_sector[unit]) {
+    if (streak[unit] < READAHEAD_TRIGGER)
+      streak[unit]++;
+  }
+  else
+    streak[unit] = 0;
+  next_sector[unit] = sector + idx;
+
+  return idx;
+}
+
+void readahead_written(uint8_t unit, uint32_t sector, uint16_t count)
+{
+  if (stage_unit == unit && sector < stage_sector + stage_count
+      && sector + count > stage_sector)
+    stage_discard();
+  return;
+}
+
+void readahead_invalidate(uint8_t unit)
+{
+  if (stage_unit == unit)
+    stage_discard();
+  streak[unit] = 0;
+  return;
+}
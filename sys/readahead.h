@@ -0,0 +1,31 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#include <stdint.h>
+
+// Requests in a row that must follow on from each other before we prefetch
+#define READAHEAD_TRIGGER       2
+
+extern uint16_t readahead_window;
+extern uint32_t readahead_hits, readahead_wasted, readahead_fetched;
+
+/**
+ * @brief enable read-ahead with a staging buffer of window sectors
+ */
+extern void readahead_setup(uint16_t segment, uint16_t window);
+
+/* Same contract as disk_read */
+extern uint16_t readahead_read(uint8_t unit, uint32_t sector, uint16_t count,
+                               uint8_t far *buf);
+
+/**
+ * @brief drop staged sectors that overlap a write
+ */
+extern void readahead_written(uint8_t unit, uint32_t sector, uint16_t count);
+
+/**
+ * @brief drop everything staged for a unit, its image has changed
+ */
+extern void readahead_invalidate(uint8_t unit);
+
+#endif /* _READAHEAD_H */
@@ -0,0 +1,104 @@
+/**
+ * Background work from the timer tick and DOS idle
+ *
+ * The wrappers in iwrap.asm let the BIOS handle the tick first, guard
+ * against re-entry and switch to bg_stack before calling in here, so
+ * these run with interrupts on and can take as long as a bus call
+ * needs. Nothing here may run while the driver is in the middle of a
+ * request since that would trample the cache and the bus buffers.
+ */
+
+#include "timer.h"
+#include "dispatch.h"
+#include "cache.h"
+#include "hydrate.h"
+#include "cachefile.h"
+#include "commands.h"
+#include "fujicom.h"
+
+#define BG_STACK_SIZE   512
+
+uint8_t bg_stack[BG_STACK_SIZE];
+uint16_t bg_stack_top;
+
+static uint8_t far *crit_err_flag;
+
+// Defined in iwrap.asm
+extern uint16_t old_timer_off;
+extern uint16_t old_timer_seg;
+extern void timer_vect(void);
+extern uint16_t old_idle_off;
+extern uint16_t old_idle_seg;
+extern void idle_vect(void);
+
+// Defined in intf5.c
+extern void intf5_async_tick(void);
+
+// Called from INT 08h wrapper in iwrap.asm - DS=CS on entry
+void timer_tick(void)
+{
+  if (driver_busy || fuji_bus_busy)
+    return;
+
+  // Other TSRs that found the bus busy, they don't need DOS
+  fuji_bus_run_deferred();
+  intf5_async_tick();
+
+  /* Write-back flushes wait for INT 28h or the next driver request,
+   * hydration and the cache file for INT 28h. XMS moves, long
+   * transfers and DOS file calls don't belong in IRQ0. */
+  return;
+}
+
+// Called from INT 28h wrapper, DOS is waiting for input so anything goes
+void idle_tick(void)
+{
+  if (driver_busy || fuji_bus_busy)
+    return;
+  fuji_bus_run_deferred();
+  intf5_async_tick();
+  cache_tick(true);
+  hydrate_tick();
+
+  // File calls are fine as long as DOS isn't handling a critical error
+  if (!*crit_err_flag)
+    cachefile_tick();
+  return;
+}
+
+void install_background(void)
+{
+  void far *old;
+  uint8_t far *indos_flag;
+  uint16_t indos_seg, indos_off;
+
+
+  if (old_timer_seg)
+    return;
+
+  bg_stack_top = (uint16_t) &bg_stack[BG_STACK_SIZE - 2];
+
+  // Get InDOS flag address via INT 21h AH=34h
+  _asm {
+    push es
+    mov ah, 34h
+    int 21h
+    mov indos_off, bx
+    mov indos_seg, es
+    pop es
+  }
+  indos_flag = (uint8_t far *) MK_FP(indos_seg, indos_off);
+  // DOS 3+ keeps the critical error flag just before InDOS
+  crit_err_flag = indos_flag - 1;
+
+  old = _dos_getvect(0x08);
+  old_timer_off = FP_OFF(old);
+  old_timer_seg = FP_SEG(old);
+  _dos_setvect(0x08, MK_FP(getCS(), (uint16_t) timer_vect));
+
+  old = _dos_getvect(0x28);
+  old_idle_off = FP_OFF(old);
+  old_idle_seg = FP_SEG(old);
+  _dos_setvect(0x28, MK_FP(getCS(), (uint16_t) idle_vect));
+  return;
+}
@@ -0,0 +1,16 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+#include <dos.h>
+
+#define BIOS_TICKS      (*(volatile uint16_t far *) MK_FP(0x40, 0x6C))
+#define TICKS_PER_SEC   18
+
+/**
+ * @brief hook INT 08h and INT 28h for work done outside of DOS
+ *        requests, always done once Init_cmd has found the FujiNet
+ */
+extern void install_background(void);
+
+#endif /* _TIMER_H */
@@ -0,0 +1,142 @@
+/**
+ * Latency of each FujiBus call, measured with PIT channel 0
+ *
+ * The BIOS tick is far too coarse to time a single sector, so the
+ * counter behind it is read as well. Channel 0 is switched from the
+ * square wave mode the BIOS uses to rate generator mode with the same
+ * divisor: the tick rate doesn't change, but the count goes down one
+ * clock at a time and can be read back as a fraction of a tick.
+ */
+
+#include "timing.h"
+#include "timer.h"
+#include <string.h>
+#include <conio.h>
+#include <dos.h>
+
+#define PIT_CH0         0x40
+#define PIT_CMD         0x43
+#define PIT_LATCH_CH0   0x00
+#define PIT_CH0_MODE2   0x34            // Channel 0, lo/hi byte, rate generator
+#define PIC1_CMD        0x20
+#define PIC_READ_IRR    0x0A
+#define IRQ0_BIT        0x01
+
+fuji_timing_stats *timing_stats;
+
+void timing_setup(fuji_timing_stats *stats)
+{
+  _disable();
+  outp(PIT_CMD, PIT_CH0_MODE2);
+  outp(PIT_CH0, 0);
+  outp(PIT_CH0, 0);
+  _enable();
+
+  timing_stats = stats;
+  timing_reset();
+  return;
+}
+
+void timing_reset(void)
+{
+  if (!timing_stats)
+    return;
+
+  memset(timing_stats, 0, sizeof(*timing_stats));
+  timing_stats->size = sizeof(*timing_stats);
+  timing_stats->entries = FUJI_TIMING_ENTRIES;
+  timing_stats->since = *(volatile uint32_t far *) MK_FP(0x40, 0x6C);
+  return;
+}
+
+uint32_t timing_now(void)
+{
+  uint16_t count, ticks;
+  uint8_t irr;
+
+
+  if (!timing_stats)
+    return 0;
+
+  _disable();
+  outp(PIT_CMD, PIT_LATCH_CH0);
+  count = inp(PIT_CH0);
+  count |= inp(PIT_CH0) << 8;
+  ticks = BIOS_TICKS;
+  outp(PIC1_CMD, PIC_READ_IRR);
+  irr = inp(PIC1_CMD);
+  _enable();
+
+  // The counter counts down, turn it into clocks since the last tick
+  count = 0 - count;
+
+  // Counter wrapped but the tick hasn't been counted yet
+  if ((irr & IRQ0_BIT) && count < 0x8000)
+    ticks++;
+
+  return (uint32_t) ticks << 16 | count;
+}
+
+static fuji_timing_entry *timing_entry(fuji_timing_entry *table, uint8_t key)
+{
+  uint8_t idx;
+
+
+  for (idx = 0; idx < FUJI_TIMING_ENTRIES; idx++) {
+    if (!table[idx].calls) {
+      table[idx].key = key;
+      return &table[idx];
+    }
+    if (table[idx].key == key)
+      return &table[idx];
+  }
+  return NULL;
+}
+
+static void timing_add(fuji_timing_entry *entry, uint32_t elapsed,
+                       uint16_t bytes_out, uint16_t bytes_in)
+{
+  uint8_t bucket;
+  uint32_t scaled;
+
+
+  for (bucket = 0, scaled = elapsed >> FUJI_TIMING_SHIFT;
+       scaled && bucket < FUJI_TIMING_BUCKETS - 1; bucket++)
+    scaled >>= 1;
+  if (entry->hist[bucket] != 0xFFFF)
+    entry->hist[bucket]++;
+
+  entry->calls++;
+  entry->total += elapsed;
+  if (elapsed > entry->max)
+    entry->max = elapsed;
+  entry->bytes_out += bytes_out;
+  entry->bytes_in += bytes_in;
+  return;
+}
+
+void timing_record(uint8_t device, uint8_t command, uint32_t start,
+                   uint16_t bytes_out, uint16_t bytes_in)
+{
+  fuji_timing_entry *entry;
+  uint32_t elapsed;
+
+
+  if (!timing_stats)
+    return;
+
+  elapsed = timing_now() - start;
+
+  entry = timing_entry(timing_stats->commands, command);
+  if (entry)
+    timing_add(entry, elapsed, bytes_out, bytes_in);
+  else
+    timing_stats->dropped++;
+
+  entry = timing_entry(timing_stats->devices, device);
+  if (entry)
+    timing_add(entry, elapsed, bytes_out, bytes_in);
+  else
+    timing_stats->dropped++;
+  return;
+}
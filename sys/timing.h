@@ -0,0 +1,28 @@
+#ifndef _TIMING_H
+#define _TIMING_H
+
+#include <fuji_f5.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+extern fuji_timing_stats *timing_stats;
+
+/**
+ * @brief put the PIT into mode 2 and start recording into stats
+ */
+extern void timing_setup(fuji_timing_stats *stats);
+
+/**
+ * @brief current time in PIT clocks, 0 if timing is off
+ */
+extern uint32_t timing_now(void);
+
+/**
+ * @brief record one finished fuji_bus_call
+ */
+extern void timing_record(uint8_t device, uint8_t command, uint32_t start,
+                          uint16_t bytes_out, uint16_t bytes_in);
+
+extern void timing_reset(void);
+
+#endif /* _TIMING_H */
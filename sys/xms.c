@@ -0,0 +1,140 @@
+/**
+ * Minimal XMS client: just enough to park data in extended memory
+ */
+
+#include "xms.h"
+
+#define XMS_MUX_INSTALLED       0x4300
+#define XMS_MUX_ENTRY           0x4310
+#define XMS_PRESENT             0x80
+
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t length;              // Must be even
+  uint16_t src_handle;          // 0 means src_offset is seg:off
+  uint32_t src_offset;
+  uint16_t dest_handle;         // 0 means dest_offset is seg:off
+  uint32_t dest_offset;
+} xms_move_t;
+#pragma pack(pop)
+
+static void (far *xms_entry)(void);
+
+// Must not be on the stack, XMS wants it at DS:SI and SS != DS
+static xms_move_t xms_move_req;
+
+bool xms_init(void)
+{
+  uint8_t present;
+
+
+  if (xms_entry)
+    return true;
+
+  _asm {
+    mov ax, XMS_MUX_INSTALLED
+    int 2fh
+    mov present, al
+  }
+  if (present != XMS_PRESENT)
+    return false;
+
+  _asm {
+    push es
+    mov ax, XMS_MUX_ENTRY
+    int 2fh
+    mov word ptr xms_entry, bx
+    mov word ptr xms_entry+2, es
+    pop es
+  }
+  return true;
+}
+
+uint16_t xms_alloc(uint16_t kbytes)
+{
+  uint16_t kb = kbytes, result, handle;
+
+
+  /* Locals used in _asm stay clear of the inline assembler's operator
+   * names, size/length/offset/seg/segment/type would be taken as those */
+  _asm {
+    push bx
+    mov ah, 09h
+    mov dx, kb
+    call dword ptr xms_entry
+    mov result, ax
+    mov handle, dx
+    pop bx
+  }
+  return result == 1 ? handle : 0;
+}
+
+void xms_free(uint16_t handle)
+{
+  uint16_t h = handle;
+
+
+  _asm {
+    push bx
+    mov ah, 0ah
+    mov dx, h
+    call dword ptr xms_entry
+    pop bx
+  }
+  return;
+}
+
+uint16_t xms_alloc_umb(uint16_t paragraphs)
+{
+  uint16_t paras = paragraphs, result, seg_out;
+
+
+  _asm {
+    push bx
+    mov ah, 10h
+    mov dx, paras
+    call dword ptr xms_entry
+    mov result, ax
+    mov seg_out, bx
+    pop bx
+  }
+  return result == 1 ? seg_out : 0;
+}
+
+static bool xms_move(void)
+{
+  uint16_t result;
+
+
+  _asm {
+    push bx
+    push si
+    lea si, xms_move_req
+    mov ah, 0bh
+    call dword ptr xms_entry
+    mov result, ax
+    pop si
+    pop bx
+  }
+  return result == 1;
+}
+
+bool xms_copy_to(uint16_t handle, uint32_t offset, const void far *src, uint16_t length)
+{
+  xms_move_req.length = length;
+  xms_move_req.src_handle = 0;
+  xms_move_req.src_offset = (uint32_t) src;
+  xms_move_req.dest_handle = handle;
+  xms_move_req.dest_offset = offset;
+  return xms_move();
+}
+
+bool xms_copy_from(uint16_t handle, uint32_t offset, void far *dest, uint16_t length)
+{
+  xms_move_req.length = length;
+  xms_move_req.src_handle = handle;
+  xms_move_req.src_offset = offset;
+  xms_move_req.dest_handle = 0;
+  xms_move_req.dest_offset = (uint32_t) dest;
+  return xms_move();
+}
@@ -0,0 +1,32 @@
+#ifndef _XMS_H
+#define _XMS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief find the XMS driver, true if one is loaded
+ */
+extern bool xms_init(void);
+
+/**
+ * @brief allocate an extended memory block, returns handle or 0
+ */
+extern uint16_t xms_alloc(uint16_t kbytes);
+
+/**
+ * @brief release an extended memory block
+ */
+extern void xms_free(uint16_t handle);
+
+/**
+ * @brief allocate an upper memory block, returns segment or 0
+ */
+extern uint16_t xms_alloc_umb(uint16_t paragraphs);
+
+extern bool xms_copy_to(uint16_t handle, uint32_t offset,
+                        const void far *src, uint16_t length);
+extern bool xms_copy_from(uint16_t handle, uint32_t offset,
+                          void far *dest, uint16_t length);
+
+#endif /* _XMS_H */
@@ -0,0 +1,121 @@
+/**
+ * Encoder and decoder microbenchmark
+ *
+ * Times compress_encode and compress_decode over the stand-in's disk,
+ * one sector kind at a time: directory-like text, runs, data that
+ * doesn't compress and empty sectors. Replies are made by the
+ * reference encoder, with and without LZ matches, and decoded in place
+ * the way fuji_bus_call does. The times are host CPU time, for
+ * comparing one version of the codec with another, not what an 8088
+ * takes. Run with "make bench".
+ */
+
+#include "harness.h"
+#include "compress.h"
+#include <string.h>
+#include <time.h>
+
+#define SECTOR          512
+#define KINDS           4       // fujinet_reset fills the disk with sector % KINDS
+#define ROUNDS          200
+
+static const char *kinds[KINDS] = {"text", "runs", "random", "empty"};
+
+static uint8_t space[SECTOR * 2];
+static uint8_t buf[SECTOR];
+static uint8_t enc[FUJINET_SECTORS / KINDS][SECTOR * 2];
+static uint16_t enc_len[FUJINET_SECTORS / KINDS];
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const uint8_t *sector(uint16_t kind, uint16_t idx)
+{
+  return &fujinet.disk[(idx * KINDS + kind) * SECTOR];
+}
+
+/* Encode every sector of a kind ROUNDS times, returns ns per sector */
+static double encode(uint16_t kind, uint32_t *wire)
+{
+  uint16_t idx, len, round;
+  double start;
+
+
+  start = now_ns();
+  for (round = 0; round < ROUNDS; round++)
+    for (idx = 0; idx < FUJINET_SECTORS / KINDS; idx++) {
+      len = compress_encode(sector(kind, idx), SECTOR);
+      if (!round)
+        *wire += len ? len : SECTOR;
+    }
+  return (now_ns() - start) / ROUNDS / (FUJINET_SECTORS / KINDS);
+}
+
+/* Decode the reference encoder's replies ROUNDS times, returns ns per
+ * sector that came compressed */
+static double decode(uint16_t kind, bool lz, uint32_t *wire, uint16_t *packed)
+{
+  uint16_t idx, round;
+  double start, elapsed = 0;
+
+
+  *packed = 0;
+  for (idx = 0; idx < FUJINET_SECTORS / KINDS; idx++) {
+    enc_len[idx] = fujinet_encode(sector(kind, idx), SECTOR, SECTOR, lz, enc[idx]);
+    *wire += enc_len[idx] ? enc_len[idx] : SECTOR;
+    if (enc_len[idx])
+      (*packed)++;
+  }
+  if (!*packed)
+    return 0;
+
+  for (round = 0; round < ROUNDS; round++)
+    for (idx = 0; idx < FUJINET_SECTORS / KINDS; idx++) {
+      if (!enc_len[idx])
+        continue;
+      memcpy(buf, enc[idx], enc_len[idx]);
+      start = now_ns();
+      if (compress_decode(buf, enc_len[idx], SECTOR) != SECTOR)
+        harness_failures++;
+      elapsed += now_ns() - start;
+    }
+  return elapsed / ROUNDS / *packed;
+}
+
+int main(void)
+{
+  uint16_t kind, packed, lz;
+  uint32_t wire;
+  double ns;
+  const uint32_t raw = FUJINET_SECTORS / KINDS * SECTOR;
+
+
+  fujinet_reset(0);
+  compress_setup(space, sizeof(space));
+
+  printf("%-7s %-11s %9s %8s\n", "", "", "ns/sector", "wire");
+  for (kind = 0; kind < KINDS; kind++) {
+    wire = 0;
+    ns = encode(kind, &wire);
+    printf("%-7s %-11s %9.0f %7.0f%%\n", kinds[kind], "encode", ns, wire * 100.0 / raw);
+    for (lz = 0; lz < 2; lz++) {
+      wire = 0;
+      ns = decode(kind, lz, &wire, &packed);
+      // Nothing of this kind that the FujiNet may send compressed
+      if (!packed)
+        printf("%-7s %-11s %9s %7.0f%%\n", kinds[kind], lz ? "decode lz" : "decode rle",
+               "-", wire * 100.0 / raw);
+      else
+        printf("%-7s %-11s %9.0f %7.0f%%\n", kinds[kind], lz ? "decode lz" : "decode rle",
+               ns, wire * 100.0 / raw);
+    }
+  }
+
+  return harness_done("bench_compress");
+}
@@ -0,0 +1,701 @@
+/**
+ * FujiNet stand-in for the host harness
+ *
+ * Answers the FujiBus commands the driver and its tools send, the
+ * extensions in FUJICOM-Protocol.md included: capabilities, media
+ * state, speed negotiation, multi sector transfers, read with status,
+ * tagged commands and compressed payloads both ways. Replies go out
+ * through line_to_pc once the command's last byte is in, after
+ * turnaround_ns. While the FujiNet and the PC are at different speeds,
+ * or faster than the cable carries, every byte either of them sends
+ * arrives as a zero.
+ */
+
+#include "fujinet.h"
+#include "line.h"
+#include <fuji_f5.h>
+#include <string.h>
+#include <stdio.h>
+
+#define HEADER_SIZE     6
+#define FRAME_MAX       (HEADER_SIZE + 4 + 2 * 64 * FUJINET_SECTOR)
+#define FIELD_COMPRESSED 0x80
+#define FIELD_TAG_MASK  0x78
+#define TOKEN_REPEAT    0x80
+#define TOKEN_MATCH     0xC0
+#define LITERAL_MAX     128
+#define RUN_MIN         3
+#define RUN_MAX         (0x40 + RUN_MIN - 1)
+#define MATCH_WINDOW    1024
+#define MEDIA_UNITS     8       // Disk devices the mount times and slots cover
+#define MEDIA_SLOT_SIZE 38      // Host slot, mode and file name
+#define BAUD_REVERT_NS  5000000000ULL
+
+enum {
+  SLIP_END     = 0xC0,
+  SLIP_ESCAPE  = 0xDB,
+  SLIP_ESC_END = 0xDC,
+  SLIP_ESC_ESC = 0xDD,
+};
+
+enum {
+  PACKET_ACK = 6,
+  PACKET_NAK = 21,
+};
+
+fujinet_state fujinet;
+
+static const uint8_t field_numbytes[] = {0, 1, 2, 3, 4, 2, 4, 4};
+static uint8_t frame[FRAME_MAX];
+static uint32_t frame_len;
+static bool frame_escape;
+static uint8_t payload[FRAME_MAX];
+static uint8_t reply[FRAME_MAX];
+static uint8_t wire[2 * FRAME_MAX + 2];
+static uint32_t revert_bps;
+static uint64_t revert_at;      // Go back to revert_bps then, unless a test arrives
+
+void fujinet_reset(uint16_t caps)
+{
+  uint32_t sector, idx;
+  uint8_t *ptr;
+
+
+  memset(&fujinet, 0, sizeof(fujinet));
+  fujinet.caps = caps;
+  fujinet.turnaround_ns = 2000000;
+  frame_len = 0;
+  frame_escape = false;
+  revert_at = 0;
+
+  for (sector = 0; sector < FUJINET_SECTORS; sector++) {
+    ptr = &fujinet.disk[sector * FUJINET_SECTOR];
+    switch (sector % 4) {
+    case 0:
+      // Directory-like text, plenty of matches
+      for (idx = 0; idx < FUJINET_SECTOR; idx++)
+        ptr[idx] = "FUJINET SYS 12345 COMMAND COM "[idx % 30] + (idx / 240);
+      break;
+    case 1:
+      // Runs
+      for (idx = 0; idx < FUJINET_SECTOR; idx++)
+        ptr[idx] = idx / 37 * 3 + sector;
+      break;
+    case 2:
+      // Nothing compresses
+      for (idx = 0; idx < FUJINET_SECTOR; idx++)
+        ptr[idx] = (idx * 131 + sector * 7) ^ (idx >> 3);
+      break;
+    default:
+      // Empty, only a marker at the start
+      ptr[0] = sector;
+      ptr[1] = sector >> 8;
+      break;
+    }
+  }
+  return;
+}
+
+uint16_t fujinet_decode(const uint8_t *src, uint16_t len, uint8_t *dst, uint16_t size)
+{
+  uint16_t in, out, decoded, count, distance;
+  uint8_t token;
+
+
+  if (len < 2)
+    return 0;
+  decoded = src[0] | src[1] << 8;
+  if (decoded > size)
+    return 0;
+
+  for (in = 2, out = 0; in < len; ) {
+    token = src[in++];
+    if (token < TOKEN_REPEAT) {
+      count = token + 1;
+      if (out + count > decoded || in + count > len)
+        return 0;
+      memcpy(&dst[out], &src[in], count);
+      in += count;
+      out += count;
+      continue;
+    }
+
+    count = (token & 0x3F) + RUN_MIN;
+    if (out + count > decoded)
+      return 0;
+    if (token < TOKEN_MATCH) {
+      if (in >= len)
+        return 0;
+      memset(&dst[out], src[in++], count);
+      out += count;
+      continue;
+    }
+
+    if (in + 2 > len)
+      return 0;
+    distance = src[in] | src[in + 1] << 8;
+    in += 2;
+    if (!distance || distance > out)
+      return 0;
+    for (; count; count--, out++)
+      dst[out] = dst[out - distance];
+  }
+
+  memset(&dst[out], 0, decoded - out);
+  return decoded;
+}
+
+/* The driver moves the compressed bytes to the end of its buffer and
+ * decodes towards the front, check that the output never catches up
+ * with the input still to be read */
+static bool decodes_in_place(const uint8_t *enc, uint16_t len, uint16_t size)
+{
+  uint32_t in = size - len + 2, out = 0;
+  const uint8_t *ptr = enc + 2, *end = enc + len;
+  uint8_t token;
+
+
+  while (ptr < end) {
+    token = *ptr++;
+    in++;
+    if (token < TOKEN_REPEAT) {
+      ptr += token + 1;
+      in += token + 1;
+      out += token + 1;
+      continue;
+    }
+    ptr += token < TOKEN_MATCH ? 1 : 2;
+    in += token < TOKEN_MATCH ? 1 : 2;
+    out += (token & 0x3F) + RUN_MIN;
+    if (out > in)
+      return false;
+  }
+  return true;
+}
+
+uint16_t fujinet_encode(const uint8_t *src, uint16_t len, uint16_t size, bool lz,
+                        uint8_t *dst)
+{
+  uint32_t idx, run, best, distance, match, dist, end, out, literal;
+
+
+  if (len < 2 || len > size)
+    return 0;
+
+  dst[0] = len & 0xFF;
+  dst[1] = len >> 8;
+  out = 2;
+
+  for (end = len; end && !src[end - 1]; end--)
+    ;
+
+  for (idx = 0, literal = 0; idx < end; ) {
+    for (run = 1; idx + run < end && run < RUN_MAX && src[idx + run] == src[idx]; run++)
+      ;
+
+    best = distance = 0;
+    for (dist = 1; lz && dist <= idx && dist <= MATCH_WINDOW; dist++) {
+      for (match = 0; idx + match < end && match < RUN_MAX
+             && src[idx + match] == src[idx + match - dist]; match++)
+        ;
+      if (match > best) {
+        best = match;
+        distance = dist;
+      }
+      if (best == RUN_MAX)
+        break;
+    }
+
+    if (out + 3 >= len)
+      return 0;
+
+    if (run >= RUN_MIN && run >= best) {
+      dst[out++] = TOKEN_REPEAT + run - RUN_MIN;
+      dst[out++] = src[idx];
+      idx += run;
+      literal = 0;
+    }
+    else if (best >= RUN_MIN) {
+      dst[out++] = TOKEN_MATCH + best - RUN_MIN;
+      dst[out++] = distance & 0xFF;
+      dst[out++] = distance >> 8;
+      idx += best;
+      literal = 0;
+    }
+    else {
+      if (!literal || dst[literal] == LITERAL_MAX - 1) {
+        literal = out++;
+        dst[literal] = 0;
+      }
+      else
+        dst[literal]++;
+      dst[out++] = src[idx++];
+    }
+  }
+
+  if (out >= len || !decodes_in_place(dst, out, size))
+    return 0;
+  return out;
+}
+
+static uint32_t speed(void)
+{
+  return fujinet.bps ? fujinet.bps : line.bps;
+}
+
+static bool garbled(void)
+{
+  return speed() != line.bps || (fujinet.cable_bps && speed() > fujinet.cable_bps);
+}
+
+static uint8_t checksum(const uint8_t *buf, uint32_t len, uint16_t sum)
+{
+  for (; len; len--, buf++) {
+    sum += *buf;
+    sum = (sum & 0xFF) + (sum >> 8);
+  }
+  return sum;
+}
+
+static bool compress_eligible(uint8_t device, uint8_t command)
+{
+  if (!(fujinet.agreed & FUJI_CAP_RLE))
+    return false;
+  if (device >= FUJI_DEVICEID_DISK && device <= FUJI_DEVICEID_DISK_LAST)
+    return command == FUJICMD_READ || command == FUJICMD_WRITE
+      || command == FUJICMD_READ_MULTI || command == FUJICMD_WRITE_MULTI;
+  if (device >= FUJI_DEVICEID_NETWORK && device <= FUJI_DEVICEID_NETWORK_LAST)
+    return command == FUJICMD_READ || command == FUJICMD_WRITE;
+  return false;
+}
+
+/* Frame a reply: header, status block, then data, compressed if the
+ * command allows it and it comes out smaller */
+static void send_reply(uint8_t device, uint8_t command, uint8_t code, uint8_t fields,
+                       const uint8_t *status, uint16_t status_length,
+                       const uint8_t *data, uint32_t data_length, uint32_t sectors)
+{
+  uint32_t length, idx, out;
+  uint16_t enc = 0;
+  uint64_t start;
+
+
+  fields &= FIELD_TAG_MASK;
+  memcpy(&reply[HEADER_SIZE], status, status_length);
+  if (code == PACKET_ACK && data_length && compress_eligible(device, command))
+    enc = fujinet_encode(data, data_length, data_length, fujinet.agreed & FUJI_CAP_LZ,
+                         &reply[HEADER_SIZE + status_length]);
+  if (enc) {
+    fields |= FIELD_COMPRESSED;
+    fujinet.compressed++;
+    if (fujinet.short_decode) {
+      idx = HEADER_SIZE + status_length;
+      length = (reply[idx] | reply[idx + 1] << 8) - 1;
+      reply[idx] = length;
+      reply[idx + 1] = length >> 8;
+    }
+    data_length = enc;
+  }
+  else if (data_length)
+    memcpy(&reply[HEADER_SIZE + status_length], data, data_length);
+
+  length = HEADER_SIZE + status_length + data_length;
+  reply[0] = device;
+  reply[1] = code;
+  reply[2] = length & 0xFF;
+  reply[3] = length >> 8;
+  reply[4] = 0;
+  reply[5] = fields;
+  reply[4] = checksum(reply, length, 0);
+
+  out = 0;
+  wire[out++] = SLIP_END;
+  for (idx = 0; idx < length; idx++) {
+    if (reply[idx] == SLIP_END) {
+      wire[out++] = SLIP_ESCAPE;
+      wire[out++] = SLIP_ESC_END;
+    }
+    else if (reply[idx] == SLIP_ESCAPE) {
+      wire[out++] = SLIP_ESCAPE;
+      wire[out++] = SLIP_ESC_ESC;
+    }
+    else
+      wire[out++] = reply[idx];
+  }
+  wire[out++] = SLIP_END;
+  if (garbled())
+    memset(wire, 0, out);
+
+  // The command is only in once its last byte has left the UART
+  start = line.tx_done > line.now ? line.tx_done : line.now;
+  line_to_pc(wire, out, start + fujinet.turnaround_ns + sectors * fujinet.sector_ns);
+  return;
+}
+
+static void nak(uint8_t device, uint8_t fields)
+{
+  send_reply(device, 0, PACKET_NAK, fields, NULL, 0, NULL, 0, 0);
+  return;
+}
+
+static uint16_t net_waiting(void)
+{
+  return fujinet.net_len - fujinet.net_pos;
+}
+
+static void net_status(uint8_t *status)
+{
+  uint16_t waiting = net_waiting();
+
+
+  status[0] = waiting & 0xFF;
+  status[1] = waiting >> 8;
+  status[2] = 1;
+  status[3] = waiting ? NETWORK_SUCCESS : NETWORK_ERROR_END_OF_FILE;
+  return;
+}
+
+static void disk_command(uint8_t device, uint8_t command, uint8_t fields,
+                         const uint8_t *aux, const uint8_t *data, uint32_t data_length)
+{
+  uint32_t sector = aux[0] | aux[1] << 8 | (uint32_t) aux[2] << 16;
+  uint32_t count = 1, idx;
+  uint8_t bitmap[8];
+
+
+  if (device != FUJI_DEVICEID_DISK) {
+    nak(device, fields);
+    return;
+  }
+
+  switch (command) {
+  case FUJICMD_READ:
+    sector |= (uint32_t) aux[3] << 24;
+    if (sector >= FUJINET_SECTORS) {
+      nak(device, fields);
+      return;
+    }
+    send_reply(device, command, PACKET_ACK, fields, NULL, 0,
+               &fujinet.disk[sector * FUJINET_SECTOR], FUJINET_SECTOR, 1);
+    return;
+
+  case FUJICMD_WRITE:
+    sector |= (uint32_t) aux[3] << 24;
+    if (sector >= FUJINET_SECTORS || data_length != FUJINET_SECTOR) {
+      nak(device, fields);
+      return;
+    }
+    memcpy(&fujinet.disk[sector * FUJINET_SECTOR], data, FUJINET_SECTOR);
+    send_reply(device, command, PACKET_ACK, fields, NULL, 0, NULL, 0, 1);
+    return;
+
+  case FUJICMD_READ_MULTI:
+  case FUJICMD_WRITE_MULTI:
+    count = aux[3];
+    if (!(fujinet.agreed & FUJI_CAP_MULTI_SECTOR) || !count || count > 64
+        || (command == FUJICMD_WRITE_MULTI && data_length != count * FUJINET_SECTOR)) {
+      nak(device, fields);
+      return;
+    }
+    memset(bitmap, 0, sizeof(bitmap));
+    for (idx = 0; idx < count && sector + idx < FUJINET_SECTORS; idx++)
+      bitmap[idx >> 3] |= 1 << (idx & 7);
+    if (command == FUJICMD_READ_MULTI) {
+      send_reply(device, command, PACKET_ACK, fields, bitmap, (count + 7) / 8,
+                 &fujinet.disk[sector * FUJINET_SECTOR], count * FUJINET_SECTOR, count);
+      return;
+    }
+    memcpy(&fujinet.disk[sector * FUJINET_SECTOR], data, idx * FUJINET_SECTOR);
+    send_reply(device, command, PACKET_ACK, fields, bitmap, (count + 7) / 8, NULL, 0, count);
+    return;
+  }
+
+  send_reply(device, command, PACKET_ACK, fields, NULL, 0, NULL, 0, 0);
+  return;
+}
+
+static void net_command(uint8_t device, uint8_t command, uint8_t fields, const uint8_t *aux)
+{
+  uint16_t length = aux[0] | aux[1] << 8;
+  uint8_t status[4];
+
+
+  switch (command) {
+  case FUJICMD_STATUS:
+    net_status(status);
+    send_reply(device, command, PACKET_ACK, fields, status, sizeof(status), NULL, 0, 0);
+    return;
+
+  case FUJICMD_READ:
+    // Asking for more than is waiting is an error on the FujiNet too
+    if (!length || length > net_waiting()) {
+      nak(device, fields);
+      return;
+    }
+    send_reply(device, command, PACKET_ACK, fields, NULL, 0,
+               &fujinet.net[fujinet.net_pos], length, 0);
+    fujinet.net_pos += length;
+    return;
+
+  case FUJICMD_READ_STATUS:
+    if (!(fujinet.agreed & FUJI_CAP_READ_STATUS)) {
+      nak(device, fields);
+      return;
+    }
+    net_status(status);
+    if (length > net_waiting())
+      length = net_waiting();
+    send_reply(device, command, PACKET_ACK, fields, status, sizeof(status),
+               &fujinet.net[fujinet.net_pos], length, 0);
+    fujinet.net_pos += length;
+    return;
+  }
+
+  send_reply(device, command, PACKET_ACK, fields, NULL, 0, NULL, 0, 0);
+  return;
+}
+
+/* Two 32 bit mount times for every unit, then every unit's slot, the
+ * way FUJICMD_GET_MEDIA_STATE replies. Only the first unit has an
+ * image. */
+static uint16_t media_state(uint8_t *buf)
+{
+  uint8_t *slots = &buf[MEDIA_UNITS * 8];
+
+
+  memset(buf, 0, MEDIA_UNITS * (8 + MEDIA_SLOT_SIZE));
+  memcpy(buf, &fujinet.mount_time, sizeof(fujinet.mount_time));
+  memset(slots, 0xFF, MEDIA_UNITS * MEDIA_SLOT_SIZE);
+  if (fujinet.mount_time) {
+    slots[0] = 0;
+    slots[1] = 1;
+    memset(&slots[2], 0, MEDIA_SLOT_SIZE - 2);
+    strcpy((char *) &slots[2], "IMAGE.IMG");
+  }
+  return MEDIA_UNITS * (8 + MEDIA_SLOT_SIZE);
+}
+
+/* saved, the rates and how many there are, the way GET_BAUD_RATES
+ * replies */
+static uint16_t baud_rates(uint8_t *buf)
+{
+  uint16_t idx;
+
+
+  memset(buf, 0, 4 + 4 * FUJINET_RATES + 1);
+  memcpy(buf, &fujinet.saved_bps, 4);
+  for (idx = 0; idx < FUJINET_RATES && fujinet.rates[idx]; idx++)
+    memcpy(&buf[4 + 4 * idx], &fujinet.rates[idx], 4);
+  buf[4 + 4 * FUJINET_RATES] = idx;
+  return 4 + 4 * FUJINET_RATES + 1;
+}
+
+static bool known_rate(uint32_t bps)
+{
+  uint16_t idx;
+
+
+  for (idx = 0; idx < FUJINET_RATES && fujinet.rates[idx]; idx++)
+    if (fujinet.rates[idx] == bps)
+      return true;
+  return false;
+}
+
+static void printer_command(uint8_t command, uint8_t fields,
+                            const uint8_t *data, uint32_t data_length)
+{
+  if (command != FUJICMD_WRITE
+      || data_length > FUJINET_PRINTED - fujinet.printed_len) {
+    nak(FUJI_DEVICEID_PRINTER, fields);
+    return;
+  }
+  memcpy(&fujinet.printed[fujinet.printed_len], data, data_length);
+  fujinet.printed_len += data_length;
+  send_reply(FUJI_DEVICEID_PRINTER, command, PACKET_ACK, fields, NULL, 0, NULL, 0, 0);
+  return;
+}
+
+static void fujinet_command(uint8_t command, const uint8_t *aux, uint8_t fields,
+                            const uint8_t *data, uint32_t data_length)
+{
+  uint16_t offer = aux[0] | aux[1] << 8, length;
+  uint32_t bps = offer | (uint32_t) aux[2] << 16 | (uint32_t) aux[3] << 24;
+  uint8_t caps[2], media[MEDIA_UNITS * (8 + MEDIA_SLOT_SIZE)], echo[FUJINET_SECTOR];
+
+
+  if ((command == FUJICMD_GET_BAUD_RATES || command == FUJICMD_SET_BAUD
+       || command == FUJICMD_BAUD_TEST) && !(fujinet.agreed & FUJI_CAP_BAUD)) {
+    nak(FUJI_DEVICEID_FUJINET, fields);
+    return;
+  }
+
+  switch (command) {
+  case FUJICMD_GET_CAPABILITIES:
+    if (!fujinet.caps) {
+      nak(FUJI_DEVICEID_FUJINET, fields);
+      return;
+    }
+    fujinet.agreed = fujinet.caps & offer;
+    caps[0] = fujinet.agreed & 0xFF;
+    caps[1] = fujinet.agreed >> 8;
+    send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields,
+               NULL, 0, caps, sizeof(caps), 0);
+    return;
+
+  case FUJICMD_STATUS:
+    media_state(media);
+    send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields,
+               NULL, 0, media, MEDIA_UNITS * 8, 0);
+    return;
+
+  case FUJICMD_READ_DEVICE_SLOTS:
+    media_state(media);
+    send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields,
+               NULL, 0, &media[MEDIA_UNITS * 8], MEDIA_UNITS * MEDIA_SLOT_SIZE, 0);
+    return;
+
+  case FUJICMD_GET_MEDIA_STATE:
+    if (!(fujinet.agreed & FUJI_CAP_MEDIA_STATE)) {
+      nak(FUJI_DEVICEID_FUJINET, fields);
+      return;
+    }
+    length = media_state(media);
+    send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields,
+               NULL, 0, media, length, 0);
+    return;
+
+  case FUJICMD_GET_BAUD_RATES:
+    length = baud_rates(media);
+    send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields,
+               NULL, 0, media, length, 0);
+    return;
+
+  case FUJICMD_SET_BAUD:
+    if (!known_rate(bps)) {
+      nak(FUJI_DEVICEID_FUJINET, fields);
+      return;
+    }
+    // The ACK goes at the old speed
+    send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields, NULL, 0, NULL, 0, 0);
+    revert_bps = speed();
+    revert_at = line.now + BAUD_REVERT_NS;
+    fujinet.bps = bps;
+    return;
+
+  case FUJICMD_BAUD_TEST:
+    if (data_length > sizeof(echo)) {
+      nak(FUJI_DEVICEID_FUJINET, fields);
+      return;
+    }
+    // It arrived intact, this speed sticks
+    revert_at = 0;
+    fujinet.saved_bps = speed();
+    memcpy(echo, data, data_length);
+    if (fujinet.clean_bps && speed() > fujinet.clean_bps && data_length)
+      echo[data_length / 2] ^= 0x10;
+    send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields,
+               NULL, 0, echo, data_length, 0);
+    return;
+  }
+
+  send_reply(FUJI_DEVICEID_FUJINET, command, PACKET_ACK, fields, NULL, 0, NULL, 0, 0);
+  return;
+}
+
+static void process(void)
+{
+  uint8_t device, command, fields, ck, aux[4] = {0, 0, 0, 0};
+  uint32_t length, naux, data_length, expect;
+  const uint8_t *data;
+
+
+  if (frame_len < HEADER_SIZE)
+    return;
+
+  device = frame[0];
+  command = frame[1];
+  length = frame[2] | frame[3] << 8;
+  ck = frame[4];
+  fields = frame[5];
+  frame[4] = 0;
+  if (length != frame_len || checksum(frame, frame_len, 0) != ck) {
+    fujinet.bad_frames++;
+    nak(device, fields);
+    return;
+  }
+
+  naux = field_numbytes[fields & 7];
+  memcpy(aux, &frame[HEADER_SIZE], naux);
+  data = &frame[HEADER_SIZE + naux];
+  data_length = frame_len - HEADER_SIZE - naux;
+
+  if (fields & FIELD_COMPRESSED) {
+    expect = command == FUJICMD_WRITE_MULTI ? aux[3] * FUJINET_SECTOR : FUJINET_SECTOR;
+    if (!compress_eligible(device, command)
+        || !(data_length = fujinet_decode(data, data_length, payload, expect))) {
+      fujinet.bad_frames++;
+      nak(device, fields);
+      return;
+    }
+    data = payload;
+  }
+
+  if (fujinet.silent) {
+    fujinet.silent--;
+    return;
+  }
+  if (fujinet.nak) {
+    fujinet.nak--;
+    nak(device, fields);
+    return;
+  }
+
+  fujinet.frames++;
+  fujinet.commands[command]++;
+
+  if (device >= FUJI_DEVICEID_DISK && device <= FUJI_DEVICEID_DISK_LAST)
+    disk_command(device, command, fields, aux, data, data_length);
+  else if (device >= FUJI_DEVICEID_NETWORK && device <= FUJI_DEVICEID_NETWORK_LAST)
+    net_command(device, command, fields, aux);
+  else if (device == FUJI_DEVICEID_FUJINET)
+    fujinet_command(command, aux, fields, data, data_length);
+  else if (device == FUJI_DEVICEID_PRINTER)
+    printer_command(command, fields, data, data_length);
+  else
+    send_reply(device, command, PACKET_ACK, fields, NULL, 0, NULL, 0, 0);
+  return;
+}
+
+void line_fujinet_rx(uint8_t c)
+{
+  if (revert_at && line.now >= revert_at) {
+    fujinet.bps = revert_bps;
+    revert_at = 0;
+  }
+  if (garbled())
+    c = 0;
+
+  if (c == SLIP_END) {
+    if (frame_len)
+      process();
+    frame_len = 0;
+    frame_escape = false;
+    return;
+  }
+
+  if (frame_escape) {
+    frame_escape = false;
+    if (c == SLIP_ESC_END)
+      c = SLIP_END;
+    else if (c == SLIP_ESC_ESC)
+      c = SLIP_ESCAPE;
+  }
+  else if (c == SLIP_ESCAPE) {
+    frame_escape = true;
+    return;
+  }
+
+  if (frame_len < FRAME_MAX)
+    frame[frame_len++] = c;
+  return;
+}
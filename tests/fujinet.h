@@ -0,0 +1,68 @@
+/**
+ * FujiNet stand-in for the host harness
+ */
+
+#ifndef _FUJINET_H
+#define _FUJINET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FUJINET_SECTOR          512
+#define FUJINET_SECTORS         2880    // One 1.44M floppy on the first disk device
+#define FUJINET_NET_MAX         65535U
+#define FUJINET_RATES           8
+#define FUJINET_PRINTED         1024
+
+typedef struct {
+  uint16_t caps;                // FUJI_CAP_* implemented, 0 NAKs GET_CAPABILITIES
+  uint16_t agreed;              // What the last GET_CAPABILITIES settled on
+  uint64_t turnaround_ns;       // End of a command to the start of its reply
+  uint64_t sector_ns;           // Added for every sector read or written
+  bool short_decode;            // Compressed replies claim one byte less than they hold
+  uint32_t silent;              // Don't answer the next this many commands
+  uint32_t nak;                 // NAK the next this many commands
+  int32_t mount_time;           // When the first disk device's image was mounted, 0 if none
+  uint32_t bps;                 // Line speed, 0 for whatever the PC is set to
+  uint32_t rates[FUJINET_RATES]; // GET_BAUD_RATES list, lowest first, 0 ends it
+  uint32_t saved_bps;           // Last speed a BAUD_TEST arrived intact at
+  uint32_t clean_bps;           // Fastest speed test patterns come back intact at, 0 for any
+  uint32_t cable_bps;           // Fastest speed anything gets through at, 0 for any
+
+  uint8_t disk[FUJINET_SECTORS * FUJINET_SECTOR];
+  uint8_t net[FUJINET_NET_MAX]; // What the first network device has to read
+  uint16_t net_len;
+  uint16_t net_pos;
+  uint8_t printed[FUJINET_PRINTED]; // What the printer device was sent
+  uint16_t printed_len;
+
+  uint32_t frames;              // Commands that arrived intact
+  uint32_t bad_frames;          // Commands that were NAKed for a bad checksum
+  uint32_t compressed;          // Replies sent compressed
+  uint32_t commands[256];       // Intact commands by command byte
+} fujinet_state;
+
+extern fujinet_state fujinet;
+
+/**
+ * @brief forget everything, fill the disk with a mix of text, runs
+ *        and empty sectors
+ */
+extern void fujinet_reset(uint16_t caps);
+
+/**
+ * @brief the reference encoder, with LZ matches if lz is set
+ * @param size room the driver has for the reply
+ * @return compressed length, 0 if it isn't smaller or the driver
+ *         couldn't decode it in place
+ */
+extern uint16_t fujinet_encode(const uint8_t *src, uint16_t len, uint16_t size, bool lz,
+                               uint8_t *dst);
+
+/**
+ * @brief decode a payload the driver compressed
+ * @return decoded length, 0 if it is bad
+ */
+extern uint16_t fujinet_decode(const uint8_t *src, uint16_t len, uint8_t *dst, uint16_t size);
+
+#endif /* _FUJINET_H */
@@ -0,0 +1,44 @@
+/**
+ * Shared setup for the host tests
+ */
+
+#include "harness.h"
+#include "fujicom.h"
+#include "compress.h"
+#include "portio.h"
+#include <string.h>
+
+int harness_failures;
+static uint64_t harness_epoch;
+
+static uint8_t compress_space[64 * 512];
+
+void harness_start(uint16_t caps, bool irq)
+{
+  line_reset();
+  fujinet_reset(caps);
+  fujicom_init();
+  port_rx_irq = irq;
+  compress_setup(compress_space, sizeof(compress_space));
+  fujicom_get_caps(FUJI_CAPS_HOST);
+
+  // Old firmware NAKing the probe isn't what the tests are counting,
+  // and drop_at and corrupt_at count from the first byte after it
+  memset(&fujicom_stats, 0, sizeof(fujicom_stats));
+  line.to_pc = line.to_fujinet = 0;
+  fujinet.frames = 0;
+  memset(fujinet.commands, 0, sizeof(fujinet.commands));
+  harness_epoch = line.now;
+  return;
+}
+
+double harness_ms(void)
+{
+  return (line.now - harness_epoch) / 1e6;
+}
+
+int harness_done(const char *name)
+{
+  printf("%s: %s\n", name, harness_failures ? "FAILED" : "ok");
+  return harness_failures ? 1 : 0;
+}
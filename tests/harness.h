@@ -0,0 +1,42 @@
+/**
+ * Shared setup for the host tests
+ */
+
+#ifndef _HARNESS_H
+#define _HARNESS_H
+
+#include "line.h"
+#include "fujinet.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+extern int harness_failures;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond); \
+      harness_failures++;                                               \
+    }                                                                   \
+  } while (0)
+
+/**
+ * @brief fresh line and FujiNet, driver initialised and capabilities
+ *        negotiated
+ * @param caps what the FujiNet implements
+ * @param irq receive through the ring like port_rx_isr, polled if false
+ */
+extern void harness_start(uint16_t caps, bool irq);
+
+/**
+ * @brief simulated milliseconds since harness_start
+ */
+extern double harness_ms(void);
+
+/**
+ * @brief print the test result and the exit code for main
+ */
+extern int harness_done(const char *name);
+
+#endif /* _HARNESS_H */
@@ -0,0 +1,32 @@
+#ifndef _HOST_DOS_H
+#define _HOST_DOS_H
+
+#include <string.h>
+#include <strings.h>
+
+union REGS {
+  struct {
+    uint16_t ax, bx, cx, dx, si, di, cflag, flags;
+  } w, x;
+  struct {
+    uint8_t al, ah, bl, bh, cl, ch, dl, dh;
+  } h;
+};
+
+struct SREGS {
+  uint16_t es, cs, ss, ds;
+};
+
+extern int int86(int intno, union REGS *in, union REGS *out);
+extern int int86x(int intno, union REGS *in, union REGS *out, struct SREGS *seg);
+extern int intdos(union REGS *in, union REGS *out);
+extern int intdosx(union REGS *in, union REGS *out, struct SREGS *seg);
+extern void segread(struct SREGS *seg);
+
+/* Interrupt vectors live in a table the tests can fill in */
+typedef void (*host_vector)(void);
+extern void far *host_vectors[256];
+#define _dos_getvect(v)         ((host_vector) host_vectors[v])
+#define _dos_setvect(v, f)      (host_vectors[v] = (void far *) (f))
+
+#endif /* _HOST_DOS_H */
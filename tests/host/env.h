@@ -0,0 +1 @@
+/* Covered by host.h */
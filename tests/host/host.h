@@ -0,0 +1,52 @@
+/**
+ * Forced into everything the host harness compiles, so driver sources
+ * written for Open Watcom build with gcc
+ */
+
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define far
+#define near
+#define __far
+#define __near
+#define cdecl
+#define __cdecl
+#define interrupt
+#define __interrupt
+#define __segment       uint16_t
+
+/* Real mode memory, big enough for the BIOS data area and anything a
+ * test hands out as a segment */
+#define HOST_MEM_SIZE   0x110000UL
+extern uint8_t host_mem[HOST_MEM_SIZE];
+
+#define MK_FP(seg, off) ((void *) &host_mem[((uint32_t) (seg) << 4) + (uintptr_t) (off)])
+#define FP_SEG(p)       ((uint16_t) 0)
+#define FP_OFF(p)       ((uint16_t) (uintptr_t) (p))
+
+extern unsigned host_inp(unsigned port);
+extern unsigned host_outp(unsigned port, unsigned value);
+#define inp             host_inp
+#define outp            host_outp
+
+#define _disable()
+#define _enable()
+
+#define _fmemcpy        memcpy
+#define _fmemmove       memmove
+#define _fmemset        memset
+#define _fmemcmp        memcmp
+#define _fstrlen        strlen
+#define _fstrcpy        strcpy
+#define _fstrncpy       strncpy
+#define _fstrcmp        strcmp
+#define _fstricmp       strcasecmp
+#define _fstrnicmp      strncasecmp
+#define stricmp         strcasecmp
+#define strnicmp        strncasecmp
+
+#endif /* _HOST_H */
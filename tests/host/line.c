@@ -0,0 +1,420 @@
+/**
+ * Host stand-in for portio.asm and port_irq.asm
+ *
+ * Nothing here runs in real time. The line keeps a clock in
+ * nanoseconds that moves forward as bytes are sent, as the driver
+ * polls the UART, and while it waits for a reply, and the BIOS tick
+ * count in host_mem follows it. Bytes to the FujiNet leave the UART
+ * back to back behind whatever the driver wrote before them, and the
+ * driver pays for every LSR poll and OUT the way port_putbuf_slip does
+ * on a 4.77 MHz 8088. Bytes from the FujiNet are queued with the time
+ * they finish arriving. With port_rx_irq set they are
+ * moved into the 256 byte receive ring whenever the clock moves,
+ * counting overruns the way port_rx_isr does, otherwise they wait in
+ * the UART for the driver to poll them.
+ */
+
+#include "line.h"
+#include "portio.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TICK_NS         54925439ULL
+#define BIOS_TICK_ADDR  0x46C
+#define UART_RBR        0
+#define UART_DLM        1
+#define UART_LCR        3
+#define UART_LSR        5
+#define LCR_DLAB        0x80
+#define UART_CLOCK      1843200UL
+#define LSR_DR          0x01
+#define LSR_THRE        0x20
+#define LSR_TEMT        0x40
+#define IO_NS           1000    // One ISA bus cycle to the UART
+#define PUT_BYTE_NS     36000   // SLIP_SEND_BYTE and the loop around it, on an 8088
+#define PUT_FIFO_NS     9000    // lodsb, out, loop
+#define TX_FIFO_DEPTH   16
+#define LINE_QUEUE      (1UL << 20)
+
+enum {
+  SLIP_END     = 0xC0,
+  SLIP_ESCAPE  = 0xDB,
+  SLIP_ESC_END = 0xDC,
+  SLIP_ESC_ESC = 0xDD,
+};
+
+uint8_t host_mem[HOST_MEM_SIZE];
+void far *host_vectors[256];
+
+uint16_t port_uart_base = 0x3F8;
+uint8_t port_rx_sum;
+uint8_t port_tx_fifo;
+uint8_t port_rx_irq;
+uint8_t port_irq;
+volatile uint8_t port_rx_head;
+volatile uint8_t port_rx_tail;
+volatile uint16_t port_rx_overruns;
+uint16_t port_rx_old_off;
+uint16_t port_rx_old_seg;
+static uint8_t port_rx_ring[256];
+
+line_state line;
+
+typedef struct {
+  uint8_t byte;
+  uint64_t at;
+} line_byte;
+
+static line_byte *line_queue;
+static uint32_t queue_head, queue_tail;
+static uint8_t uart_lcr;
+static uint16_t uart_divisor;
+
+void port_rx_isr(void)
+{
+  return;
+}
+
+static uint64_t byte_ns(void)
+{
+  return 10ULL * 1000000000ULL / (line.bps ? line.bps : 115200);
+}
+
+static void set_ticks(void)
+{
+  uint32_t ticks = line.now / TICK_NS;
+
+
+  memcpy(&host_mem[BIOS_TICK_ADDR], &ticks, sizeof(ticks));
+  return;
+}
+
+static uint32_t ticks_now(void)
+{
+  return line.now / TICK_NS;
+}
+
+static bool arrived(void)
+{
+  return queue_head != queue_tail && line_queue[queue_tail].at <= line.now;
+}
+
+static uint8_t take(void)
+{
+  uint8_t c = line_queue[queue_tail].byte;
+
+
+  queue_tail = (queue_tail + 1) % LINE_QUEUE;
+  return c;
+}
+
+/* What port_rx_isr would have done by now */
+static void run_isr(void)
+{
+  if (!port_rx_irq)
+    return;
+
+  while (arrived()) {
+    if ((uint8_t) (port_rx_head + 1) == port_rx_tail) {
+      take();
+      port_rx_overruns++;
+      line.overruns++;
+      continue;
+    }
+    port_rx_ring[port_rx_head] = take();
+    port_rx_head++;
+  }
+  return;
+}
+
+void line_advance(uint64_t ns)
+{
+  line.now += ns;
+  set_ticks();
+  run_isr();
+  return;
+}
+
+void line_reset(void)
+{
+  uint32_t clock = line.uart_clock ? line.uart_clock : UART_CLOCK;
+
+
+  if (!line_queue)
+    line_queue = malloc(LINE_QUEUE * sizeof(*line_queue));
+  queue_head = queue_tail = 0;
+  port_rx_head = port_rx_tail = 0;
+  port_rx_overruns = 0;
+  port_rx_irq = 0;
+  port_tx_fifo = 0;
+  memset(&line, 0, sizeof(line));
+  line.uart_clock = clock;
+  line.bps = 115200;
+  uart_lcr = 0;
+  set_ticks();
+  return;
+}
+
+uint64_t line_last_arrival(void)
+{
+  if (queue_head == queue_tail)
+    return line.now;
+  return line_queue[(queue_head + LINE_QUEUE - 1) % LINE_QUEUE].at;
+}
+
+void line_to_pc(const uint8_t *buf, uint16_t len, uint64_t start)
+{
+  uint64_t at = start;
+  uint64_t last = line_last_arrival();
+
+
+  if (at < last)
+    at = last;
+  for (; len; len--, buf++) {
+    at += byte_ns();
+    line.to_pc++;
+    if (line.drop_at && line.to_pc == line.drop_at)
+      continue;
+    line_queue[queue_head].byte = *buf;
+    if (line.corrupt_at && line.to_pc == line.corrupt_at)
+      line_queue[queue_head].byte ^= 0x5A;
+    line_queue[queue_head].at = at;
+    queue_head = (queue_head + 1) % LINE_QUEUE;
+  }
+  return;
+}
+
+/* Wait for the next byte from the FujiNet, the same way
+ * SLIPD_WAIT_CHAR does, giving up once the tick count reaches
+ * deadline */
+static bool wait_char(uint32_t deadline, uint8_t *c)
+{
+  uint64_t until;
+
+
+  for (;;) {
+    if (port_rx_irq) {
+      if (port_rx_tail != port_rx_head) {
+        *c = port_rx_ring[port_rx_tail];
+        port_rx_tail++;
+        return true;
+      }
+    }
+    else if (arrived()) {
+      *c = take();
+      return true;
+    }
+
+    if (ticks_now() >= deadline)
+      return false;
+
+    until = deadline * TICK_NS;
+    if (queue_head != queue_tail && line_queue[queue_tail].at < until)
+      until = line_queue[queue_tail].at;
+    line_advance(until > line.now ? until - line.now : IO_NS);
+  }
+}
+
+void cdecl port_init(uint16_t base, uint16_t divisor)
+{
+  port_uart_base = base;
+  uart_divisor = divisor;
+  if (divisor)
+    line.bps = line.uart_clock / 16 / divisor;
+  return;
+}
+
+/* THRE, nothing is waiting behind the byte being shifted out */
+static bool tx_empty(void)
+{
+  return line.now + byte_ns() >= line.tx_done;
+}
+
+/* Poll the LSR until THRE */
+static void tx_wait(void)
+{
+  uint64_t ready = line.tx_done - byte_ns();
+
+
+  if (!tx_empty())
+    line_advance(ready - line.now);
+  line_advance(IO_NS);
+  return;
+}
+
+/* Write THR after cpu_ns of getting the byte ready, it goes out as
+ * soon as the ones before it are through */
+static void tx_write(uint8_t c, uint64_t cpu_ns)
+{
+  line_advance(cpu_ns);
+  line.tx_done = (line.tx_done > line.now ? line.tx_done : line.now) + byte_ns();
+  line.to_fujinet++;
+  line_fujinet_rx(c);
+  return;
+}
+
+/* One encoded byte, waiting for THRE before each one, or once per
+ * TX_FIFO_DEPTH bytes with port_tx_fifo set */
+static void tx_put(uint8_t c, uint8_t *free)
+{
+  if (!port_tx_fifo) {
+    tx_wait();
+    tx_write(c, PUT_BYTE_NS);
+    return;
+  }
+
+  if (!*free) {
+    tx_wait();
+    *free = TX_FIFO_DEPTH;
+  }
+  (*free)--;
+  tx_write(c, PUT_FIFO_NS);
+  return;
+}
+
+int cdecl port_putc(uint8_t c)
+{
+  tx_wait();
+  tx_write(c, PUT_BYTE_NS);
+  return c;
+}
+
+uint16_t cdecl port_putbuf_slip(const void far *buf, uint16_t len)
+{
+  const uint8_t *ptr = buf;
+  uint16_t idx;
+  uint8_t free = 0;
+
+
+  for (idx = 0; idx < len; idx++) {
+    switch (ptr[idx]) {
+    case SLIP_END:
+      tx_put(SLIP_ESCAPE, &free);
+      tx_put(SLIP_ESC_END, &free);
+      break;
+    case SLIP_ESCAPE:
+      tx_put(SLIP_ESCAPE, &free);
+      tx_put(SLIP_ESC_ESC, &free);
+      break;
+    default:
+      tx_put(ptr[idx], &free);
+      break;
+    }
+  }
+  return len;
+}
+
+uint16_t cdecl port_checksum(const void far *buf, uint16_t len, uint16_t seed)
+{
+  const uint8_t *ptr = buf;
+  uint16_t sum = seed & 0xFF;
+
+
+  for (; len; len--, ptr++) {
+    sum += *ptr;
+    sum = (sum & 0xFF) + (sum >> 8);
+  }
+  return sum;
+}
+
+uint16_t cdecl port_getbuf_slip_dual(void *hdr_buf, uint16_t hdr_len,
+                                     void far *data_buf, uint16_t data_len,
+                                     uint16_t timeout)
+{
+  uint8_t *ptr = hdr_buf;
+  uint16_t left = hdr_len, total = 0, sum = 0;
+  uint8_t c;
+
+
+  if (!hdr_len && !data_len) {
+    port_rx_sum = 0;
+    return 0;
+  }
+
+  if (!left) {
+    ptr = data_buf;
+    left = data_len;
+    data_len = 0;
+  }
+
+  if (timeout & PORT_RX_CONTINUE) {
+    timeout &= ~PORT_RX_CONTINUE;
+    sum = port_rx_sum;
+  }
+  else {
+    // Sync on a SLIP_END, then skip any more of them
+    do {
+      if (!wait_char(ticks_now() + timeout, &c))
+        goto done;
+    } while (c != SLIP_END);
+    do {
+      if (!wait_char(ticks_now() + timeout, &c))
+        goto done;
+    } while (c == SLIP_END);
+    goto decode;
+  }
+
+  for (;;) {
+    if (!wait_char(ticks_now() + timeout, &c))
+      break;
+  decode:
+    if (c == SLIP_END)
+      break;
+    if (c == SLIP_ESCAPE) {
+      if (!wait_char(ticks_now() + timeout, &c))
+        break;
+      if (c == SLIP_ESC_END)
+        c = SLIP_END;
+      else if (c == SLIP_ESC_ESC)
+        c = SLIP_ESCAPE;
+    }
+
+    *ptr++ = c;
+    sum += c;
+    sum = (sum & 0xFF) + (sum >> 8);
+    total++;
+    if (--left)
+      continue;
+    if (!data_len)
+      break;
+    ptr = data_buf;
+    left = data_len;
+    data_len = 0;
+  }
+
+ done:
+  port_rx_sum = sum;
+  return total;
+}
+
+unsigned host_inp(unsigned port)
+{
+  line_advance(IO_NS);
+  if (port == port_uart_base + UART_LSR)
+    return (tx_empty() ? LSR_THRE : 0) | (line.now >= line.tx_done ? LSR_TEMT : 0)
+      | (!port_rx_irq && arrived() ? LSR_DR : 0);
+  if (port == port_uart_base + UART_LCR)
+    return uart_lcr;
+  if (port == port_uart_base + UART_RBR)
+    return !port_rx_irq && arrived() ? take() : 0;
+  return 0;
+}
+
+/* Only the divisor latch matters, the line follows it */
+unsigned host_outp(unsigned port, unsigned value)
+{
+  line_advance(IO_NS);
+  if (port == port_uart_base + UART_LCR)
+    uart_lcr = value;
+  else if ((uart_lcr & LCR_DLAB) && port == port_uart_base + UART_RBR)
+    uart_divisor = (uart_divisor & 0xFF00) | value;
+  else if ((uart_lcr & LCR_DLAB) && port == port_uart_base + UART_DLM)
+    uart_divisor = (uart_divisor & 0x00FF) | value << 8;
+  else
+    return value;
+
+  if (!(uart_lcr & LCR_DLAB) && uart_divisor)
+    line.bps = line.uart_clock / 16 / uart_divisor;
+  return value;
+}
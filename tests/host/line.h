@@ -0,0 +1,48 @@
+#ifndef _LINE_H
+#define _LINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+  uint64_t now;                 // Nanoseconds since line_reset
+  uint32_t bps;                 // What the PC's UART is set to
+  uint32_t uart_clock;          // Its crystal, line_reset keeps it
+  uint32_t to_pc;               // Bytes the FujiNet has sent
+  uint32_t to_fujinet;          // Bytes the driver has sent
+  uint64_t tx_done;             // When the last byte sent finishes leaving the UART
+  uint32_t overruns;            // Bytes the receive ring had no room for
+  uint32_t drop_at;             // Lose this byte to the PC, counting from 1
+  uint32_t corrupt_at;          // Flip bits in this one
+} line_state;
+
+extern line_state line;
+
+/**
+ * @brief empty the line and start the clock again, polled receive at
+ *        115200 bps
+ */
+extern void line_reset(void);
+
+/**
+ * @brief let time pass, as if the driver was busy with something else
+ */
+extern void line_advance(uint64_t ns);
+
+/**
+ * @brief queue bytes for the PC, the first one starting at start or
+ *        once everything already queued is through
+ */
+extern void line_to_pc(const uint8_t *buf, uint16_t len, uint64_t start);
+
+/**
+ * @brief when the last byte queued for the PC finishes arriving
+ */
+extern uint64_t line_last_arrival(void);
+
+/**
+ * @brief every byte the driver sends, see fujinet.c
+ */
+extern void line_fujinet_rx(uint8_t c);
+
+#endif /* _LINE_H */
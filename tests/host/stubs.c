@@ -0,0 +1,69 @@
+/**
+ * Driver routines the harness doesn't need the real thing for
+ */
+
+#include "print.h"
+#include "hydrate.h"
+#include "xms.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* HARNESS_VERBOSE=1 shows what the driver prints */
+void vconsolef(const char *format, va_list args)
+{
+  if (getenv("HARNESS_VERBOSE"))
+    vfprintf(stderr, format, args);
+  return;
+}
+
+void consolef(const char *format, ...)
+{
+  va_list args;
+
+
+  va_start(args, format);
+  vconsolef(format, args);
+  va_end(args);
+  return;
+}
+
+uint16_t getCS(void)
+{
+  return 0;
+}
+
+/* There is no XMS, caches stay in conventional memory */
+bool xms_copy_to(uint16_t handle, uint32_t offset, const void far *src, uint16_t length)
+{
+  return false;
+}
+
+bool xms_copy_from(uint16_t handle, uint32_t offset, void far *dest, uint16_t length)
+{
+  return false;
+}
+
+/* Nothing is ever hydrated, every read goes to the wire */
+uint16_t hydrate_max_kb;
+hydrate_unit hydrate_units[8];  // FN_MAX_DEV, sys/fujinet.h is shadowed here
+uint32_t cachefile_loaded;
+
+void hydrate_start(uint8_t unit, uint32_t sectors)
+{
+  return;
+}
+
+void hydrate_drop(uint8_t unit)
+{
+  return;
+}
+
+uint16_t hydrate_read(uint8_t unit, uint32_t sector, uint16_t count, uint8_t far *buf)
+{
+  return 0;
+}
+
+void hydrate_written(uint8_t unit, uint32_t sector, uint16_t count, const uint8_t far *buf)
+{
+  return;
+}
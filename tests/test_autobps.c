@@ -0,0 +1,97 @@
+/**
+ * Line speed negotiation against the FujiNet stand-in
+ *
+ * autobps_negotiate steps up through the speeds the FujiNet lists,
+ * keeping the last one whose test pattern came back intact. Both ends
+ * have to end up at the same speed whatever happens on the way: the
+ * stand-in garbles everything while they differ, so a disk read
+ * afterwards shows whether they do.
+ */
+
+#include "harness.h"
+#include "autobps.h"
+#include "fujicom.h"
+#include <fuji_f5.h>
+#include <string.h>
+#include <stdlib.h>
+
+static const uint32_t rates[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600};
+
+static uint8_t space[AUTOBPS_SPACE];
+static uint8_t buf[512];
+
+static void start(const char *bps, uint32_t clean_bps)
+{
+  setenv("FUJI_BPS", bps, 1);
+  harness_start(FUJI_CAP_BAUD, false);
+  memcpy(fujinet.rates, rates, sizeof(rates));
+  fujinet.bps = line.bps;
+  fujinet.clean_bps = clean_bps;
+  return;
+}
+
+/* Both ends at bps and still talking */
+static void check_speed(uint32_t bps)
+{
+  CHECK(fujicom_bps == bps && line.bps == bps && fujinet.bps == bps);
+  CHECK(fuji_bus_call(FUJI_DEVICEID_DISK, FUJICMD_READ, FUJI_FIELD_C1234,
+                      1, 0, 0, 0, NULL, 0, buf, sizeof(buf)));
+  CHECK(!memcmp(buf, &fujinet.disk[512], sizeof(buf)));
+  return;
+}
+
+int main(void)
+{
+  // Up from 9600 to the fastest a standard UART clock divides to
+  start("9600", 0);
+  autobps_negotiate(0, space);
+  printf("from 9600 bps: %u bps after %u tests, %.0f ms\n", line.bps,
+         fujinet.commands[FUJICMD_BAUD_TEST], harness_ms());
+  CHECK(fujinet.commands[FUJICMD_BAUD_TEST] == 4);
+  CHECK(fujinet.saved_bps == 115200);
+  check_speed(115200);
+
+  // Only as far as asked
+  start("9600", 0);
+  autobps_negotiate(38400, space);
+  check_speed(38400);
+
+  // Straight to the speed that passed last time
+  start("9600", 0);
+  fujinet.saved_bps = 57600;
+  autobps_negotiate(0, space);
+  CHECK(fujinet.commands[FUJICMD_BAUD_TEST] == 1 && fujinet.commands[FUJICMD_SET_BAUD] == 1);
+  check_speed(57600);
+
+  // A pattern spoiled on the way back: the FujiNet got it intact and
+  // has to be talked back down
+  start("9600", 38400);
+  autobps_negotiate(0, space);
+  printf("spoiled above 38400 bps: %u bps, %.0f ms\n", line.bps, harness_ms());
+  CHECK(fujinet.saved_bps == 38400);
+  check_speed(38400);
+  CHECK(fujicom_stats.failures == 0);
+
+  // Nothing gets through above 19200, the FujiNet goes back by itself
+  start("9600", 0);
+  fujinet.cable_bps = 19200;
+  autobps_negotiate(0, space);
+  printf("lost above 19200 bps: %u bps, %.0f ms\n", line.bps, harness_ms());
+  // Not much longer than the FujiNet takes to give up
+  CHECK(harness_ms() < 8000);
+  CHECK(fujinet.saved_bps == 19200);
+  check_speed(19200);
+
+  // A card with a 7.3728 MHz crystal divides down to 460800 bps
+  setenv("FUJI_CLOCK", "7372800", 1);
+  line.uart_clock = 7372800;
+  start("115200", 0);
+  CHECK(fujicom_divisor(115200) == 4 && fujicom_divisor(921600) == 0);
+  autobps_negotiate(0, space);
+  printf("7.3728 MHz UART: %u bps after %u tests\n", line.bps,
+         fujinet.commands[FUJICMD_BAUD_TEST]);
+  CHECK(fujinet.commands[FUJICMD_BAUD_TEST] == 2);
+  check_speed(460800);
+
+  return harness_done("autobps");
+}
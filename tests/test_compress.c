@@ -0,0 +1,88 @@
+/**
+ * Compressed payloads both ways
+ *
+ * Sectors the driver encodes have to come out of the reference
+ * decoder unchanged, and replies from the reference encoder, with and
+ * without LZ matches, have to come out of compress_decode unchanged
+ * after decoding in place. A reply that decodes to any other length
+ * than was asked for has to be refused.
+ */
+
+#include "harness.h"
+#include "compress.h"
+#include "fujicom.h"
+#include <string.h>
+
+#define SECTOR          512
+#define CHECKED         64
+
+static uint8_t buf[SECTOR];
+static uint8_t enc[SECTOR * 2];
+
+static bool disk_read(uint32_t sector)
+{
+  return fuji_bus_call(FUJI_DEVICEID_DISK, FUJICMD_READ, FUJI_FIELD_C1234,
+                       sector & 0xFF, sector >> 8, 0, 0, NULL, 0, buf, SECTOR);
+}
+
+int main(void)
+{
+  const uint8_t *sector;
+  uint16_t len, idx, lz, packed[3] = {0, 0, 0};
+
+
+  harness_start(FUJI_CAP_RLE | FUJI_CAP_LZ, false);
+
+  // Driver to FujiNet
+  for (idx = 0; idx < CHECKED; idx++) {
+    sector = &fujinet.disk[idx * SECTOR];
+    len = compress_encode(sector, SECTOR);
+    if (!len)
+      continue;
+    CHECK(len < SECTOR);
+    CHECK(fujinet_decode(compress_buf, len, buf, SECTOR) == SECTOR);
+    CHECK(!memcmp(buf, sector, SECTOR));
+    packed[0]++;
+  }
+
+  // FujiNet to driver, in place
+  for (lz = 0; lz < 2; lz++) {
+    for (idx = 0; idx < CHECKED; idx++) {
+      sector = &fujinet.disk[idx * SECTOR];
+      len = fujinet_encode(sector, SECTOR, SECTOR, lz, enc);
+      if (!len)
+        continue;
+      memset(buf, 0xEE, sizeof(buf));
+      memcpy(buf, enc, len);
+      CHECK(compress_decode(buf, len, SECTOR) == SECTOR);
+      CHECK(!memcmp(buf, sector, SECTOR));
+      packed[1 + lz]++;
+    }
+  }
+  printf("of %u sectors the driver packed %u, the FujiNet %u, %u with LZ\n",
+         CHECKED, packed[0], packed[1], packed[2]);
+  CHECK(packed[0] && packed[1] && packed[2] >= packed[1]);
+
+  // The decoded length has to be the one that was asked for
+  len = fujinet_encode(&fujinet.disk[1 * SECTOR], SECTOR, SECTOR, true, enc);
+  CHECK(len);
+  memcpy(buf, enc, len);
+  CHECK(!compress_decode(buf, len, SECTOR + 1));
+  memcpy(buf, enc, len);
+  buf[0]--;
+  CHECK(!compress_decode(buf, len, SECTOR));
+  memcpy(buf, enc, len);
+  CHECK(!compress_decode(buf, len - 1, SECTOR));
+
+  // Over the line, a reply that comes up one byte short is a bad
+  // frame every time it is sent
+  harness_start(FUJI_CAP_RLE | FUJI_CAP_LZ, false);
+  CHECK(disk_read(1));
+  CHECK(!memcmp(buf, &fujinet.disk[1 * SECTOR], SECTOR));
+  CHECK(fujinet.compressed == 1);
+  fujinet.short_decode = true;
+  CHECK(!disk_read(3));
+  CHECK(fujicom_stats.bad_frames == 3 && fujicom_stats.failures == 1);
+
+  return harness_done("compress");
+}
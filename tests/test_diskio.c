@@ -0,0 +1,103 @@
+/**
+ * Multi-sector transfers against one sector per round trip
+ *
+ * Reads and writes the same 64 sectors with each way wire_read and
+ * wire_write can talk to the FujiNet, checks the data and compares
+ * how long the line was busy. Then writes them again through the
+ * 16550A transmit FIFO and a byte at a time, at the standard rate and
+ * at a rate only a faster UART clock reaches.
+ */
+
+#include "harness.h"
+#include "diskio.h"
+#include "fujicom.h"
+#include "portio.h"
+#include <string.h>
+
+#define COUNT           64
+#define FIRST           100
+
+typedef struct {
+  const char *name;
+  uint16_t caps;
+  bool irq;
+} mode;
+
+static const mode modes[] = {
+  {"single",       0,                                            false},
+  {"tagged",       FUJI_CAP_TAGGED,                              true},
+  {"multi",        FUJI_CAP_MULTI_SECTOR,                        false},
+  {"multi+rle+lz", FUJI_CAP_MULTI_SECTOR | FUJI_CAP_RLE | FUJI_CAP_LZ, false},
+};
+
+#define MODES (sizeof(modes) / sizeof(modes[0]))
+
+static const uint32_t rates[] = {115200, 460800};
+
+#define RATES (sizeof(rates) / sizeof(rates[0]))
+
+static uint8_t buf[COUNT * SECTOR_SIZE];
+static uint8_t expect[COUNT * SECTOR_SIZE];
+
+int main(void)
+{
+  double read_ms[MODES], write_ms[MODES], tx_ms[RATES][2];
+  uint32_t frames;
+  unsigned idx, sector, fifo;
+
+
+  for (idx = 0; idx < MODES; idx++) {
+    harness_start(modes[idx].caps, modes[idx].irq);
+    // About what a TNFS mounted image takes to find a sector
+    fujinet.turnaround_ns = 8000000;
+    CHECK(fujicom_caps == (modes[idx].caps & FUJI_CAPS_HOST));
+
+    memset(buf, 0xEE, sizeof(buf));
+    CHECK(wire_read(0, FIRST, COUNT, buf) == COUNT);
+    CHECK(!memcmp(buf, &fujinet.disk[FIRST * SECTOR_SIZE], sizeof(buf)));
+    read_ms[idx] = harness_ms();
+    frames = fujinet.frames;
+
+    // Write the sectors back in reverse order, then read them again
+    for (sector = 0; sector < COUNT; sector++)
+      memcpy(&expect[sector * SECTOR_SIZE], &buf[(COUNT - 1 - sector) * SECTOR_SIZE],
+             SECTOR_SIZE);
+    CHECK(wire_write(0, FIRST, COUNT, expect) == COUNT);
+    write_ms[idx] = harness_ms() - read_ms[idx];
+    CHECK(!memcmp(&fujinet.disk[FIRST * SECTOR_SIZE], expect, sizeof(expect)));
+
+    printf("%-14s read %7.1f ms in %2u frames, write %7.1f ms, %u compressed\n",
+           modes[idx].name, read_ms[idx], frames, write_ms[idx], fujinet.compressed);
+    CHECK(!fujicom_stats.retries && !fujicom_stats.failures);
+  }
+
+  // Every way of avoiding a round trip per sector has to pay off
+  CHECK(read_ms[1] < read_ms[0]);
+  CHECK(read_ms[2] < read_ms[0]);
+  CHECK(write_ms[2] < write_ms[0]);
+  CHECK(read_ms[3] < read_ms[2]);
+
+  // Without RLE the sectors go out as they are
+  for (idx = 0; idx < RATES; idx++)
+    for (fifo = 0; fifo < 2; fifo++) {
+      harness_start(FUJI_CAP_MULTI_SECTOR, false);
+      line.bps = rates[idx];
+      port_tx_fifo = fifo;
+      CHECK(wire_write(0, FIRST, COUNT, buf) == COUNT);
+      tx_ms[idx][fifo] = harness_ms();
+      CHECK(!memcmp(&fujinet.disk[FIRST * SECTOR_SIZE], buf, sizeof(buf)));
+      printf("%6u bps %-9s write %7.1f ms\n", rates[idx], fifo ? "tx fifo" : "byte",
+             tx_ms[idx][fifo]);
+    }
+
+  // At 115200 bps an 8088 keeps up either way, above it only the FIFO
+  // does
+  CHECK(tx_ms[0][1] <= tx_ms[0][0]);
+  CHECK(tx_ms[1][1] * 1.5 < tx_ms[1][0]);
+
+  // Past the end of the image the FujiNet only manages the first few
+  harness_start(FUJI_CAP_MULTI_SECTOR, false);
+  CHECK(wire_read(0, FUJINET_SECTORS - 3, 8, buf) == 3);
+
+  return harness_done("diskio");
+}
@@ -0,0 +1,165 @@
+/**
+ * Lost and damaged replies: timeout classes, resync and retries
+ *
+ * Runs with polled receive, fujicom_resync spins on the BIOS tick
+ * count with the ring and the simulated clock only moves when the
+ * driver touches the UART.
+ */
+
+#include "harness.h"
+#include "fujicom.h"
+#include "diskio.h"
+#include "portio.h"
+#include <string.h>
+
+#define SECTOR          512
+#define NET             FUJI_DEVICEID_NETWORK
+#define DISK            FUJI_DEVICEID_DISK
+
+static uint8_t buf[SECTOR];
+static uint8_t sectors[4 * SECTOR];
+
+static bool sector_read(uint32_t sector)
+{
+  return fuji_bus_call(DISK, FUJICMD_READ, FUJI_FIELD_C1234,
+                       sector & 0xFF, sector >> 8, 0, 0, NULL, 0, buf, SECTOR);
+}
+
+static bool net_read(uint16_t length)
+{
+  return fuji_bus_call(NET, FUJICMD_READ, FUJI_FIELD_A1_A2,
+                       length & 0xFF, length >> 8, 0, 0, NULL, 0, buf, length);
+}
+
+static bool net_status(void)
+{
+  return fuji_bus_call(NET, FUJICMD_STATUS, FUJI_FIELD_NONE,
+                       0, 0, 0, 0, NULL, 0, buf, 4);
+}
+
+static void net_fill(uint16_t length)
+{
+  uint16_t idx;
+
+
+  for (idx = 0; idx < length; idx++)
+    fujinet.net[idx] = idx * 7;
+  fujinet.net_len = length;
+  fujinet.net_pos = 0;
+  return;
+}
+
+int main(void)
+{
+  double start;
+  uint16_t length;
+  uint8_t tag;
+
+
+  // A byte lost from a sector: short frame, resync, sent again
+  harness_start(0, false);
+  line.drop_at = 300;
+  CHECK(sector_read(5));
+  CHECK(!memcmp(buf, &fujinet.disk[5 * SECTOR], SECTOR));
+  CHECK(fujicom_stats.bad_frames == 1 && fujicom_stats.retries == 1);
+  CHECK(fujinet.commands[FUJICMD_READ] == 2);
+  printf("lost byte, disk READ: %.0f ms\n", harness_ms());
+
+  // A damaged byte fails the checksum and goes the same way
+  harness_start(0, false);
+  line.corrupt_at = 100;
+  CHECK(sector_read(6));
+  CHECK(!memcmp(buf, &fujinet.disk[6 * SECTOR], SECTOR));
+  CHECK(fujicom_stats.bad_frames == 1 && fujicom_stats.retries == 1);
+
+  // No reply at all: a disk READ gives up after TIMEOUT_SHORT
+  harness_start(0, false);
+  fujinet.silent = 1;
+  CHECK(sector_read(7));
+  CHECK(fujicom_stats.timeouts == 1 && fujicom_stats.retries == 1);
+  printf("silent once, disk READ: %.0f ms\n", harness_ms());
+  CHECK(harness_ms() > 1900 && harness_ms() < 3000);
+
+  // Every try lost: the command is sent 1 + FUJI_RETRIES times
+  harness_start(0, false);
+  fujinet.silent = 10;
+  CHECK(!sector_read(8));
+  CHECK(fujicom_stats.timeouts == 3 && fujicom_stats.retries == 2
+        && fujicom_stats.failures == 1);
+
+  // Network commands wait TIMEOUT_SLOW and aren't sent again, the
+  // server may already have acted on them
+  harness_start(0, false);
+  net_fill(100);
+  fujinet.silent = 1;
+  start = harness_ms();
+  CHECK(!net_status());
+  printf("silent once, network STATUS: %.0f ms\n", harness_ms() - start);
+  CHECK(harness_ms() - start > 14900 && harness_ms() - start < 16000);
+  CHECK(fujicom_stats.retries == 0 && fujicom_stats.failures == 1);
+
+  harness_start(0, false);
+  net_fill(100);
+line.drop_at = 20;
+  CHECK(!net_read(50));
+  CHECK(fujicom_stats.retries == 0 && fujicom_stats.failures == 1);
+  CHECK(fujinet.commands[FUJICMD_READ] == 1);
+
+  // A NAK means the FujiNet didn't act on it, so even a network READ
+  // is sent again
+  harness_start(0, false);
+  net_fill(100);
+  fujinet.nak = 1;
+  CHECK(net_read(50));
+  CHECK(!memcmp(buf, fujinet.net, 50));
+  CHECK(fujicom_stats.naks == 1 && fujicom_stats.retries == 1);
+  CHECK(fujinet.commands[FUJICMD_READ] == 1);
+
+  // The line is usable straight after a resync
+  harness_start(0, false);
+  line.drop_at = 10;
+  CHECK(sector_read(9));
+  CHECK(sector_read(10));
+  CHECK(!memcmp(buf, &fujinet.disk[10 * SECTOR], SECTOR));
+  CHECK(fujicom_stats.retries == 1 && !fujicom_stats.failures);
+
+  // Polled receive never tags, even with the FujiNet agreeing to it
+  harness_start(FUJI_CAP_TAGGED, false);
+  CHECK(fujicom_caps & FUJI_CAP_TAGGED);
+  CHECK(!fuji_bus_submit(DISK, FUJICMD_READ, FUJI_FIELD_C1234, 1, 0, 0, 0,
+                         NULL, 0, NULL, 0, buf, SECTOR));
+  CHECK(wire_read(0, 20, 4, sectors) == 4);
+  CHECK(!memcmp(sectors, &fujinet.disk[20 * SECTOR], sizeof(sectors)));
+  CHECK(fujinet.frames == 4 && !fujicom_stats.failures);
+
+  // A lost tagged sector is given up on after the sector's own
+  // timeout when the next call needs the line, not the longest one
+  harness_start(FUJI_CAP_TAGGED, true);
+  fujinet.silent = 1;
+  CHECK(fuji_bus_submit(DISK, FUJICMD_READ, FUJI_FIELD_C1234, 1, 0, 0, 0,
+                        NULL, 0, NULL, 0, sectors, SECTOR));
+  CHECK(sector_read(2));
+  CHECK(!memcmp(buf, &fujinet.disk[2 * SECTOR], SECTOR));
+  printf("lost tagged disk READ, settled in: %.0f ms\n", harness_ms());
+  CHECK(harness_ms() < 3000);
+
+  // A reply INT F5 lets an async request leave in the ring can sit
+  // there without being collected, even if every byte is escaped
+  harness_start(FUJI_CAP_TAGGED, true);
+  length = 1;
+  while (fuji_bus_reply_wire(0, length + 1) < PORT_RX_RING)
+    length++;
+  printf("async replies fit the ring up to %u bytes\n", length);
+  CHECK(length >= 100);
+  net_fill(length);
+  memset(fujinet.net, 0xC0, length);
+  tag = fuji_bus_submit(NET, FUJICMD_READ, FUJI_FIELD_A1_A2, length, 0, 0, 0,
+                        NULL, 0, NULL, 0, buf, length);
+  CHECK(tag);
+  line_advance(1000000000ULL);
+  CHECK(!line.overruns);
+  CHECK(fuji_bus_wait(tag));
+  CHECK(!memcmp(buf, fujinet.net, length));
+
+  return harness_done("fujicom");
+}
@@ -0,0 +1,327 @@
+/**
+ * fujifs against an INT F5 stand-in
+ *
+ * fujiF5w is answered here, in place of the driver and the FujiNet,
+ * by a share with one directory of files. Every call is counted as a
+ * round trip and charged the turnaround plus its bytes at 115200 bps,
+ * which is what fnshare waits for when DOS opens or reads a file. The
+ * INT F5 vector points either past the driver signature or at an
+ * older driver without one, which takes driver queries for a command
+ * and times out. Reads of the listing can be made to fail partway
+ * through.
+ */
+
+#include "harness.h"
+#include "fujifs.h"
+#include <fuji_f5.h>
+#include <dos.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FILES           100
+#define TURNAROUND_US   2000
+#define BYTE_US         87
+#define BIOS_TICK_ADDR  0x46C
+#define TICK_US         54925
+#define TIMEOUT_US      15000000
+
+typedef struct {
+  char path[64];
+  uint8_t *data;
+  uint32_t length, pos;
+} share_channel;
+
+static share_channel channels[FUJI_DEVICEID_NETWORK_LAST - FUJI_DEVICEID_NETWORK + 1];
+static char listing[FILES * 48];
+static uint32_t listing_len, listing_fail;   // Reads past this fail, 0 for none
+static uint8_t contents[4096];
+
+static uint32_t calls, commands[256], queries;
+static uint64_t clock_us;
+
+// What sits in front of the INT F5 handler
+static char new_driver[16] = FUJIDRV_SIGNATURE;
+static char old_driver[16];
+
+static void share_reset(void)
+{
+  memset(channels, 0, sizeof(channels));
+  memset(commands, 0, sizeof(commands));
+  calls = 0;
+  clock_us = 0;
+  memset(&host_mem[BIOS_TICK_ADDR], 0, 4);
+  return;
+}
+
+static void share_advance(uint64_t us)
+{
+  uint32_t ticks;
+
+
+  clock_us += us;
+  ticks = clock_us / TICK_US;
+  memcpy(&host_mem[BIOS_TICK_ADDR], &ticks, sizeof(ticks));
+  return;
+}
+
+static uint8_t share_open(share_channel *chan, const char *path)
+{
+  const char *name;
+  uint32_t idx;
+
+
+  strncpy(chan->path, path, sizeof(chan->path) - 1);
+  chan->pos = 0;
+  name = strrchr(path, '/');
+  if (name && !strcasecmp(name, "/BIG.DAT")) {
+    chan->data = contents;
+    chan->length = sizeof(contents);
+    return NETWORK_SUCCESS;
+  }
+  if (!name || !strcmp(name, "/.") || !name[1]) {
+    chan->data = (uint8_t *) listing;
+    chan->length = listing_len;
+    return NETWORK_SUCCESS;
+  }
+  for (idx = 0; idx < FILES; idx++) {
+    char want[16];
+
+
+    snprintf(want, sizeof(want), "/FILE%04u.TXT", idx);
+    if (!strcasecmp(name, want)) {
+      chan->data = contents;
+      chan->length = 100 + idx;
+      return NETWORK_SUCCESS;
+    }
+  }
+  chan->data = NULL;
+  chan->length = 0;
+  return NETWORK_ERROR_FILE_NOT_FOUND;
+}
+
+static bool share_fails(share_channel *chan, uint32_t count)
+{
+  return listing_fail && chan->data == (uint8_t *) listing
+    && chan->pos + count > listing_fail;
+}
+
+static void share_status(share_channel *chan, uint8_t *buf, uint8_t errcode)
+{
+  uint32_t left = chan->length - chan->pos;
+
+
+  if (left > 0xFFFF)
+    left = 0xFFFF;
+  buf[0] = left & 0xFF;
+  buf[1] = left >> 8;
+  buf[2] = 1;
+  buf[3] = errcode ? errcode : left ? NETWORK_SUCCESS : NETWORK_ERROR_END_OF_FILE;
+  return;
+}
+
+int fujiF5w(uint16_t descrdir, uint16_t devcom, uint16_t aux12, uint16_t aux34,
+            void *buffer, uint16_t length)
+{
+  uint8_t device = devcom & 0xFF, command = devcom >> 8, *buf = buffer;
+  share_channel *chan;
+  uint16_t count;
+
+
+  if ((descrdir & 0xFF) == FUJIINT_DRIVER) {
+    queries++;
+    if (host_vectors[FUJINET_INT] == &old_driver[8]) {
+      share_advance(TIMEOUT_US);
+      return REPLY_ERROR;
+    }
+    if (command != FUJIDRV_CAPS_GET)
+      return REPLY_ERROR;
+    count = FUJI_CAP_READ_STATUS;
+    memcpy(buffer, &count, length < sizeof(count) ? length : sizeof(count));
+    return REPLY_COMPLETE;
+  }
+
+  calls++;
+  commands[command]++;
+  share_advance(TURNAROUND_US + (uint64_t) (8 + length) * BYTE_US);
+  if (device < FUJI_DEVICEID_NETWORK || device > FUJI_DEVICEID_NETWORK_LAST)
+    return REPLY_ERROR;
+  chan = &channels[device - FUJI_DEVICEID_NETWORK];
+
+  switch (command) {
+  case FUJICMD_OPEN:
+    share_open(chan, (const char *) buf);
+    return REPLY_COMPLETE;
+
+  case FUJICMD_STATUS:
+    if (length < 4)
+      return REPLY_ERROR;
+    share_status(chan, buf, chan->data ? 0 : NETWORK_ERROR_FILE_NOT_FOUND);
+    return REPLY_COMPLETE;
+
+  case FUJICMD_READ:
+    if (aux12 > chan->length - chan->pos || aux12 > length || share_fails(chan, aux12))
+      return REPLY_ERROR;
+    memcpy(buf, &chan->data[chan->pos], aux12);
+    chan->pos += aux12;
+    return REPLY_COMPLETE;
+
+  case FUJICMD_READ_STATUS:
+    if (length < 4)
+      return REPLY_ERROR;
+    count = chan->length - chan->pos;
+    if (count > aux12)
+      count = aux12;
+    if (count > length - 4)
+      count = length - 4;
+    if (share_fails(chan, count))
+      return REPLY_ERROR;
+    memcpy(&buf[4], &chan->data[chan->pos], count);
+    chan->pos += count;
+    share_status(chan, buf, 0);
+    // The status counts what was still waiting before this read
+    buf[0] = (chan->length - chan->pos + count) & 0xFF;
+    buf[1] = (chan->length - chan->pos + count) >> 8;
+    return REPLY_COMPLETE;
+
+  case FUJICMD_GETCWD:
+    strncpy((char *) buf, "N:TNFS://share/", length);
+    return REPLY_COMPLETE;
+
+  case FUJICMD_CLOSE:
+    chan->data = NULL;
+    return REPLY_COMPLETE;
+  }
+  return REPLY_COMPLETE;
+}
+
+static void make_share(void)
+{
+  uint32_t idx;
+
+
+  listing_len = 0;
+  for (idx = 0; idx < FILES; idx++)
+    listing_len += sprintf(&listing[listing_len], "FILE%04u TXT %u 01-02-24 03:30p\r\n",
+                           idx, 100 + idx);
+  for (idx = 0; idx < sizeof(contents); idx++)
+    contents[idx] = idx * 7;
+  return;
+}
+
+/* Look up every file the way fnshare does before it opens one */
+static double open_all(fujifs_handle host)
+{
+  FN_DIRENT entry;
+  char path[32];
+  uint32_t idx;
+  uint64_t start = clock_us;
+
+
+  for (idx = 0; idx < FILES; idx++) {
+    snprintf(path, sizeof(path), "/FILE%04u.TXT", idx);
+    CHECK(!fujifs_stat(host, path, &entry));
+    CHECK(entry.size == 100 + idx && !entry.isdir);
+  }
+  return (clock_us - start) / 1000.0;
+}
+
+static uint8_t pool[512 * 22];
+static uint8_t buf[1024];
+
+/* Round trips one fujifs_read takes */
+static uint32_t read_trips(fujifs_handle handle, uint16_t length, size_t expect,
+                           const uint8_t *data)
+{
+  uint32_t start = calls;
+
+
+  CHECK(fujifs_read(handle, buf, length) == expect);
+  CHECK(!memcmp(buf, data, expect));
+  return calls - start;
+}
+
+int main(void)
+{
+  fujifs_handle host, file;
+  FN_DIRENT entry;
+  uint32_t trips;
+  double cold_ms, cached_ms;
+
+
+  make_share();
+  share_reset();
+  host_vectors[FUJINET_INT] = &new_driver[8];
+  CHECK(!fujifs_open_url(&host, "TNFS://share/", NULL, NULL));
+  CHECK(queries == 1);
+
+  // Every lookup reads the whole listing without a pool
+  CHECK(!fujifs_dircache(NULL, 0));
+  trips = calls;
+  cold_ms = open_all(host);
+  trips = calls - trips;
+  printf("%u lookups, no directory cache: %7.1f ms in %u round trips\n",
+         FILES, cold_ms, trips);
+
+  CHECK(fujifs_dircache(pool, sizeof(pool)) >= FILES);
+  trips = calls;
+  cached_ms = open_all(host);
+  trips = calls - trips;
+  printf("%u lookups, directory cache:    %7.1f ms in %u round trips\n",
+         FILES, cached_ms, trips);
+  CHECK(cached_ms * 10 < cold_ms);
+
+  // Misses are answered from the listing too
+  trips = calls;
+  CHECK(fujifs_stat(host, "/NOSUCH.TXT", &entry) == NETWORK_ERROR_FILE_NOT_FOUND);
+  CHECK(calls - trips <= 1);
+
+  // Listings expire
+  share_advance(6 * 1000000);
+  trips = calls;
+  CHECK(!fujifs_stat(host, "/FILE0001.TXT", &entry));
+  CHECK(calls - trips > 2);
+
+  // A listing cut short isn't kept and doesn't say a name is missing
+  share_advance(6 * 1000000);
+  listing_fail = listing_len / 2;
+  CHECK(fujifs_stat(host, "/FILE0099.TXT", &entry) == NETWORK_ERROR_SERVICE_NOT_AVAILABLE);
+  trips = calls;
+  CHECK(!fujifs_stat(host, "/FILE0001.TXT", &entry));
+  CHECK(entry.size == 101 && !strcmp(entry.name, "FILE0001.TXT"));
+  CHECK(calls - trips > 2);
+  listing_fail = 0;
+  CHECK(!fujifs_stat(host, "/FILE0099.TXT", &entry));
+  CHECK(entry.size == 199 && !strcmp(entry.name, "FILE0099.TXT"));
+  trips = calls;
+  CHECK(!fujifs_stat(host, "/FILE0001.TXT", &entry));
+  CHECK(calls == trips);
+
+  // READ_STATUS brings a small read in with its status in one trip
+  CHECK(!fujifs_open(host, &file, "/FILE0099.TXT", FUJIFS_READ));
+  memset(commands, 0, sizeof(commands));
+  CHECK(read_trips(file, 256, 199, contents) == 1);
+  CHECK(commands[FUJICMD_READ_STATUS] == 1 && !commands[FUJICMD_READ]);
+  CHECK(read_trips(file, 256, 0, contents) == 1);
+  fujifs_close(file);
+
+  // A big one leaves room for the status and comes up short, the rest
+  // is known to be waiting and follows in one trip
+  CHECK(!fujifs_open(host, &file, "/BIG.DAT", FUJIFS_READ));
+  CHECK(read_trips(file, 1024, 1020, contents) == 1);
+  CHECK(read_trips(file, 1024, 1024, &contents[1020]) == 1);
+  fujifs_close(file);
+
+  // An older driver is never asked, it would hang for its timeout
+  share_reset();
+  queries = 0;
+  host_vectors[FUJINET_INT] = &old_driver[8];
+  CHECK(!fujifs_open_url(&host, "TNFS://share/", NULL, NULL));
+  CHECK(!queries && clock_us < TIMEOUT_US);
+  CHECK(!fujifs_open(host, &file, "/FILE0099.TXT", FUJIFS_READ));
+  CHECK(read_trips(file, 256, 199, contents) == 2);
+  CHECK(!commands[FUJICMD_READ_STATUS]);
+  fujifs_close(file);
+
+  return harness_done("fujifs");
+}
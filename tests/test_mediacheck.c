@@ -0,0 +1,88 @@
+/**
+ * Media checks against the FujiNet stand-in
+ *
+ * DOS sends Media_check_cmd before nearly every directory operation.
+ * An answer stays good for media_check_ticks, after that one refresh
+ * goes on the wire: FUJICMD_GET_MEDIA_STATE where it was agreed,
+ * FUJICMD_STATUS and FUJICMD_READ_DEVICE_SLOTS otherwise.
+ */
+
+#include "harness.h"
+#include "commands.h"
+#include "fujicom.h"
+#include <fuji_f5.h>
+#include <string.h>
+
+#define CHECKS          50
+#define WINDOW          18      // About a second of BIOS ticks
+#define TICK_NS         54925000ULL
+
+static SYSREQ req;
+
+static uint8_t media_check(uint8_t unit)
+{
+  memset(&req, 0, sizeof(req));
+  req.unit = unit;
+  CHECK(Media_check_cmd(&req) == OP_COMPLETE);
+  return req.media.return_info;
+}
+
+/* A burst of checks the way a DIR makes them, a tick apart, all inside
+ * one window. Returns the frames it took. */
+static uint32_t burst(uint8_t expect)
+{
+  uint32_t frames = fujinet.frames, idx;
+
+
+  for (idx = 0; idx < CHECKS; idx++) {
+    CHECK(media_check(0) == expect);
+    line_advance(TICK_NS * (WINDOW - 2) / CHECKS);
+  }
+  return fujinet.frames - frames;
+}
+
+int main(void)
+{
+  uint32_t frames;
+
+
+  media_check_ticks = WINDOW;
+
+  harness_start(FUJI_CAP_MEDIA_STATE, false);
+  fujinet.mount_time = 1000;
+  CHECK(fujicom_caps == FUJI_CAP_MEDIA_STATE);
+
+  // The first check finds the image, everything after it in the window
+  // is answered without the wire
+  CHECK(media_check(0) == (uint8_t) -1);
+  CHECK(fujinet.frames == 1 && fujinet.commands[FUJICMD_GET_MEDIA_STATE] == 1);
+  frames = burst(1);
+  CHECK(!frames);
+  CHECK(media_check(1) == 0);
+  CHECK(fujinet.frames == 1);
+
+  // A change inside the window isn't seen until it runs out, then it is
+  // reported once
+  fujinet.mount_time = 2000;
+  CHECK(media_check(0) == 1);
+  line_advance(TICK_NS * WINDOW);
+  CHECK(media_check(0) == (uint8_t) -1);
+  CHECK(media_check(0) == 1);
+  CHECK(fujinet.frames == 2 && fujinet.commands[FUJICMD_GET_MEDIA_STATE] == 2);
+  CHECK(!fujinet.commands[FUJICMD_STATUS] && !fujinet.commands[FUJICMD_READ_DEVICE_SLOTS]);
+  printf("media state:         %u frames for %u checks\n", fujinet.frames, CHECKS + 5);
+
+  // Without the capability a refresh takes two round trips
+  harness_start(0, false);
+  fujinet.mount_time = 2000;
+  line_advance(TICK_NS * WINDOW);
+  CHECK(media_check(0) == 1);
+  CHECK(fujinet.frames == 2);
+  CHECK(fujinet.commands[FUJICMD_STATUS] == 1 && fujinet.commands[FUJICMD_READ_DEVICE_SLOTS] == 1);
+  CHECK(!fujinet.commands[FUJICMD_GET_MEDIA_STATE]);
+  CHECK(!burst(1));
+  printf("status+device slots: %u frames for %u checks\n", fujinet.frames, CHECKS + 1);
+
+  CHECK(!fujicom_stats.retries && !fujicom_stats.failures);
+  return harness_done("mediacheck");
+}
@@ -0,0 +1,157 @@
+/**
+ * fujiprn's auto-flush against the FujiNet stand-in
+ *
+ * The printer driver's INT 08h hook runs ahead of the BIOS and its EOI,
+ * while the receive IRQ can't get in. fujiF5w is answered here the way
+ * fujinet.sys answers it: driver queries without the bus, commands
+ * through fuji_bus_call receiving through the ring like port_rx_isr. A
+ * command made from inside the hook would never see its reply.
+ */
+
+#include "harness.h"
+#include "../printer/commands.h"
+#include "fujicom.h"
+#include <fuji_f5.h>
+#include <dos.h>
+#include <string.h>
+
+#define TICK_NS         54925000ULL
+#define FLUSH_TICKS     (18 * 5)
+
+// Called from iwrap.asm
+extern void timer_tick(void);
+
+// What iwrap.asm holds
+uint16_t old_timer_off, old_timer_seg, old_idle_off, old_idle_seg;
+
+void timer_vect(void)
+{
+  return;
+}
+
+void idle_vect(void)
+{
+  return;
+}
+
+void defer_vect(void)
+{
+  idle_flush();
+  return;
+}
+
+// What sits in front of the INT F5 handler
+static char new_driver[16] = FUJIDRV_SIGNATURE;
+static char old_driver[16];
+
+static bool in_irq0;
+static uint32_t irq0_calls, deferred;
+
+int intdos(union REGS *in, union REGS *out)
+{
+  // DOS 6.22
+  out->h.al = 6;
+  out->h.ah = 22;
+  return 0;
+}
+
+int fujiF5w(uint16_t descrdir, uint16_t devcom, uint16_t aux12, uint16_t aux34,
+            void *buffer, uint16_t length)
+{
+  uint8_t device = devcom & 0xFF, command = devcom >> 8;
+
+
+  if ((descrdir & 0xFF) == FUJIINT_DRIVER) {
+    if (command != FUJIDRV_BUS_DEFER)
+      return REPLY_ERROR;
+    // The far pointer doesn't survive the host, it can only be defer_vect
+    deferred++;
+    return fuji_bus_defer(defer_vect) ? REPLY_COMPLETE : REPLY_ERROR;
+  }
+
+  if (in_irq0) {
+    irq0_calls++;
+    return REPLY_ERROR;
+  }
+  if (fuji_bus_busy)
+    return REPLY_BUSY;
+  return fuji_bus_call(device, command, descrdir >> 8,
+                       aux12 & 0xFF, aux12 >> 8, aux34 & 0xFF, aux34 >> 8,
+                       buffer, length, NULL, 0) ? REPLY_COMPLETE : REPLY_ERROR;
+}
+
+/* One BIOS tick: fujiprn's hook, the BIOS and its EOI, then the
+ * background tick in fujinet.sys */
+static void tick(void)
+{
+  in_irq0 = true;
+  timer_tick();
+  in_irq0 = false;
+  line_advance(TICK_NS);
+  if (!fuji_bus_busy)
+    fuji_bus_run_deferred();
+  return;
+}
+
+static void print(const char *text)
+{
+  for (; *text; text++)
+    CHECK(prn_buf_add(*text));
+  return;
+}
+
+/* Ticks until the printer has been sent length bytes, or limit */
+static uint32_t ticks_until(uint16_t length, uint32_t limit)
+{
+  uint32_t ticks;
+
+
+  for (ticks = 0; ticks < limit && fujinet.printed_len < length; ticks++)
+    tick();
+  return ticks;
+}
+
+int main(void)
+{
+  static const char first[] = "HELLO, PRINTER\r\n", second[] = "PAGE 2\f";
+  uint32_t ticks;
+
+
+  harness_start(FUJI_CAP_TAGGED, true);
+  host_vectors[FUJINET_INT] = &new_driver[8];
+  install_timer_handler();
+
+  // Held until the printer has been quiet for five seconds, then sent
+  // from fujinet.sys's tick and not from inside IRQ0
+  print(first);
+  CHECK(!fujinet.printed_len);
+  ticks = ticks_until(sizeof(first) - 1, FLUSH_TICKS * 2);
+  printf("auto-flush after %u ticks, %u bus calls in IRQ0\n", ticks, irq0_calls);
+  CHECK(ticks >= FLUSH_TICKS && ticks <= FLUSH_TICKS + 2);
+  CHECK(!irq0_calls && deferred == 1);
+  CHECK(fujinet.printed_len == sizeof(first) - 1
+        && !memcmp(fujinet.printed, first, sizeof(first) - 1));
+
+  // While fujinet.sys has the bus the flush waits for it
+  print(second);
+  fuji_bus_busy = 1;
+  ticks_until(fujinet.printed_len + 1, FLUSH_TICKS + 10);
+  CHECK(fujinet.printed_len == sizeof(first) - 1);
+  fuji_bus_busy = 0;
+  tick();
+  CHECK(!irq0_calls && deferred == 2);
+  CHECK(fujinet.printed_len == sizeof(first) + sizeof(second) - 2
+        && !memcmp(&fujinet.printed[sizeof(first) - 1], second, sizeof(second) - 1));
+
+  // An older fujinet.sys isn't asked, INT 28h flushes instead
+  host_vectors[FUJINET_INT] = &old_driver[8];
+  install_timer_handler();
+  print(first);
+  ticks_until(fujinet.printed_len + 1, FLUSH_TICKS + 10);
+  CHECK(!irq0_calls && deferred == 2);
+  CHECK(fujinet.printed_len == sizeof(first) + sizeof(second) - 2);
+  idle_flush();
+  CHECK(fujinet.printed_len == 2 * sizeof(first) + sizeof(second) - 3);
+
+  return harness_done("printer");
+}